@@ -1,14 +1,37 @@
 #include "runtime/ebl.hpp"
 #include "runtime/listBuilder.hpp"
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <unistd.h>
 
 using namespace ebl;
 
-static struct {
-    const char* name_;
-    const char* docstring_;
-    size_t argc_;
-    ebl::CFunction impl_;
-} exports[] = {
+// The result of running code in ctx, printed to a string in env.
+static ValuePtr runIn(Environment& env, Context& ctx, const Arguments& args)
+{
+    auto& other = ctx.topLevel();
+    std::stringstream result;
+    print(other, other.exec(checkedCast<String>(args[1])->toAscii()), result,
+          true);
+    return env.create<String>(result.str());
+}
+
+// Runs script in a new context, and writes the context to image.
+static void writeImage(const std::string& image, const std::string& script)
+{
+    std::ifstream file(script);
+    if (not file) {
+        throw std::runtime_error("failed to load \'" + script + '\'');
+    }
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    Context ctx;
+    ctx.topLevel().exec(buffer.str());
+    ctx.writeToFile(image);
+}
+
+static const NativeFunction exports[] = {
      {"addr", "(addr obj) -> address of obj", 1,
       [](Environment& env, const Arguments& args) -> ValuePtr {
           return env.create<RawPointer>(args[0].handle());
@@ -33,6 +56,68 @@ static struct {
               env.create<Integer>((Integer::Rep)stat.used_),
               env.create<Integer>((Integer::Rep)stat.remaining_));
       }},
+     {"gc-stats", "(gc-stats) -> (collections nursery-collections "
+      "total-pause-us max-pause-us mark-us compact-us fixup-us "
+      "mark-slices)", 0,
+      [](Environment& env, const Arguments&) -> ValuePtr {
+          using namespace std::chrono;
+          const auto& stat = env.getContext()->gcStat();
+          const Integer::Rep fields[] = {
+              Integer::Rep(stat.collections_),
+              Integer::Rep(stat.nurseryCollections_),
+              Integer::Rep(duration_cast<microseconds>(stat.totalPause_).count()),
+              Integer::Rep(duration_cast<microseconds>(stat.maxPause_).count()),
+              Integer::Rep(duration_cast<microseconds>(stat.markTime_).count()),
+              Integer::Rep(duration_cast<microseconds>(stat.compactTime_).count()),
+              Integer::Rep(duration_cast<microseconds>(stat.fixupTime_).count()),
+              Integer::Rep(stat.markSlices_)};
+          LazyListBuilder builder(env);
+          for (auto field : fields) {
+              builder.pushBack(env.create<Integer>(field));
+          }
+          return builder.result();
+      }},
+     {"write-image", "(write-image image script) -> run script in a new "
+      "context, and write the context to image", 2,
+      [](Environment& env, const Arguments& args) -> ValuePtr {
+          writeImage(checkedCast<String>(args[0])->toAscii(),
+                     checkedCast<String>(args[1])->toAscii());
+          return env.getNull();
+      }},
+     {"with-image", "(with-image script callback) -> result of invoking "
+      "callback on a temporary image written from script", 2,
+      [](Environment& env, const Arguments& args) -> ValuePtr {
+          char image[] = "/tmp/ebl-image-XXXXXX";
+          const int fd = mkstemp(image);
+          if (fd == -1) {
+              throw std::runtime_error("failed to create a temporary image");
+          }
+          close(fd);
+          struct Remove {
+              const char* image_;
+              ~Remove() { std::remove(image_); }
+          } removal{image};
+          writeImage(image, checkedCast<String>(args[0])->toAscii());
+          Arguments callbackArgs(env);
+          callbackArgs.push(env.create<String>(std::string(image)));
+          return checkedCast<Function>(args[1])->call(callbackArgs);
+      }},
+     {"run-image", "(run-image image code) -> load image into a new context, "
+      "and print the result of running code there to a string", 2,
+      [](Environment& env, const Arguments& args) -> ValuePtr {
+          Context ctx;
+          ctx.loadFromFile(checkedCast<String>(args[0])->toAscii());
+          return runIn(env, ctx, args);
+      }},
+     {"boot-image", "(boot-image image code) -> boot a new context from "
+      "image, and print the result of running code there to a string", 2,
+      [](Environment& env, const Arguments& args) -> ValuePtr {
+          const auto image = checkedCast<String>(args[0])->toAscii();
+          auto config = Context::defaultConfig();
+          config.image_ = image.c_str();
+          Context ctx(config);
+          return runIn(env, ctx, args);
+      }},
      {"sizeof", "(sizeof obj) -> number of bytes that obj occupies in memory", 1,
       [](Environment& env, const Arguments& args) -> ValuePtr {
           return env.create<Integer>(Integer::Rep(typeInfo(args[0]).size_));
@@ -42,10 +127,6 @@ static struct {
 extern "C" {
 void __dllMain(ebl::Environment& env)
 {
-    for (const auto& exp : exports) {
-        auto doc = env.create<ebl::String>(exp.docstring_, strlen(exp.docstring_));
-        env.setGlobal(exp.name_, "debug",
-                      env.create<ebl::Function>(doc, exp.argc_, exp.impl_));
-    }
+    env.setGlobals("debug", exports);
 }
 }
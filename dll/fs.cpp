@@ -6,13 +6,8 @@
 // runtime.
 #include <stdio.h>
 
-static struct {
-    const char* name_;
-    size_t argc_;
-    const char* docstring_;
-    ebl::CFunction impl_;
-} exports[] = {
-     {"open", 3, "(open filename mode callback) -> result of invoking callback on opened file",
+static const ebl::NativeFunction exports[] = {
+     {"open", "(open filename mode callback) -> result of invoking callback on opened file", 3,
      [](ebl::Environment& env, const ebl::Arguments& args) {
          ebl::Arguments callbackArgs(env);
          const auto fname = ebl::checkedCast<ebl::String>(args[0])->toAscii();
@@ -23,7 +18,7 @@ static struct {
          fclose(file);
          return result;
      }},
-     {"slurp", 1, "(slurp file-name) -> string containing entire file",
+     {"slurp", "(slurp file-name) -> string containing entire file", 1,
       [](ebl::Environment& env, const ebl::Arguments& args) -> ebl::ValuePtr {
           std::ifstream t(ebl::checkedCast<ebl::String>(args[0])->toAscii());
           std::stringstream buffer;
@@ -31,7 +26,7 @@ static struct {
           auto result = buffer.str();
           return env.create<ebl::String>(result.c_str(), result.length());
       }},
-    {"getline", 1, "(getline file) -> string containing next line in the file",
+    {"getline", "(getline file) -> string containing next line in the file", 1,
      [](ebl::Environment& env, const ebl::Arguments& args) -> ebl::ValuePtr {
          char* line = nullptr;
          size_t cap = 0;
@@ -48,7 +43,7 @@ static struct {
          free(line);
          return env.getNull();
      }},
-     {"write", 1, "(write file obj ...) -> write representations of objects to file",
+     {"write", "(write file obj ...) -> write representations of objects to file", 1,
       [](ebl::Environment& env, const ebl::Arguments& args) -> ebl::ValuePtr {
           auto file = ebl::checkedCast<ebl::RawPointer>(args[0])->value();
           std::stringstream format;
@@ -64,10 +59,6 @@ static struct {
 extern "C" {
 void __dllMain(ebl::Environment& env)
 {
-    for (const auto& exp : exports) {
-        auto doc = env.create<ebl::String>(exp.docstring_, strlen(exp.docstring_));
-        env.setGlobal(exp.name_, "fs",
-                      env.create<ebl::Function>(doc, exp.argc_, exp.impl_));
-    }
+    env.setGlobals("fs", exports);
 }
 }
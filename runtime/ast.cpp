@@ -12,38 +12,129 @@ namespace ast {
 thread_local Vector<StrVal*> namespacePath;
 thread_local Vector<Lambda*> currentFunction;
 
-Scope::FindResult Scope::find(const Vector<StrVal>& varNamePatterns,
-                              FrameDist traversed) const
+SymbolId SymbolTable::intern(const StrVal& name)
 {
-    for (StackLoc i = 0; i < variables_.size(); ++i) {
-        for (auto& pattern : varNamePatterns) {
-            if (variables_[i].name_ == pattern) {
-                return {{traversed, i}, this, variables_[i].isMutable_};
+    return ids_.emplace(name, ids_.size()).first->second;
+}
+
+bool SymbolTable::lookup(const StrVal& name, SymbolId& id) const
+{
+    auto found = ids_.find(name);
+    if (found == ids_.end()) {
+        return false;
+    }
+    id = found->second;
+    return true;
+}
+
+StackLoc Scope::insert(SymbolTable& symbols, const std::string& varName,
+                       bool isMutable)
+{
+    if (variables_.size() > std::numeric_limits<StackLoc>::max() or
+        frame_->frameSize_ > std::numeric_limits<StackLoc>::max()) {
+        throw std::runtime_error("Too many variables in environment");
+    }
+    const StackLoc ret = variables_.size();
+    if (not index_.emplace(symbols.intern(varName), ret).second) {
+        throw Error("redefinition of variable " + varName + " not allowed");
+    }
+    const StackLoc slot = frame_->frameSize_++;
+    variables_.push_back({varName, slot, isMutable, false, false});
+    return ret;
+}
+
+// Within a scope, the earliest defined of the matching variables wins.
+Scope::FindResult Scope::find(const Vector<SymbolId>& ids,
+                              const StrVal& varName, FrameDist traversed)
+{
+    for (Scope* scope = this; scope; scope = scope->parent_, ++traversed) {
+        const auto& index = scope->index_;
+        auto best = index.end();
+        for (auto id : ids) {
+            auto found = index.find(id);
+            if (found not_eq index.end() and
+                (best == index.end() or found->second < best->second)) {
+                best = found;
             }
         }
+        if (best not_eq index.end()) {
+            const auto& var = scope->variables_[best->second];
+            return {{traversed, var.slot_}, scope, var.isMutable_,
+                    best->second};
+        }
     }
-    if (parent_) {
-        return parent_->find(varNamePatterns, traversed + 1);
-    } else {
-        throw Error("variable " + varNamePatterns.back() +
-                    " is not visible in the current environment");
+    throw Error("variable " + varName +
+                " is not visible in the current environment");
+}
+
+Scope::FindResult Scope::find(const SymbolTable& symbols,
+                              const Vector<StrVal>& varNamePatterns,
+                              FrameDist traversed)
+{
+    Vector<SymbolId> ids;
+    SymbolId id;
+    for (auto& pattern : varNamePatterns) {
+        if (symbols.lookup(pattern, id)) {
+            ids.push_back(id);
+        }
     }
+    return find(ids, varNamePatterns.back(), traversed);
 }
 
-Scope::FindResult Scope::find(const StrVal& varNamePath,
-                              FrameDist traversed) const
+Scope::FindResult Scope::find(const SymbolTable& symbols,
+                              const StrVal& varNamePath, FrameDist traversed)
 {
-    for (StackLoc i = 0; i < variables_.size(); ++i) {
-        if (variables_[i].name_ == varNamePath) {
-            return {{traversed, i}, this, variables_[i].isMutable_};
+    Vector<SymbolId> ids;
+    SymbolId id;
+    if (symbols.lookup(varNamePath, id)) {
+        ids.push_back(id);
+    }
+    return find(ids, varNamePath, traversed);
+}
+
+
+StackLoc Lambda::capture(Scope* owner, StackLoc index, Access source)
+{
+    for (StackLoc i = 0; i < captures_.size(); ++i) {
+        if (captures_[i].owner_ == owner and captures_[i].index_ == index) {
+            return i;
+        }
+    }
+    if (captures_.size() > std::numeric_limits<uint8_t>::max()) {
+        throw std::runtime_error("too many variables captured by closure");
+    }
+    captures_.push_back({owner, index, source});
+    return captures_.size() - 1;
+}
+
+// Works out how the code currently being compiled reaches a variable. If the
+// variable belongs to the frame of an enclosing function, every function in
+// between needs to capture it too, so that it can be passed along to the
+// closures nested within.
+static Access resolve(const Scope::FindResult& found)
+{
+    auto owner = found.owner_;
+    if (owner->isTopLevel()) {
+        return {Access::Global, found.varLoc_.offset_};
+    }
+    // Outside of functions, the only frame is the enclosing top level let.
+    if (currentFunction.empty() or
+        owner->frame() == static_cast<Scope*>(currentFunction.back())) {
+        return {Access::Local, found.varLoc_.offset_};
+    }
+    size_t first = 0;
+    for (size_t i = 0; i < currentFunction.size(); ++i) {
+        if (owner->frame() == static_cast<Scope*>(currentFunction[i])) {
+            first = i + 1;
         }
     }
-    if (parent_) {
-        return parent_->find(varNamePath, traversed + 1);
-    } else {
-        throw Error("variable " + varNamePath +
-                    " is not visible in the current environment");
+    owner->captured(found.index_);
+    Access access{Access::Local, found.varLoc_.offset_};
+    for (size_t i = first; i < currentFunction.size(); ++i) {
+        access = {Access::Captured,
+                  currentFunction[i]->capture(owner, found.index_, access)};
     }
+    return access;
 }
 
 
@@ -139,11 +230,6 @@ void Set::visit(Visitor& visitor)
     visitor.visit(*this);
 }
 
-void UserValue::visit(Visitor& visitor)
-{
-    visitor.visit(*this);
-}
-
 void Namespace::init(Environment& env, Scope& scope)
 {
     if (not currentFunction.empty()) {
@@ -243,7 +329,8 @@ static void validateIdentifier(const StrVal& name)
 void LValue::init(Environment& env, Scope& scope)
 {
     const auto patterns = makeNsPatterns(name_);
-    cachedVarInfo_ = scope.find(patterns);
+    cachedVarInfo_ = scope.find(env.getContext()->symbols(), patterns);
+    cachedAccess_ = resolve(cachedVarInfo_);
 }
 
 
@@ -257,10 +344,13 @@ void Lambda::init(Environment& env, Scope& scope)
                     storeI<ebl::String>(*env.getContext(), docstring_);
             }
             Scope::setParent(&scope);
-            for (auto it = argNames_.rbegin(); it != argNames_.rend(); ++it) {
-                validateIdentifier(*it);
-                Scope::insert(*it);
+            for (const auto& name : argNames_) {
+                validateIdentifier(name);
+                Scope::setDefined(
+                    Scope::insert(env.getContext()->symbols(), name));
             }
+            // The function itself sits in the frame after its arguments.
+            Scope::reserveSlot();
             for (const auto& statement : statements_) {
                 statement->init(env, *this);
             }
@@ -281,9 +371,14 @@ void Application::init(Environment& env, Scope& scope)
 void Let::init(Environment& env, Scope& scope)
 {
     Scope::setParent(&scope);
+    if (not scope.isTopLevel()) {
+        Scope::shareFrame(scope);
+    }
+    auto& symbols = env.getContext()->symbols();
     for (const auto& binding : bindings_) {
-        Scope::insert(binding.name_);
+        const auto index = Scope::insert(symbols, binding.name_);
         binding.value_->init(env, *this);
+        Scope::setDefined(index);
     }
     for (const auto& statement : statements_) {
         statement->init(env, *this);
@@ -294,9 +389,14 @@ void Let::init(Environment& env, Scope& scope)
 void LetMut::init(Environment& env, Scope& scope)
 {
     Scope::setParent(&scope);
+    if (not scope.isTopLevel()) {
+        Scope::shareFrame(scope);
+    }
+    auto& symbols = env.getContext()->symbols();
     for (const auto& binding : bindings_) {
-        Scope::insert(binding.name_, true);
+        const auto index = Scope::insert(symbols, binding.name_, true);
         binding.value_->init(env, *this);
+        Scope::setDefined(index);
     }
     for (const auto& statement : statements_) {
         statement->init(env, *this);
@@ -359,8 +459,10 @@ void Def::init(Environment& env, Scope& scope)
         fullName += "::";
     }
     fullName += name_;
-    scope.insert(fullName);
+    cachedScope_ = &scope;
+    cachedIndex_ = scope.insert(env.getContext()->symbols(), fullName);
     value_->init(env, scope);
+    scope.setDefined(cachedIndex_);
 }
 
 
@@ -373,20 +475,22 @@ void DefMut::init(Environment& env, Scope& scope)
         fullName += "::";
     }
     fullName += name_;
-    scope.insert(fullName, true);
+    cachedScope_ = &scope;
+    cachedIndex_ = scope.insert(env.getContext()->symbols(), fullName, true);
     value_->init(env, scope);
+    scope.setDefined(cachedIndex_);
 }
 
 
 void Set::init(Environment& env, Scope& scope)
 {
     const auto patterns = makeNsPatterns(name_);
-    auto found = scope.find(patterns);
-    if (not found.isMutable_) {
+    cachedVarInfo_ = scope.find(env.getContext()->symbols(), patterns);
+    if (not cachedVarInfo_.isMutable_) {
         throw std::runtime_error("failed to rebind immutable variable " +
                                  name_);
     }
-    cachedVarLoc_ = found.varLoc_;
+    cachedAccess_ = resolve(cachedVarInfo_);
     value_->init(env, scope);
 }
 
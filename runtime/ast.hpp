@@ -6,6 +6,7 @@
 #include <limits>
 #include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 namespace ebl {
@@ -20,56 +21,149 @@ using StrVal = std::string;
 using Error = std::runtime_error;
 
 
+// Variable names are interned, so that scopes can index their variables by
+// SymbolId instead of comparing strings. Each context has its own table,
+// which its scopes share.
+class SymbolTable {
+public:
+    SymbolId intern(const StrVal& name);
+
+    // False if the name was never interned, so no scope can define it.
+    bool lookup(const StrVal& name, SymbolId& id) const;
+
+private:
+    std::unordered_map<StrVal, SymbolId> ids_;
+};
+
+
+// Functions, and let expressions outside of functions, each get a frame at
+// runtime. Any other scopes within them, like nested lets, share their
+// frame, with each variable at a fixed slot.
 class Scope {
 private:
     struct Variable {
         StrVal name_;
+        StackLoc slot_;
         bool isMutable_;
+        bool defined_;
+        bool boxed_;
     };
 
 public:
-    void setParent(Scope* parent)
+    StackLoc insert(SymbolTable& symbols, const std::string& varName,
+                    bool isMutable = false);
+
+    struct FindResult {
+        VarLoc varLoc_;
+        Scope* owner_;
+        bool isMutable_;
+        StackLoc index_;
+    };
+
+    FindResult find(const SymbolTable& symbols, const StrVal& varPath,
+                    FrameDist traversed = 0);
+
+
+    FindResult find(const SymbolTable& symbols,
+                    const Vector<StrVal>& varNamePatterns,
+                    FrameDist traversed = 0);
+
+    inline void setParent(Scope* parent)
     {
         parent_ = parent;
     }
 
+    inline Scope* getParent() const
+    {
+        return parent_;
+    }
 
-    inline StackLoc insert(const std::string& varName, bool isMutable = false)
+    // Joins the frame of the scope that encloses this one, rather than
+    // getting a frame of its own.
+    inline void shareFrame(Scope& enclosing)
     {
-        if (variables_.size() > std::numeric_limits<StackLoc>::max()) {
-            throw std::runtime_error("Too many variables in environment");
-        }
-        const StackLoc ret = variables_.size();
-        for (const auto& var : variables_) {
-            if (var.name_ == varName) {
-                throw Error("redefinition of variable " + varName +
-                            " not allowed");
-            }
-        }
-        variables_.push_back({varName, isMutable});
-        return ret;
+        frame_ = enclosing.frame_;
     }
 
-    struct FindResult {
-        VarLoc varLoc_;
-        const Scope* owner_;
-        bool isMutable_;
-    };
+    inline Scope* frame() const
+    {
+        return frame_;
+    }
 
-    FindResult find(const StrVal& varPath, FrameDist traversed = 0) const;
+    inline bool isFrame() const
+    {
+        return frame_ == this;
+    }
 
+    inline bool isTopLevel() const
+    {
+        return frame_->parent_ == nullptr;
+    }
 
-    FindResult find(const Vector<StrVal>& varNamePatterns,
-                    FrameDist traversed = 0) const;
+    inline size_t frameSize() const
+    {
+        return frameSize_;
+    }
 
-    inline Scope* getParent() const
+    // Sets aside a slot that doesn't belong to any variable.
+    inline void reserveSlot()
     {
-        return parent_;
+        ++frameSize_;
+    }
+
+    inline const StrVal& nameOf(StackLoc index) const
+    {
+        return variables_[index].name_;
+    }
+
+    inline StackLoc slotOf(StackLoc index) const
+    {
+        return variables_[index].slot_;
+    }
+
+    inline bool isMutable(StackLoc index) const
+    {
+        return variables_[index].isMutable_;
+    }
+
+    inline size_t variableCount() const
+    {
+        return variables_.size();
+    }
+
+    // A variable is defined once its initial value has been computed.
+    // Closures created before then, i.e. within the variable's own
+    // definition, can't capture the value, and capture a box instead.
+    inline void setDefined(StackLoc index)
+    {
+        variables_[index].defined_ = true;
+    }
+
+    // Captured variables live in boxes if they might change after being
+    // captured, so that all closures share the same value.
+    void captured(StackLoc index)
+    {
+        auto& var = variables_[index];
+        if (var.isMutable_ or not var.defined_) {
+            var.boxed_ = true;
+        }
+    }
+
+    inline bool isBoxed(StackLoc index) const
+    {
+        return variables_[index].boxed_;
     }
 
 private:
+    FindResult find(const Vector<SymbolId>& ids, const StrVal& varName,
+                    FrameDist traversed);
+
     Scope* parent_ = nullptr;
+    Scope* frame_ = this;
+    size_t frameSize_ = 0;
     Vector<Variable> variables_;
+    // Each variable's index in variables_, by interned name.
+    std::unordered_map<SymbolId, StackLoc> index_;
 };
 
 
@@ -185,9 +279,20 @@ struct Namespace : Expr {
 };
 
 
+// How code reaches a variable: globals live in the top level environment,
+// locals in the current frame, and anything else was captured by the
+// enclosing function when it was created.
+struct Access {
+    enum Kind { Global, Local, Captured };
+    Kind kind_;
+    StackLoc offset_;
+};
+
+
 struct LValue : Value {
     StrVal name_;
     Scope::FindResult cachedVarInfo_;
+    Access cachedAccess_;
 
     void visit(Visitor& visitor) override;
     void init(Environment& env, Scope& scope) override;
@@ -200,6 +305,18 @@ struct Lambda : Expr, Scope {
     StrVal docstring_;
     ImmediateId cachedDocstringLoc_;
 
+    // Values copied into the closure when it's created, in order. The source
+    // is either a slot in the enclosing frame, or one of the enclosing
+    // function's own captures.
+    struct Capture {
+        Scope* owner_;
+        StackLoc index_;
+        Access source_;
+    };
+    Vector<Capture> captures_;
+
+    StackLoc capture(Scope* owner, StackLoc index, Access source);
+
     void visit(Visitor& visitor) override;
     void init(Environment& env, Scope& scope) override;
 };
@@ -289,6 +406,8 @@ struct And : Expr {
 struct Def : Expr {
     StrVal name_;
     Ptr<Statement> value_;
+    Scope* cachedScope_;
+    StackLoc cachedIndex_;
 
     void visit(Visitor& visitor) override;
     void init(Environment& env, Scope& scope) override;
@@ -302,27 +421,14 @@ struct DefMut : Def {
 struct Set : Expr {
     StrVal name_;
     Ptr<Statement> value_;
-    VarLoc cachedVarLoc_;
+    Scope::FindResult cachedVarInfo_;
+    Access cachedAccess_;
 
     void visit(Visitor& visitor) override;
     void init(Environment& env, Scope& scope) override;
 };
 
 
-// Users of the library might want to push their own data into the environment,
-// but
-struct UserValue : Statement {
-    ImmediateId varLoc_;
-
-    UserValue(ImmediateId loc) : varLoc_(loc)
-    {
-    }
-
-    void visit(Visitor& visitor) override;
-    void init(Environment& env, Scope& scope) override{};
-};
-
-
 class Visitor {
 public:
     virtual ~Visitor()
@@ -347,7 +453,6 @@ public:
     virtual void visit(And& node) = 0;
     virtual void visit(Def& node) = 0;
     virtual void visit(Set& node) = 0;
-    virtual void visit(UserValue& node) = 0;
 };
 
 } // namespace ast
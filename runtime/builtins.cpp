@@ -8,6 +8,7 @@
 #include "lexer.hpp"
 #include "ebl.hpp"
 #include "listBuilder.hpp"
+#include "operations.hpp"
 
 namespace ebl {
 
@@ -132,14 +133,7 @@ void print(Environment& env, ValuePtr val, std::ostream& out,
     }
 }
 
-struct BuiltinFunctionInfo {
-    const char* name;
-    const char* docstring;
-    size_t requiredArgs;
-    CFunction impl;
-};
-
-static const BuiltinFunctionInfo builtins[] =
+static const NativeFunction builtins[] =
     {{"cons", "(cons car cdr) -> create a pair from car and cdr", 2,
       [](Environment& env, const Arguments& args) -> ValuePtr {
           return env.create<Pair>(args[0], args[1]);
@@ -194,12 +188,12 @@ static const BuiltinFunctionInfo builtins[] =
           }
       }},
      {"get", "(get val index) -> get element at index in list or string", 2,
-      [](Environment&, const Arguments& args) -> ValuePtr {
+      [](Environment& env, const Arguments& args) -> ValuePtr {
           switch (args[0]->typeId()) {
           case typeId<String>():
-              return (
-                  *args[0]
-                       .cast<String>())[checkedCast<Integer>(args[1])->value()];
+              return (*args[0].cast<String>())[checkedCast<Integer>(args[1])
+                                                   ->value()]
+                  ->clone(env);
 
           case typeId<Pair>():
               return listRef(args[0].cast<Pair>(),
@@ -280,8 +274,12 @@ static const BuiltinFunctionInfo builtins[] =
       }},
      {"mod", "(mod integer) -> the modulus of integer", 2,
       [](Environment& env, const Arguments& args) -> ValuePtr {
-          return env.create<Integer>(checkedCast<Integer>(args[0])->value() %
-                                     checkedCast<Integer>(args[1])->value());
+          const auto divisor = checkedCast<Integer>(args[1])->value();
+          if (divisor == 0) {
+              throw std::runtime_error("mod by zero");
+          }
+          return env.create<Integer>(
+              wrappingMod(checkedCast<Integer>(args[0])->value(), divisor));
       }},
      {"f+", "(f+ f-1 f-2) -> add floats f-1 and f-2", 2,
       [](Environment& env, const Arguments& args) -> ValuePtr {
@@ -616,17 +614,7 @@ static const BuiltinFunctionInfo builtins[] =
 
 void initBuiltins(Environment& env)
 {
-    std::for_each(
-        std::begin(builtins), std::end(builtins),
-        [&](const BuiltinFunctionInfo& info) {
-            auto doc = env.getNull();
-            if (info.docstring) {
-                doc =
-                    env.create<String>(info.docstring, strlen(info.docstring));
-            }
-            auto fn = env.create<Function>(doc, info.requiredArgs, info.impl);
-            env.setGlobal(info.name, fn);
-        });
+    env.setGlobals("", builtins);
 }
 
 } // namespace ebl
@@ -4,14 +4,192 @@
 
 namespace ebl {
 
-struct FunctionContext {
-    size_t letCount_;
+size_t paramSize(Opcode op)
+{
+    switch (op) {
+    case Opcode::Call:
+    case Opcode::TailCall:
+    case Opcode::Recur:
+    case Opcode::Load0Fast:
+    case Opcode::Load1Fast:
+    case Opcode::Load0Car:
+    case Opcode::Load0Cdr:
+    case Opcode::IncrR:
+    case Opcode::DecrR:
+        return 1;
+
+    case Opcode::Jump:
+    case Opcode::JumpIfFalse:
+    case Opcode::Load0:
+    case Opcode::Load1:
+    case Opcode::LoadGlobal:
+    case Opcode::StoreGlobal:
+    case Opcode::Reserve:
+    case Opcode::PushI:
+    case Opcode::PushLambda:
+    case Opcode::PushVariadicLambda:
+    case Opcode::Load0Fast2:
+    case Opcode::JumpIfNotNull:
+    case Opcode::JumpIfNotLt:
+    case Opcode::JumpIfNotGt:
+    case Opcode::AddRR:
+    case Opcode::SubRR:
+    case Opcode::LtRR:
+    case Opcode::GtRR:
+        return 2;
+
+    case Opcode::Load0PushI:
+    case Opcode::AddRK:
+    case Opcode::SubRK:
+    case Opcode::LtRK:
+    case Opcode::GtRK:
+        return 3;
+
+    case Opcode::Load:
+    case Opcode::Rebind:
+    case Opcode::PushDocumentedLambda:
+    case Opcode::JumpIfNotLtRR:
+    case Opcode::JumpIfNotGtRR:
+        return 4;
+
+    case Opcode::JumpIfNotLtRK:
+    case Opcode::JumpIfNotGtRK:
+        return 5;
+
+    default:
+        return 0;
+    }
+}
+
+bool isJump(Opcode op)
+{
+    switch (op) {
+    case Opcode::Jump:
+    case Opcode::JumpIfFalse:
+    case Opcode::JumpIfNotNull:
+    case Opcode::JumpIfNotLt:
+    case Opcode::JumpIfNotGt:
+    case Opcode::JumpIfNotLtRR:
+    case Opcode::JumpIfNotLtRK:
+    case Opcode::JumpIfNotGtRR:
+    case Opcode::JumpIfNotGtRK:
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+// In the same order as the Opcode enum.
+static const char* const opcodeNames[] = {
+    "Exit", "Call", "Return", "Recur", "TailCall", "Jump", "JumpIfFalse",
+    "Load", "Load0", "Load1", "Load0Fast", "Load1Fast", "LoadGlobal",
+    "StoreGlobal", "Reserve", "Rebind", "PushI", "PushNull", "PushTrue",
+    "PushFalse", "PushLambda", "PushDocumentedLambda", "PushVariadicLambda",
+    "Discard", "Dup", "EnterLet", "ExitLet", "Box", "Unbox", "SetBox", "Cons",
+    "Car", "Cdr", "IsNull", "Add", "Sub", "Lt", "Gt", "Incr", "Decr", "Eq",
+    "Not", "Mod", "Load0Fast2", "Load0Car", "Load0Cdr", "Load0PushI",
+    "JumpIfNotNull", "JumpIfNotLt", "JumpIfNotGt", "AddRR", "AddRK", "SubRR",
+    "SubRK", "LtRR", "LtRK", "GtRR", "GtRK", "IncrR", "DecrR", "JumpIfNotLtRR",
+    "JumpIfNotLtRK", "JumpIfNotGtRR", "JumpIfNotGtRK"};
+
+static_assert(sizeof opcodeNames / sizeof *opcodeNames == (size_t)Opcode::Count,
+              "opcodeNames doesn't match the Opcode enum");
+
+const char* opcodeName(Opcode op)
+{
+    return opcodeNames[(size_t)op];
+}
+
+struct Superinstruction {
+    Opcode first_;
+    Opcode second_;
+    Opcode fused_;
 };
 
-thread_local std::vector<FunctionContext> fnContexts;
+// Picked from counts of the instruction pairs executed by the tests and the
+// example programs.
+static const Superinstruction superinstructions[] = {
+    {Opcode::Load0Fast, Opcode::Load0Fast, Opcode::Load0Fast2},
+    {Opcode::Load0Fast, Opcode::Car, Opcode::Load0Car},
+    {Opcode::Load0Fast, Opcode::Cdr, Opcode::Load0Cdr},
+    {Opcode::Load0Fast, Opcode::PushI, Opcode::Load0PushI},
+    {Opcode::IsNull, Opcode::JumpIfFalse, Opcode::JumpIfNotNull},
+    {Opcode::Lt, Opcode::JumpIfFalse, Opcode::JumpIfNotLt},
+    {Opcode::Gt, Opcode::JumpIfFalse, Opcode::JumpIfNotGt}};
+
+static const Superinstruction* findSuperinstruction(Opcode first,
+                                                    Opcode second)
+{
+    for (const auto& super : superinstructions) {
+        if (super.first_ == first and super.second_ == second) {
+            return &super;
+        }
+    }
+    return nullptr;
+}
+
+// Fuses pairs of instructions into superinstructions. Nothing can jump into
+// the middle of a fused pair, so pairs starting at jump targets, or at the
+// start of a function body, are left alone. Fusing shrinks the code, so
+// jumps get new offsets afterwards.
+static void fuseInstructions(Bytecode& bc)
+{
+    std::vector<size_t> starts;
+    std::vector<bool> targets(bc.size() + 1, false);
+    for (size_t ip = 0; ip < bc.size();) {
+        const auto op = (Opcode)bc[ip];
+        starts.push_back(ip);
+        ip += 1 + paramSize(op);
+        if (isJump(op)) {
+            targets[ip + *(uint16_t*)(&bc[ip - 2])] = true;
+        } else if (op == Opcode::PushLambda or
+                   op == Opcode::PushDocumentedLambda or
+                   op == Opcode::PushVariadicLambda) {
+            // The function body starts after the jump over it.
+            targets[ip + 1 + paramSize(Opcode::Jump)] = true;
+        }
+    }
+    Bytecode result;
+    result.reserve(bc.size());
+    std::vector<size_t> moved(bc.size() + 1);
+    std::vector<std::pair<size_t, size_t>> jumps;
+    for (size_t i = 0; i < starts.size(); ++i) {
+        const size_t ip = starts[i];
+        moved[ip] = result.size();
+        const Superinstruction* super = nullptr;
+        if (i + 1 < starts.size() and not targets[starts[i + 1]]) {
+            super = findSuperinstruction((Opcode)bc[ip],
+                                         (Opcode)bc[starts[i + 1]]);
+        }
+        size_t end = ip + 1 + paramSize((Opcode)bc[ip]);
+        if (super) {
+            result.push_back((uint8_t)super->fused_);
+            result.insert(result.end(), bc.begin() + ip + 1, bc.begin() + end);
+            ++i;
+            moved[starts[i]] = result.size();
+            const size_t next = starts[i];
+            end = next + 1 + paramSize((Opcode)bc[next]);
+            result.insert(result.end(), bc.begin() + next + 1,
+                          bc.begin() + end);
+        } else {
+            result.insert(result.end(), bc.begin() + ip, bc.begin() + end);
+        }
+        if (isJump((Opcode)bc[starts[i]])) {
+            jumps.push_back({result.size(), end + *(uint16_t*)(&bc[end - 2])});
+        }
+    }
+    moved[bc.size()] = result.size();
+    for (const auto& jump : jumps) {
+        *(uint16_t*)(&result[jump.first - 2]) =
+            moved[jump.second] - jump.first;
+    }
+    bc = std::move(result);
+}
 
 Bytecode BytecodeBuilder::result()
 {
+    fuseInstructions(data_);
     // Appending an Exit to the end of a sequence of expressions
     // allows new bytecode to be simply appended to old bytecode.
     data_.push_back((uint8_t)Opcode::Exit);
@@ -52,67 +230,142 @@ void BytecodeBuilder::visit(ast::False& node)
     writeOp<Opcode::PushFalse>(data_);
 }
 
-void BytecodeBuilder::visit(ast::LValue& node)
+static void writeLoad(Bytecode& bc, VarLoc varloc)
 {
-    const auto varloc = node.cachedVarInfo_.varLoc_;
     if (varloc.frameDist_ == 0) {
         if (varloc.offset_ < 256) {
-            writeOp<Opcode::Load0Fast>(data_);
-            writeParam(data_, (uint8_t)varloc.offset_);
+            writeOp<Opcode::Load0Fast>(bc);
+            writeParam(bc, (uint8_t)varloc.offset_);
         } else {
-            writeOp<Opcode::Load0>(data_);
-            writeParam(data_, varloc.offset_);
+            writeOp<Opcode::Load0>(bc);
+            writeParam(bc, varloc.offset_);
         }
     } else if (varloc.frameDist_ == 1) {
         if (varloc.offset_ < 256) {
-            writeOp<Opcode::Load1Fast>(data_);
-            writeParam(data_, (uint8_t)varloc.offset_);
+            writeOp<Opcode::Load1Fast>(bc);
+            writeParam(bc, (uint8_t)varloc.offset_);
         } else {
-            writeOp<Opcode::Load1>(data_);
-            writeParam(data_, varloc.offset_);
+            writeOp<Opcode::Load1>(bc);
+            writeParam(bc, varloc.offset_);
         }
-    } else if (varloc.frameDist_ == 2) {
-        writeOp<Opcode::Load2>(data_);
-        writeParam(data_, varloc.offset_);
     } else {
-        writeOp<Opcode::Load>(data_);
-        writeParam(data_, varloc.frameDist_);
-        writeParam(data_, varloc.offset_);
+        writeOp<Opcode::Load>(bc);
+        writeParam(bc, varloc.frameDist_);
+        writeParam(bc, varloc.offset_);
+    }
+}
+
+static void writeRebind(Bytecode& bc, VarLoc varloc)
+{
+    writeOp<Opcode::Rebind>(bc);
+    writeParam(bc, varloc.frameDist_);
+    writeParam(bc, varloc.offset_);
+}
+
+// Captured variables live in the closure, the current frame's parent.
+static VarLoc frameLocation(const ast::Access& access)
+{
+    if (access.kind_ == ast::Access::Local) {
+        return {0, access.offset_};
+    }
+    return {1, access.offset_};
+}
+
+static void writeLoad(Bytecode& bc, const ast::Access& access)
+{
+    if (access.kind_ == ast::Access::Global) {
+        writeOp<Opcode::LoadGlobal>(bc);
+        writeParam(bc, access.offset_);
+    } else {
+        writeLoad(bc, frameLocation(access));
+    }
+}
+
+static void writeStore(Bytecode& bc, const ast::Access& access)
+{
+    if (access.kind_ == ast::Access::Global) {
+        writeOp<Opcode::StoreGlobal>(bc);
+        writeParam(bc, access.offset_);
+    } else {
+        writeRebind(bc, frameLocation(access));
+    }
+}
+
+void BytecodeBuilder::visit(ast::LValue& node)
+{
+    writeLoad(data_, node.cachedAccess_);
+    const auto& info = node.cachedVarInfo_;
+    if (info.owner_->isBoxed(info.index_)) {
+        writeOp<Opcode::Unbox>(data_);
     }
 }
 
 void BytecodeBuilder::visit(ast::Set& node)
 {
     node.value_->visit(*this);
-    writeOp<Opcode::Rebind>(data_);
-    writeParam(data_, node.cachedVarLoc_.frameDist_);
-    writeParam(data_, node.cachedVarLoc_.offset_);
+    const auto& info = node.cachedVarInfo_;
+    if (info.owner_->isBoxed(info.index_)) {
+        writeLoad(data_, node.cachedAccess_);
+        writeOp<Opcode::SetBox>(data_);
+    } else {
+        writeStore(data_, node.cachedAccess_);
+    }
     writeOp<Opcode::PushNull>(data_);
 }
 
-void BytecodeBuilder::visit(ast::Lambda& node)
+// Local variables have fixed slots in the current frame. Boxed variables get
+// their box before the value is computed, as closures created along the way
+// might need to capture it.
+static void writeDefinition(BytecodeBuilder& builder, Bytecode& bc,
+                            const ast::Scope& scope, StackLoc index,
+                            ast::Statement& value)
 {
-    fnContexts.push_back({0});
-    assert(node.argNames_.size() < 256);
-    if (node.docstring_.empty()) {
-        writeOp<Opcode::PushLambda>(data_);
-        data_.push_back((uint8_t)node.argNames_.size());
+    const VarLoc varloc{0, scope.slotOf(index)};
+    if (scope.isBoxed(index)) {
+        writeOp<Opcode::PushNull>(bc);
+        writeOp<Opcode::Box>(bc);
+        writeRebind(bc, varloc);
+        value.visit(builder);
+        writeLoad(bc, varloc);
+        writeOp<Opcode::SetBox>(bc);
     } else {
-        writeOp<Opcode::PushDocumentedLambda>(data_);
-        data_.push_back((uint8_t)node.argNames_.size());
+        value.visit(builder);
+        writeRebind(bc, varloc);
+    }
+}
+
+static void writeReserve(Bytecode& bc, size_t slots)
+{
+    if (slots) {
+        writeOp<Opcode::Reserve>(bc);
+        writeParam(bc, (StackLoc)slots);
+    }
+}
+
+void BytecodeBuilder::visitLambda(ast::Lambda& node, Opcode pushOp)
+{
+    assert(node.argNames_.size() < 256);
+    for (auto& capture : node.captures_) {
+        writeLoad(data_, capture.source_);
+    }
+    data_.push_back((uint8_t)pushOp);
+    data_.push_back((uint8_t)node.argNames_.size());
+    data_.push_back((uint8_t)node.captures_.size());
+    if (pushOp == Opcode::PushDocumentedLambda) {
         writeParam(data_, node.cachedDocstringLoc_);
     }
     writeOp<Opcode::Jump>(data_);
     size_t jumpLoc = data_.size();
     writeParam(data_, (uint16_t)0);
-    for (size_t i = 0; i < node.argNames_.size(); ++i) {
-        writeOp<Opcode::Store>(data_);
-    }
+    writeReserve(data_, node.frameSize() - (node.argNames_.size() + 1));
+    ast::Statement* const enclosingTail = tail_;
+    tail_ = node.statements_.back().get();
     for (auto& statement : node.statements_) {
         statement->visit(*this);
         writeOp<Opcode::Discard>(data_);
     }
     data_.pop_back();
+    tail_ = enclosingTail;
     writeOp<Opcode::Return>(data_);
     uint16_t* jumpOffset = (uint16_t*)(&data_[jumpLoc]);
     const size_t offset = (data_.size() - 2) - jumpLoc;
@@ -120,109 +373,169 @@ void BytecodeBuilder::visit(ast::Lambda& node)
         throw std::runtime_error("jump offset exceeds allowed size");
     }
     *jumpOffset = offset;
-    fnContexts.pop_back();
 }
 
-void BytecodeBuilder::visit(ast::VariadicLambda& node)
+void BytecodeBuilder::visit(ast::Lambda& node)
 {
-    // FIXME: This is mostly a shameless copy-paste, refactor!
-    fnContexts.push_back({0});
-    assert(node.argNames_.size() < 256);
     if (node.docstring_.empty()) {
-        writeOp<Opcode::PushVariadicLambda>(data_);
-        data_.push_back((uint8_t)node.argNames_.size());
+        visitLambda(node, Opcode::PushLambda);
     } else {
+        visitLambda(node, Opcode::PushDocumentedLambda);
+    }
+}
+
+void BytecodeBuilder::visit(ast::VariadicLambda& node)
+{
+    if (not node.docstring_.empty()) {
         throw std::runtime_error("TODO: documentedVariadicLambda");
-        writeOp<Opcode::PushDocumentedLambda>(data_);
-        data_.push_back((uint8_t)node.argNames_.size());
-        writeParam(data_, node.cachedDocstringLoc_);
     }
-    writeOp<Opcode::Jump>(data_);
-    size_t jumpLoc = data_.size();
-    writeParam(data_, (uint16_t)0);
-    for (size_t i = 0; i < node.argNames_.size(); ++i) {
-        writeOp<Opcode::Store>(data_);
+    visitLambda(node, Opcode::PushVariadicLambda);
+}
+
+static const InlinedBuiltin inlinedBuiltins[] = {
+    {"cons", 2, Opcode::Cons}, {"car", 1, Opcode::Car},
+    {"cdr", 1, Opcode::Cdr},   {"null?", 1, Opcode::IsNull},
+    {"+", 2, Opcode::Add},     {"-", 2, Opcode::Sub},
+    {"<", 2, Opcode::Lt},      {">", 2, Opcode::Gt},
+    {"incr", 1, Opcode::Incr}, {"decr", 1, Opcode::Decr},
+    {"equal?", 2, Opcode::Eq}, {"not", 1, Opcode::Not},
+    {"mod", 2, Opcode::Mod}};
+
+// Builtins are the first things defined at the top level, and top level
+// variables can't be redefined, so an immutable top level binding with the
+// builtin's exact name (i.e. not one reached through a namespace) must still
+// refer to the builtin.
+const InlinedBuiltin* findInlinedBuiltin(const ast::Application& node)
+{
+    auto lval = dynamic_cast<ast::LValue*>(node.toApply_.get());
+    if (not lval) {
+        return nullptr;
     }
-    for (auto& statement : node.statements_) {
-        statement->visit(*this);
-        writeOp<Opcode::Discard>(data_);
+    const auto& info = lval->cachedVarInfo_;
+    if (not info.owner_->isTopLevel() or info.isMutable_) {
+        return nullptr;
     }
-    data_.pop_back();
-    writeOp<Opcode::Return>(data_);
-    uint16_t* jumpOffset = (uint16_t*)(&data_[jumpLoc]);
-    const size_t offset = (data_.size() - 2) - jumpLoc;
-    if (offset > std::numeric_limits<uint16_t>::max()) {
-        throw std::runtime_error("jump offset exceeds allowed size");
+    const auto& name = info.owner_->nameOf(info.index_);
+    for (const auto& builtin : inlinedBuiltins) {
+        // Other arities go through a regular call, which either handles
+        // them, for variadic builtins like +, or raises the usual error.
+        if (name == builtin.name_ and node.args_.size() == builtin.argc_) {
+            return &builtin;
+        }
     }
-    *jumpOffset = offset;
-    fnContexts.pop_back();
+    return nullptr;
+}
+
+struct RegisterForm {
+    Opcode op_;
+    Opcode rr_;
+    Opcode rk_;
+};
+
+static const RegisterForm registerForms[] = {
+    {Opcode::Add, Opcode::AddRR, Opcode::AddRK},
+    {Opcode::Sub, Opcode::SubRR, Opcode::SubRK},
+    {Opcode::Lt, Opcode::LtRR, Opcode::LtRK},
+    {Opcode::Gt, Opcode::GtRR, Opcode::GtRK},
+    {Opcode::Incr, Opcode::IncrR, Opcode::Count},
+    {Opcode::Decr, Opcode::DecrR, Opcode::Count},
+    {Opcode::JumpIfNotLt, Opcode::JumpIfNotLtRR, Opcode::JumpIfNotLtRK},
+    {Opcode::JumpIfNotGt, Opcode::JumpIfNotGtRR, Opcode::JumpIfNotGtRK}};
+
+// Unboxed local variables are registers, i.e. slots in the current frame.
+static bool isRegister(const ast::Statement& node)
+{
+    auto lval = dynamic_cast<const ast::LValue*>(&node);
+    if (not lval or lval->cachedAccess_.kind_ not_eq ast::Access::Local) {
+        return false;
+    }
+    const auto& info = lval->cachedVarInfo_;
+    return lval->cachedAccess_.offset_ < 256 and
+           not info.owner_->isBoxed(info.index_);
+}
+
+// Writes the register form of op, applied to node's arguments, if there is
+// one. Jumps are left for the caller to fill in.
+bool BytecodeBuilder::writeRegisterForm(Opcode op, ast::Application& node)
+{
+    if (not registerInstructions_) {
+        return false;
+    }
+    for (const auto& form : registerForms) {
+        if (form.op_ not_eq op or not isRegister(*node.args_[0])) {
+            continue;
+        }
+        auto lhs = dynamic_cast<ast::LValue*>(node.args_[0].get());
+        const auto reg = (uint8_t)lhs->cachedAccess_.offset_;
+        if (node.args_.size() == 1) {
+            data_.push_back((uint8_t)form.rr_);
+            data_.push_back(reg);
+            return true;
+        }
+        auto& rhs = *node.args_[1];
+        if (isRegister(rhs)) {
+            data_.push_back((uint8_t)form.rr_);
+            data_.push_back(reg);
+            const auto& access = static_cast<ast::LValue&>(rhs).cachedAccess_;
+            data_.push_back((uint8_t)access.offset_);
+            return true;
+        }
+        if (auto literal = dynamic_cast<ast::Literal*>(&rhs)) {
+            data_.push_back((uint8_t)form.rk_);
+            data_.push_back(reg);
+            writeParam(data_, literal->cachedVal_);
+            return true;
+        }
+        return false;
+    }
+    return false;
 }
 
 void BytecodeBuilder::visit(ast::Application& node)
 {
-    if (auto lval = dynamic_cast<ast::LValue*>(node.toApply_.get())) {
-        const bool isTopLevel =
-            lval->cachedVarInfo_.owner_->getParent() == nullptr;
-        if (isTopLevel) {
-            if (lval->name_ == "cons") {
-                if (node.args_.size() not_eq 2) {
-                    throw std::runtime_error("wrong number of args to cons");
-                }
-                node.args_[0]->visit(*this);
-                node.args_[1]->visit(*this);
-                writeOp<Opcode::Cons>(data_);
-                return;
-            } else if (lval->name_ == "car") {
-                if (node.args_.size() not_eq 1) {
-                    throw std::runtime_error("wrong number of args to car");
-                }
-                node.args_[0]->visit(*this);
-                writeOp<Opcode::Car>(data_);
-                return;
-            } else if (lval->name_ == "cdr") {
-                if (node.args_.size() not_eq 1) {
-                    throw std::runtime_error("wrong number of args to cdr");
-                }
-                node.args_[0]->visit(*this);
-                writeOp<Opcode::Cdr>(data_);
-                return;
-            } else if (lval->name_ == "null?") {
-                if (node.args_.size() not_eq 1) {
-                    throw std::runtime_error("wrong number of args to null?");
-                }
-                node.args_[0]->visit(*this);
-                writeOp<Opcode::IsNull>(data_);
-                return;
-            }
+    if (auto builtin = findInlinedBuiltin(node)) {
+        if (writeRegisterForm(builtin->op_, node)) {
+            return;
+        }
+        for (auto& arg : node.args_) {
+            arg->visit(*this);
         }
+        data_.push_back(static_cast<uint8_t>(builtin->op_));
+        return;
     }
     for (auto& arg : node.args_) {
         arg->visit(*this);
     }
     node.toApply_->visit(*this);
-    writeOp<Opcode::Call>(data_);
+    if (&node == tail_) {
+        writeOp<Opcode::TailCall>(data_);
+    } else {
+        writeOp<Opcode::Call>(data_);
+    }
     assert(node.args_.size() < 256);
     data_.push_back((uint8_t)node.args_.size());
 }
 
 void BytecodeBuilder::visit(ast::Let& node)
 {
-    if (not fnContexts.empty()) {
-        ++fnContexts.back().letCount_;
+    // Lets within a function use slots in the function's frame, only a top
+    // level let needs a frame of its own.
+    if (node.isFrame()) {
+        writeOp<Opcode::EnterLet>(data_);
+        writeReserve(data_, node.frameSize());
+    } else if (&node == tail_) {
+        tail_ = node.statements_.back().get();
     }
-    writeOp<Opcode::EnterLet>(data_);
-    for (auto& binding : node.bindings_) {
-        binding.value_->visit(*this);
-        writeOp<Opcode::Store>(data_);
+    for (size_t i = 0; i < node.bindings_.size(); ++i) {
+        writeDefinition(*this, data_, node, i, *node.bindings_[i].value_);
     }
     for (auto& st : node.statements_) {
         st->visit(*this);
         writeOp<Opcode::Discard>(data_);
     }
     data_.pop_back();
-    writeOp<Opcode::ExitLet>(data_);
-    if (not fnContexts.empty()) {
-        --fnContexts.back().letCount_;
+    if (node.isFrame()) {
+        writeOp<Opcode::ExitLet>(data_);
     }
 }
 
@@ -245,6 +558,9 @@ void BytecodeBuilder::visit(ast::Namespace& node)
 
 void BytecodeBuilder::visit(ast::Begin& node)
 {
+    if (&node == tail_) {
+        tail_ = node.statements_.back().get();
+    }
     for (auto& st : node.statements_) {
         st->visit(*this);
         writeOp<Opcode::Discard>(data_);
@@ -256,17 +572,36 @@ void BytecodeBuilder::visit(ast::Begin& node)
 
 void BytecodeBuilder::visit(ast::If& node)
 {
-    // Condition, then conditionally branch over the true block
-    node.condition_->visit(*this);
-    writeOp<Opcode::JumpIfFalse>(data_);
+    // Condition, then conditionally branch over the true block. Comparisons
+    // of registers branch directly.
+    const bool tail = &node == tail_;
+    auto condition = dynamic_cast<ast::Application*>(node.condition_.get());
+    auto builtin = condition ? findInlinedBuiltin(*condition) : nullptr;
+    auto jump = Opcode::JumpIfFalse;
+    if (builtin and builtin->op_ == Opcode::Lt) {
+        jump = Opcode::JumpIfNotLt;
+    } else if (builtin and builtin->op_ == Opcode::Gt) {
+        jump = Opcode::JumpIfNotGt;
+    }
+    if (jump == Opcode::JumpIfFalse or
+        not writeRegisterForm(jump, *condition)) {
+        node.condition_->visit(*this);
+        writeOp<Opcode::JumpIfFalse>(data_);
+    }
     const size_t jumpOffset1Loc = data_.size();
     writeParam(data_, (uint16_t)0);
     // True block, then unconditionally branch over the false block
+    if (tail) {
+        tail_ = node.trueBranch_.get();
+    }
     node.trueBranch_->visit(*this);
     writeOp<Opcode::Jump>(data_);
     const size_t jumpOffset2Loc = data_.size();
     writeParam(data_, (uint16_t)0);
     // False block
+    if (tail) {
+        tail_ = node.falseBranch_.get();
+    }
     node.falseBranch_->visit(*this);
     uint16_t* jumpOffset1 = (uint16_t*)(&data_[jumpOffset1Loc]);
     uint16_t* jumpOffset2 = (uint16_t*)(&data_[jumpOffset2Loc]);
@@ -282,20 +617,93 @@ void BytecodeBuilder::visit(ast::If& node)
     *jumpOffset2 = j2result;
 }
 
+// Writes a jump with its offset left at zero, and returns where the offset
+// is, for patchJump to fill in once the target is known.
+size_t BytecodeBuilder::writeJump(Opcode op)
+{
+    data_.push_back((uint8_t)op);
+    const size_t jump = data_.size();
+    writeParam(data_, (uint16_t)0);
+    return jump;
+}
+
+// Points the jump at the end of the code written so far.
+void BytecodeBuilder::patchJump(size_t jump)
+{
+    const size_t offset = data_.size() - (jump + 2);
+    if (offset > std::numeric_limits<uint16_t>::max()) {
+        throw std::runtime_error("jump offset exceeds allowed size");
+    }
+    *(uint16_t*)(&data_[jump]) = offset;
+}
+
+// Only false is false, so (or) is false, and otherwise the value is the first
+// one that isn't false, or else the last one. Values are copied before the
+// test, which consumes them.
 void BytecodeBuilder::visit(ast::Or& node)
 {
-    throw std::runtime_error("or unimplemented");
+    if (node.statements_.empty()) {
+        writeOp<Opcode::PushFalse>(data_);
+        return;
+    }
+    const bool tail = &node == tail_;
+    std::vector<size_t> exits;
+    for (size_t i = 0; i < node.statements_.size() - 1; ++i) {
+        node.statements_[i]->visit(*this);
+        writeOp<Opcode::Dup>(data_);
+        const size_t next = writeJump(Opcode::JumpIfFalse);
+        exits.push_back(writeJump(Opcode::Jump));
+        patchJump(next);
+        writeOp<Opcode::Discard>(data_);
+    }
+    if (tail) {
+        tail_ = node.statements_.back().get();
+    }
+    node.statements_.back()->visit(*this);
+    for (auto exit : exits) {
+        patchJump(exit);
+    }
 }
 
+// (and) is true, and otherwise the value is false if any of the values are,
+// or else the last one.
 void BytecodeBuilder::visit(ast::And& node)
 {
-    throw std::runtime_error("and unimplemented");
+    if (node.statements_.empty()) {
+        writeOp<Opcode::PushTrue>(data_);
+        return;
+    }
+    const bool tail = &node == tail_;
+    std::vector<size_t> exits;
+    for (size_t i = 0; i < node.statements_.size() - 1; ++i) {
+        node.statements_[i]->visit(*this);
+        exits.push_back(writeJump(Opcode::JumpIfFalse));
+    }
+    if (tail) {
+        tail_ = node.statements_.back().get();
+    }
+    node.statements_.back()->visit(*this);
+    if (exits.empty()) {
+        return;
+    }
+    const size_t end = writeJump(Opcode::Jump);
+    for (auto exit : exits) {
+        patchJump(exit);
+    }
+    writeOp<Opcode::PushFalse>(data_);
+    patchJump(end);
 }
 
 void BytecodeBuilder::visit(ast::Def& node)
 {
-    node.value_->visit(*this);
-    writeOp<Opcode::Store>(data_);
+    if (node.cachedScope_->isTopLevel()) {
+        node.value_->visit(*this);
+        writeOp<Opcode::StoreGlobal>(data_);
+        writeParam(data_, node.cachedScope_->slotOf(node.cachedIndex_));
+    } else {
+        writeDefinition(*this, data_, *node.cachedScope_, node.cachedIndex_,
+                        *node.value_);
+    }
     writeOp<Opcode::PushNull>(data_);
 }
 
@@ -304,24 +712,8 @@ void BytecodeBuilder::visit(ast::Recur& node)
     for (auto& arg : node.args_) {
         arg->visit(*this);
     }
-    // If recur is used within a let environment nested within a
-    // function, we need to exit the nested environments before
-    // re-playing the function.
-    for (size_t i = 0; i < fnContexts.back().letCount_; ++i) {
-        writeOp<Opcode::ExitLet>(data_);
-    }
     writeOp<Opcode::Recur>(data_);
-}
-
-void BytecodeBuilder::visit(ast::UserValue& node)
-{
-    writeOp<Opcode::PushI>(data_);
-    writeParam(data_, node.varLoc_);
-}
-
-void BytecodeBuilder::unusedExpr()
-{
-    writeOp<Opcode::Discard>(data_);
+    data_.push_back((uint8_t)node.args_.size());
 }
 
 } // namespace ebl
@@ -9,8 +9,25 @@ namespace ebl {
 
 class Context;
 
+enum class Opcode : uint8_t;
+
+// Calls to these builtins compile to their opcode, rather than to a call.
+struct InlinedBuiltin {
+    const char* name_;
+    size_t argc_;
+    Opcode op_;
+};
+
+const InlinedBuiltin* findInlinedBuiltin(const ast::Application& node);
+
 class BytecodeBuilder : public ast::Visitor {
 public:
+    // See Context::Configuration::registerInstructions_.
+    explicit BytecodeBuilder(bool registerInstructions)
+        : registerInstructions_(registerInstructions), tail_(nullptr)
+    {
+    }
+
     void visit(ast::Namespace& node) override;
     void visit(ast::Literal& node) override;
     void visit(ast::Null& node) override;
@@ -28,14 +45,21 @@ public:
     void visit(ast::And& node) override;
     void visit(ast::Def& node) override;
     void visit(ast::Set& node) override;
-    void visit(ast::UserValue& node) override;
     void visit(ast::Recur& node) override;
 
-    void unusedExpr();
-
     Bytecode result();
 
 private:
+    void visitLambda(ast::Lambda& node, Opcode pushOp);
+    bool writeRegisterForm(Opcode op, ast::Application& node);
+    size_t writeJump(Opcode op);
+    void patchJump(size_t jump);
+
+    const bool registerInstructions_;
+    // The expression in tail position in the function being compiled, whose
+    // value the function returns. Ifs, lets and begins pass the position on
+    // to their last expressions, and calls there become tail calls.
+    ast::Statement* tail_;
     Bytecode data_;
 };
 
@@ -50,14 +74,15 @@ enum class Opcode : uint8_t {
 
     Return, // RETURN : transfer control back to the caller
 
-    Recur, // RECUR : re-invoke the current function, by recycling the
-           // working environment frame. NOTE: A RECUR bytecode needs
-           // to be preceeded by a number of EXITLET opcodes equal to
-           // the number of let expressions within which the RECUR
-           // form occurs. This is because ENTERLET advances the
-           // environment frame without pushing onto the callstack
-           // (because let opens an environment, but technically isn't
-           // a function call).
+    Recur, // RECUR(u8 argc) : re-invoke the current function, by moving
+           // the new arguments into the current frame. Lets within a
+           // function share the function's frame, so there's nothing
+           // else to unwind.
+
+    TailCall, // TAILCALL(u8 argc) : a call in tail position, where the
+              // callee replaces the current frame, rather than pushing a
+              // new one. Calls to builtins don't have a frame, and are
+              // followed by the function's return, as usual.
 
     // JUMP INSTRUCTIONS
     //
@@ -69,10 +94,12 @@ enum class Opcode : uint8_t {
     // LOAD INSTRUCTIONS
     //
     // For loading values from the environment onto the operand
-    // stack. This is a frequent operation, and the compiler does a
-    // number of optimizations to cut down on the cost of loading,
-    // because generically loading from the ebl stack, which is a
-    // parent pointer tree, is costly.
+    // stack. Functions are closure converted, so a frame's parent is
+    // either the function's closure, holding its captured values, or
+    // the top level. Globals are slots in the top level's frame, which
+    // the global instructions index directly, however deeply nested the
+    // code is. The current frame lives on the operand stack, see
+    // StackFrame.
     //
     // The *Fast opcodes use a single byte index, which works pretty
     // well actually, because most function call environments don't
@@ -83,11 +110,15 @@ enum class Opcode : uint8_t {
     Load,      // LOAD(u16 frame_dist, u16 frame_offset)
     Load0,     // LOAD0(u16 frame_offset) : load from the current frame
     Load1,     // LOAD1(u16 frame_offset) : load from the parent frame
-    Load2,     // LOAD2(u16 frame_offset) : load from the grandparent frame
     Load0Fast, // LOAD0FAST(u8 frame_offset) : load from current, small offset
     Load1Fast, // LOAD1FAST(u8 frame_offset) : load from parent, small offset
 
-    Store, // STORE : move the top of the stack to the end of env frame.
+    LoadGlobal,  // LOADGLOBAL(u16 slot) : load a global variable
+    StoreGlobal, // STOREGLOBAL(u16 slot) : move the top of the stack into a
+                 // global variable, defining it if it's new.
+
+    Reserve, // RESERVE(u16 count) : push count null slots onto the stack,
+             // for the current frame's local variables.
 
     Rebind, // REBIND(u16 frame_dist, u16 frame_offset) : Overwrite a
             // variable binding in the environment. This particular
@@ -106,23 +137,90 @@ enum class Opcode : uint8_t {
     PushNull,             // PUSHNULL : push the null constant onto the stack
     PushTrue,             // PUSHTRUE : push the true constant onto the stack
     PushFalse,            // PUSHFALSE : push the false constant onto the stack
-    PushLambda,           // PUSHLAMBDA(u8 argc)
-    PushDocumentedLambda, // PUSHDOCUMENTEDLAMBDA(u8 argc, u16 id)
-    PushVariadicLambda,   // PUSHVARIADICLAMBDA(u8 argc)
+    //
+    // The lambda opcodes consume a number of captured values from the stack,
+    // which become the closure's frame.
+    //
+    PushLambda,           // PUSHLAMBDA(u8 argc, u8 captures)
+    PushDocumentedLambda, // PUSHDOCUMENTEDLAMBDA(u8 argc, u8 captures, u16 id)
+    PushVariadicLambda,   // PUSHVARIADICLAMBDA(u8 argc, u8 captures)
 
     Discard, // DISCARD : pop the top of the operand stack, i.e. toss out the
              // result of the last expression.
+    Dup,     // DUP : push a copy of the top of the operand stack
 
-    EnterLet, // ENTERLET : open a new env frame for the let expression
+    EnterLet, // ENTERLET : open a new stack frame for a top level let
     ExitLet,  // EXITLET : pop the env frame associated with the let expr
 
+    // Captured variables that might change are kept in boxes, shared by the
+    // frame and the closures.
+    Box,    // BOX : replace the stack top with a box containing it
+    Unbox,  // UNBOX : replace the box on the stack top with its contents
+    SetBox, // SETBOX : consume a box and a value beneath it, storing the
+            // value in the box
+
     // INLINED FUNCTION CALLS
     Cons,
     Car,
     Cdr,
     IsNull,
 
+    // Numeric builtins, with fast paths for integers and floats. Anything
+    // else falls back to calling the builtin function of the same name.
+    Add,  // ADD : (+ a b)
+    Sub,  // SUB : (- a b)
+    Lt,   // LT : (< a b)
+    Gt,   // GT : (> a b)
+    Incr, // INCR : (incr a)
+    Decr, // DECR : (decr a)
+    Eq,   // EQ : (equal? a b)
+    Not,  // NOT : (not a)
+    Mod,  // MOD : (mod a b)
+
+    // SUPERINSTRUCTIONS
+    //
+    // Pairs of instructions that often run back to back, fused into one to
+    // save a dispatch. The builder fuses them in a pass over its result, and
+    // each one takes its pair's parameters, in order.
+    //
+    Load0Fast2,    // LOAD0FAST2(u8 offset, u8 offset) : Load0Fast, Load0Fast
+    Load0Car,      // LOAD0CAR(u8 offset) : Load0Fast, Car
+    Load0Cdr,      // LOAD0CDR(u8 offset) : Load0Fast, Cdr
+    Load0PushI,    // LOAD0PUSHI(u8 offset, u16 id) : Load0Fast, PushI
+    JumpIfNotNull, // JUMPIFNOTNULL(u16 offset) : IsNull, JumpIfFalse
+    JumpIfNotLt,   // JUMPIFNOTLT(u16 offset) : Lt, JumpIfFalse
+    JumpIfNotGt,   // JUMPIFNOTGT(u16 offset) : Gt, JumpIfFalse
+
+    // REGISTER INSTRUCTIONS
+    //
+    // Forms of the instructions above that read their operands straight out
+    // of slots in the current frame (r), or out of the immediates (k),
+    // rather than off of the operand stack.
+    //
+    AddRR,         // ADDRR(u8 r, u8 r)
+    AddRK,         // ADDRK(u8 r, u16 k)
+    SubRR,         // SUBRR(u8 r, u8 r)
+    SubRK,         // SUBRK(u8 r, u16 k)
+    LtRR,          // LTRR(u8 r, u8 r)
+    LtRK,          // LTRK(u8 r, u16 k)
+    GtRR,          // GTRR(u8 r, u8 r)
+    GtRK,          // GTRK(u8 r, u16 k)
+    IncrR,         // INCRR(u8 r)
+    DecrR,         // DECRR(u8 r)
+    JumpIfNotLtRR, // JUMPIFNOTLTRR(u8 r, u8 r, u16 offset)
+    JumpIfNotLtRK, // JUMPIFNOTLTRK(u8 r, u16 k, u16 offset)
+    JumpIfNotGtRR, // JUMPIFNOTGTRR(u8 r, u8 r, u16 offset)
+    JumpIfNotGtRK, // JUMPIFNOTGTRK(u8 r, u16 k, u16 offset)
+
     Count
 };
 
+// The number of bytes of parameters that follow an opcode.
+size_t paramSize(Opcode op);
+
+// Jumps end with a u16 offset, relative to the next instruction.
+bool isJump(Opcode op);
+
+const char* opcodeName(Opcode op);
+
 } // namespace ebl
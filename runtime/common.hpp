@@ -6,8 +6,8 @@
 
 namespace ebl {
 using ImmediateId = uint16_t;
-using SymbolId = uint16_t;
-    
+using SymbolId = uint32_t;
+
 using StackLoc = uint16_t;
 using FrameDist = uint16_t;
 struct VarLoc {
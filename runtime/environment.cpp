@@ -1,79 +1,103 @@
 #include "environment.hpp"
 #include "bytecode.hpp"
+#include "optimizer.hpp"
 #include "parser.hpp"
+#include "persistent.hpp"
 #include "pool.hpp"
 #include "vm.hpp"
+#include <algorithm>
 #include <cassert>
 #include <chrono>
+#include <cstring>
 #include <fstream>
 #include <iomanip>
+#include <map>
+#include <sstream>
+#include <unordered_map>
 
 #include <iostream>
 #include "ebl.hpp"
 
+#if defined(__unix__) or defined(__APPLE__)
+#define EBL_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 namespace ebl {
 
 ValuePtr Environment::getGlobal(const std::string& key)
 {
-    auto loc = context_->astRoot_->find(key).varLoc_;
+    auto loc = context_->astRoot_->find(context_->symbols_, key).varLoc_;
     return context_->topLevel_->load(loc);
 }
 
-static ast::Ptr<ast::Def> makeUoDef(Context* ctx, const std::string& key,
-                                    ValuePtr value)
+// Builtins and dll exports go straight into the top level, without
+// compiling or running any code.
+void Context::defineNative(const std::string& name, ValuePtr value)
 {
-    const auto id = ctx->immediates().size();
-    ctx->immediates().push_back(value);
-    auto def = make_unique<ast::Def>();
-    auto val = make_unique<ast::UserValue>(id);
-    def->name_ = key;
-    def->value_ = std::move(val);
-    return def;
+    assert(astRoot_);
+    const auto index = astRoot_->insert(symbols_, name);
+    astRoot_->setDefined(index);
+    const auto slot = astRoot_->slotOf(index);
+    topLevel_->storeGlobal(slot, value);
+    natives_[name] = slot;
 }
 
 void Environment::setGlobal(const std::string& key,
                             const std::string& nameSpace, ValuePtr value)
 {
-    assert(context_->astRoot_);
-    auto newNs = make_unique<ast::Namespace>();
-    newNs->name_ = nameSpace;
-    newNs->statements_.push_back(makeUoDef(context_, key, value));
-    context_->astRoot_->statements_.push_back(std::move(newNs));
-    context_->astRoot_->statements_.back()->init(context_->topLevel(),
-                                                 *context_->astRoot_);
-    BytecodeBuilder builder;
-    const size_t lastExecuted = context_->program_.size();
-    context_->astRoot_->statements_.back()->visit(builder);
-
-    auto newCode = builder.result();
-    std::copy(newCode.begin(), newCode.end(),
-              std::back_inserter(context_->program_));
-    context_->callStack().push_back({0, 0, context_->topLevel().reference()});
-    VM::execute(*context_->topLevel_, context_->program_, lastExecuted);
-    context_->callStack().pop_back();
+    context_->defineNative(nameSpace + "::" + key, value);
 }
 
 void Environment::setGlobal(const std::string& key, ValuePtr value)
 {
-    assert(context_->astRoot_);
-    context_->astRoot_->statements_.push_back(makeUoDef(context_, key, value));
-    context_->astRoot_->statements_.back()->init(context_->topLevel(),
-                                                 *context_->astRoot_);
-    BytecodeBuilder builder;
-    const size_t lastExecuted = context_->program_.size();
-    context_->astRoot_->statements_.back()->visit(builder);
-    builder.unusedExpr();
-    auto newCode = builder.result();
-    std::copy(newCode.begin(), newCode.end(),
-              std::back_inserter(context_->program_));
-    context_->callStack().push_back({0, 0, context_->topLevel().reference()});
-    VM::execute(*context_->topLevel_, context_->program_, lastExecuted);
-    context_->callStack().pop_back();
+    context_->defineNative(key, value);
+}
+
+void Environment::setGlobals(const std::string& nameSpace,
+                             const NativeFunction* functions, size_t count)
+{
+    const auto prefix = nameSpace.empty() ? nameSpace : nameSpace + "::";
+    auto& vars = context_->topLevel_->vars_;
+    vars.reserve(vars.size() + count);
+    for (size_t i = 0; i < count; ++i) {
+        const auto& native = functions[i];
+        auto doc = getNull();
+        if (native.docstring_) {
+            doc = create<String>(native.docstring_, strlen(native.docstring_));
+        }
+        context_->defineNative(
+            prefix + native.name_,
+            create<Function>(doc, native.requiredArgs_, native.impl_));
+    }
+}
+
+Environment::Environment(Context* context, EnvPtr parent)
+    : context_(context), parent_(parent), epoch_(context->gcEpoch()),
+      traced_(0), remembered_(false)
+{
+}
+
+bool Environment::isYoung() const
+{
+    return epoch_ == context_->gcEpoch();
+}
+
+void Environment::writeBarrier(ValuePtr value)
+{
+    if (UNLIKELY(value->young() and not remembered_ and not isYoung())) {
+        remembered_ = true;
+        context_->rememberedFrames().push_back(reference());
+    }
 }
 
 void Environment::push(ValuePtr value)
 {
     vars_.push_back(value);
+    writeBarrier(value);
 }
 
 void Environment::clear()
@@ -100,17 +124,31 @@ ValuePtr Environment::load(VarLoc loc)
 
 void Environment::store(VarLoc loc, ValuePtr value)
 {
-    getFrame(loc).vars_[loc.offset_] = value;
+    auto& frame = getFrame(loc);
+    deletionBarrier(frame.vars_[loc.offset_]);
+    frame.vars_[loc.offset_] = value;
+    frame.writeBarrier(value);
+}
+
+void Environment::storeGlobal(StackLoc slot, ValuePtr value)
+{
+    if (slot < vars_.size()) {
+        deletionBarrier(vars_[slot]);
+    } else {
+        vars_.resize(slot + 1, getNull());
+    }
+    vars_[slot] = value;
+    writeBarrier(value);
 }
 
 ValuePtr Environment::getNull()
 {
-    return context_->nullValue_;
+    return makeImmediate<Null>();
 }
 
 ValuePtr Environment::getBool(bool trueOrFalse)
 {
-    return context_->booleans_[trueOrFalse];
+    return makeImmediate<Boolean>(trueOrFalse);
 }
 
 EnvPtr Environment::derive()
@@ -135,7 +173,20 @@ void initBuiltins(Environment& env);
 const Context::Configuration& Context::defaultConfig()
 {
     static const Configuration defaults{
-        10000000 // Ten megabyte heap
+        10000000,    // Ten megabyte initial heap
+        2097152,     // Never shrinks below two megabytes
+        1073741824,  // Grows up to a gigabyte
+        50,          // Keeps the heap about half full
+        1048576,     // One megabyte nursery
+        1,           // Single threaded collector
+        0,           // Stop the world while marking
+        true,        // Operate directly on frame slots
+        true,        // Fold constants
+        true,        // Compile hot functions
+        1000,        // Hot after a thousand calls
+        false,       // No profiling
+        0,           // No sampling
+        nullptr      // Compile the builtins and onloads
     };
     return defaults;
 }
@@ -143,90 +194,711 @@ const Context::Configuration& Context::defaultConfig()
 #include "onloads.hpp"
 
 Context::Context(const Configuration& config)
-    : heap_(config.heapSize_, 0),
+    : config_(config), heap_(config.heapSize_),
+      nursery_(config.nurserySize_ ? Heap(config.nurserySize_) : Heap()),
+      allocator_(config.nurserySize_ ? &nursery_ : &heap_),
       topLevel_(std::allocate_shared<Environment>(PoolAllocator<Environment>{},
                                                   this, nullptr)),
-      booleans_{{topLevel_->create<Boolean>(false)},
-                {topLevel_->create<Boolean>(true)}},
-      nullValue_{topLevel_->create<Null>()}, collector_{new MarkCompact},
+      collector_{new MarkCompact(config.gcThreads_)},
+      jit_(config.jit_ and not config.profile_ and Jit::supported()
+               ? new Jit(*this, config.jitThreshold_)
+               : nullptr),
+      profiler_(config.profile_ ? new Profiler(*this) : nullptr),
       persistentsList_(nullptr)
 {
-    topLevel_->exec("");
-    initBuiltins(*topLevel_);
-    callStack_.push_back({0, 0, topLevel_});
-    topLevel_->exec(onloads);
+    registerContext(*this);
+    try {
+        callStack_.push_back({0, 0, topLevel_.get(), 0});
+        topLevel_->exec("");
+        initBuiltins(*topLevel_);
+        if (config.image_) {
+            loadFromFile(config.image_);
+        } else {
+            topLevel_->exec(onloads);
+        }
+        if (config.sampleInterval_) {
+            sampler_.reset(new Sampler(
+                *this, std::chrono::microseconds(config.sampleInterval_)));
+        }
+    } catch (...) {
+        unregisterContext(*this);
+        throw;
+    }
 }
 
 Context::~Context()
 {
+    unregisterContext(*this);
 }
 
-void Context::writeToFile(const std::string& fname)
+template <typename F> void Context::recordPause(F&& collect)
+{
+    using namespace std::chrono;
+    const auto start = steady_clock::now();
+    collect();
+    const auto pause = duration_cast<nanoseconds>(steady_clock::now() - start);
+    gcStat_.totalPause_ += pause;
+    gcStat_.maxPause_ = std::max(gcStat_.maxPause_, pause);
+}
+
+void Context::runGC(Environment& env)
 {
-    std::ofstream bc(fname, std::ofstream::binary);
+    allocsUntilSlice_ = 0;
+    ++gcStat_.collections_;
+    recordPause([&] {
+        ++gcCycle_;
+        collector_->run(env, heap_);
+        if (nursery_.size()) {
+            // Everything in the nursery might survive, so only scavenge if
+            // the heap has room for the whole nursery.
+            if (heap_.capacity() - heap_.size() < nursery_.size()) {
+                throw Heap::OOM{};
+            }
+            ++gcCycle_;
+            scavenger_.run(env, nursery_, heap_, false);
+            ++gcEpoch_;
+        }
+    });
+}
 
-    // bc << "@Section:Immediates\n";
-    for (auto& val : immediates_) {
-        bc << val->typeId();
-        print(*topLevel_, val, bc, false);
-        bc << "\n";
+size_t Context::heapCapacityFor(size_t liveBytes) const
+{
+    const size_t needed = liveBytes + nursery_.capacity();
+    const size_t occupancy = config_.heapOccupancy_;
+    size_t capacity = heap_.capacity();
+    // Leave some slack before shrinking, so that a heap hovering around the
+    // target occupancy isn't resized on every collection.
+    if (needed * 100 > capacity * occupancy or
+        needed * 100 < capacity * occupancy / 2) {
+        capacity = needed * 100 / occupancy;
     }
+    capacity = std::max(capacity, config_.minHeapSize_);
+    capacity = std::min(capacity, std::max(config_.maxHeapSize_, liveBytes));
+    return (capacity + Heap::Align - 1) / Heap::Align * Heap::Align;
+}
+
+// While marking incrementally, run a slice of marking after this many
+// allocations.
+static const size_t allocsPerSlice = 4096;
 
-    bc << "@Section:Program\n";
-    std::cout << immediates_.size() << std::endl;
-    bc.write((const char*)program_.data(), program_.size());
+void Context::collectNursery(Environment& env)
+{
+    if (heap_.capacity() - heap_.size() < nursery_.size() or
+        collector_->incrementalMarkFinished()) {
+        runGC(env);
+        return;
+    }
+    ++gcStat_.nurseryCollections_;
+    recordPause([&] {
+        ++gcCycle_;
+        scavenger_.run(env, nursery_, heap_,
+                       collector_->incrementalMarking());
+        ++gcEpoch_;
+        // Incremental marking begins while the nursery is empty, once the
+        // heap is half full.
+        if (config_.gcSliceBudget_ and not collector_->incrementalMarking() and
+            heap_.size() > heap_.capacity() / 2) {
+            ++gcCycle_;
+            collector_->beginIncrementalMark(env);
+            allocsUntilSlice_ = allocsPerSlice;
+        }
+    });
 }
 
-void Context::loadFromFile(const std::string& fname)
+void Context::markSlice(Environment& env)
 {
-    operandStack_.clear();
-    callStack_.clear();
-    topLevel_->clear();
+    ++gcStat_.markSlices_;
+    bool finished = false;
+    recordPause([&] {
+        using namespace std::chrono;
+        finished = collector_->markSlice(
+            env, heap_, duration_cast<nanoseconds>(microseconds(config_.gcSliceBudget_)));
+    });
+    allocsUntilSlice_ = finished ? 0 : allocsPerSlice;
+}
+
+template <> std::string immediateKey<String>(const std::string& val)
+{
+    return std::string(1, (char)typeId<String>()) + val;
+}
+
+template <> std::string immediateKey<Symbol>(const Heap::Ptr<String>& val)
+{
+    std::stringstream str;
+    str << (char)typeId<Symbol>() << *val;
+    return str.str();
+}
+
+// Empty if storeI doesn't create values of val's type.
+static std::string immediateKeyOf(ValuePtr val)
+{
+    switch (val->typeId()) {
+    case typeId<Integer>():
+        return immediateKey<Integer>(val.cast<Integer>()->value());
+
+    case typeId<Float>():
+        return immediateKey<Float>(val.cast<Float>()->value());
+
+    case typeId<Character>():
+        return immediateKey<Character>(val.cast<Character>()->value());
+
+    case typeId<String>(): {
+        std::stringstream str;
+        str << *val.cast<String>();
+        return immediateKey<String>(str.str());
+    }
+
+    case typeId<Symbol>():
+        return immediateKey<Symbol>(val.cast<Symbol>()->value());
+
+    default:
+        return {};
+    }
+}
+
+// An image starts with a header and a table of sections, which leaves room
+// for sections to be added later. Numbers are little endian, and strings are
+// a u32 length followed by utf8.
+//
+//   header:   "EBLI", u32 version, u32 opcode count, u32 section count
+//   section:  u32 kind, u64 offset, u64 size
+//
+// The dlls section lists the dlls that the program opened, which the loading
+// context opens too, unless it already has. Immediates are a u32 count
+// followed by each value's kind and contents, where a pair's contents are
+// its car and its cdr. The symbol table names every
+// top level variable, in slot order, so that code can still be compiled
+// against the top level once an image has been loaded. Builtins, and values
+// defined by dlls, can't be written out, so they're only flagged as native
+// in the symbol table, and the loading context supplies its own. The
+// bytecode expects the same instruction set, so the version has to change
+// along with it. The execs section has a u32 count of calls to exec, in the
+// order that they began, each with a u32 count of the statements that it
+// compiled and their u64 offsets into the program.
+static const char imageMagic[] = {'E', 'B', 'L', 'I'};
+static const uint32_t imageVersion = 4;
+
+enum class ImageSection : uint32_t {
+    Dlls,
+    Immediates,
+    Symbols,
+    Program,
+    Execs
+};
+
+enum class ImageValue : uint8_t {
+    Null,
+    Boolean,
+    Integer,
+    Float,
+    Complex,
+    Character,
+    String,
+    Symbol,
+    Pair
+};
+
+enum ImageSymbolFlags : uint8_t { Mutable = 1, Native = 2 };
+
+namespace {
+
+class ImageWriter {
+public:
+    void write(uint64_t value, size_t bytes)
+    {
+        for (size_t i = 0; i < bytes; ++i) {
+            buffer_.push_back(char(value >> (i * 8)));
+        }
+    }
+
+    void write(double value)
+    {
+        uint64_t bits;
+        std::memcpy(&bits, &value, sizeof bits);
+        write(bits, sizeof bits);
+    }
+
+    void write(const std::string& str)
+    {
+        write(str.size(), 4);
+        buffer_ += str;
+    }
+
+    void write(const char* data, size_t size)
+    {
+        buffer_.append(data, size);
+    }
+
+    const std::string& buffer() const
+    {
+        return buffer_;
+    }
+
+private:
+    std::string buffer_;
+};
+
+class ImageReader {
+public:
+    ImageReader(const char* data, size_t size) : data_(data), size_(size)
+    {
+    }
+
+    const char* take(size_t bytes)
+    {
+        if (bytes > size_) {
+            throw std::runtime_error("truncated image");
+        }
+        const auto result = data_;
+        data_ += bytes;
+        size_ -= bytes;
+        return result;
+    }
+
+    uint64_t read(size_t bytes)
+    {
+        const auto data = (const uint8_t*)take(bytes);
+        uint64_t value = 0;
+        for (size_t i = 0; i < bytes; ++i) {
+            value |= (uint64_t)data[i] << (i * 8);
+        }
+        return value;
+    }
+
+    size_t remaining() const
+    {
+        return size_;
+    }
+
+    double readDouble()
+    {
+        const uint64_t bits = read(8);
+        double value;
+        std::memcpy(&value, &bits, sizeof value);
+        return value;
+    }
 
+    std::string readString()
+    {
+        const auto size = read(4);
+        return std::string(take(size), size);
+    }
+
+private:
+    const char* data_;
+    size_t size_;
+};
+
+// Maps a file into memory, where the platform allows, so that an image is
+// decoded in place rather than read into a buffer first.
+class MappedFile {
+public:
+    MappedFile(const std::string& fname) : data_(nullptr), size_(0)
+    {
+#ifdef EBL_MMAP
+        const int fd = open(fname.c_str(), O_RDONLY);
+        struct stat info;
+        if (fd == -1 or fstat(fd, &info) == -1) {
+            if (fd not_eq -1) {
+                close(fd);
+            }
+            throw std::runtime_error("failed to open " + fname);
+        }
+        size_ = info.st_size;
+        if (size_) {
+            void* mapping = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if (mapping == MAP_FAILED) {
+                throw std::runtime_error("failed to map " + fname);
+            }
+            data_ = (const char*)mapping;
+        } else {
+            close(fd);
+        }
+#else
+        std::ifstream file(fname, std::ifstream::binary);
+        if (not file) {
+            throw std::runtime_error("failed to open " + fname);
+        }
+        std::stringstream contents;
+        contents << file.rdbuf();
+        contents_ = contents.str();
+        data_ = contents_.data();
+        size_ = contents_.size();
+#endif
+    }
 
-    std::ifstream bc(fname, std::ifstream::binary);
-    std::string line;
+    MappedFile(const MappedFile&) = delete;
 
-    size_t count = 0;
-    while (std::getline(bc, line)) {
-        if (line == "@Section:Program") {
-            break;
+    ~MappedFile()
+    {
+#ifdef EBL_MMAP
+        if (data_) {
+            munmap((void*)data_, size_);
         }
+#endif
+    }
+
+    const char* data() const
+    {
+        return data_;
+    }
+
+    size_t size() const
+    {
+        return size_;
+    }
+
+private:
+    const char* data_;
+    size_t size_;
+#ifndef EBL_MMAP
+    std::string contents_;
+#endif
+};
+
+} // namespace
+
+static void writeImmediate(ImageWriter& out, ValuePtr val)
+{
+    switch (val->typeId()) {
+    case typeId<Null>():
+        out.write((uint8_t)ImageValue::Null, 1);
+        break;
+
+    case typeId<Boolean>():
+        out.write((uint8_t)ImageValue::Boolean, 1);
+        out.write(val.cast<Boolean>()->value(), 1);
+        break;
+
+    case typeId<Integer>():
+        out.write((uint8_t)ImageValue::Integer, 1);
+        out.write((uint32_t)val.cast<Integer>()->value(), 4);
+        break;
+
+    case typeId<Float>():
+        out.write((uint8_t)ImageValue::Float, 1);
+        out.write(val.cast<Float>()->value());
+        break;
+
+    case typeId<Complex>(): {
+        const auto value = val.cast<Complex>()->value();
+        out.write((uint8_t)ImageValue::Complex, 1);
+        out.write(value.real());
+        out.write(value.imag());
+    } break;
+
+    case typeId<Character>():
+        out.write((uint8_t)ImageValue::Character, 1);
+        out.write(val.cast<Character>()->value().data(), 4);
+        break;
+
+    case typeId<String>(): {
+        std::stringstream str;
+        str << *val.cast<String>();
+        out.write((uint8_t)ImageValue::String, 1);
+        out.write(str.str());
+    } break;
+
+    case typeId<Symbol>(): {
+        std::stringstream str;
+        str << *val.cast<Symbol>()->value();
+        out.write((uint8_t)ImageValue::Symbol, 1);
+        out.write(str.str());
+    } break;
+
+    case typeId<Pair>(): {
+        // Quoted lists. The elements follow the pair.
+        auto pair = val.cast<Pair>();
+        out.write((uint8_t)ImageValue::Pair, 1);
+        writeImmediate(out, pair->getCar());
+        writeImmediate(out, pair->getCdr());
+    } break;
+
+    default:
+        throw std::runtime_error(std::string("can't write ") +
+                                 typeInfo(val).name_ + " to an image");
+    }
+}
+
+static ValuePtr readImmediate(Environment& env, ImageReader& in,
+                              const std::string& fname)
+{
+    switch ((ImageValue)in.read(1)) {
+    case ImageValue::Null:
+        return env.getNull();
+
+    case ImageValue::Boolean:
+        return env.getBool(in.read(1));
+
+    case ImageValue::Integer:
+        return env.create<Integer>((int32_t)in.read(4));
+
+    case ImageValue::Float:
+        return env.create<Float>(in.readDouble());
+
+    case ImageValue::Complex: {
+        const auto real = in.readDouble();
+        const auto imag = in.readDouble();
+        return env.create<Complex>(Complex::Rep(real, imag));
+    }
+
+    case ImageValue::Character: {
+        Character::Rep value;
+        std::memcpy(value.data(), in.take(4), 4);
+        return env.create<Character>(value);
+    }
+
+    case ImageValue::String:
+        return env.create<String>(in.readString());
+
+    case ImageValue::Symbol: {
+        auto str = env.create<String>(in.readString());
+        return env.create<Symbol>(str);
+    }
+
+    case ImageValue::Pair: {
+        PersistentBase car(env, readImmediate(env, in, fname));
+        auto cdr = readImmediate(env, in, fname);
+        return env.create<Pair>(car.getUntypedVal(), cdr);
+    }
+
+    default:
+        throw std::runtime_error(fname + " has a garbled immediate");
+    }
+}
+
+void Context::writeToFile(const std::string& fname)
+{
+    ImageWriter dlls;
+    dlls.write(dllNames_.size(), 4);
+    for (auto& name : dllNames_) {
+        dlls.write(name);
+    }
+
+    ImageWriter immediates;
+    immediates.write(immediates_.size(), 4);
+    for (auto& val : immediates_) {
+        writeImmediate(immediates, val);
+    }
 
-        // FIXME: First N immediates are builtin functions...
-        if (++count < 126) {
-            continue;
+    ImageWriter symbols;
+    symbols.write(astRoot_->variableCount(), 4);
+    for (StackLoc index = 0; index < astRoot_->variableCount(); ++index) {
+        const auto& name = astRoot_->nameOf(index);
+        symbols.write(name);
+        symbols.write((astRoot_->isMutable(index) ? Mutable : 0) |
+                          (natives_.count(name) ? Native : 0),
+                      1);
+    }
+
+    ImageWriter execs;
+    execs.write(execs_.size(), 4);
+    for (auto& statements : execs_) {
+        execs.write(statements.size(), 4);
+        for (auto start : statements) {
+            execs.write(start, 8);
         }
+    }
 
-        TypeId id(line[0]);
+    struct Section {
+        ImageSection kind_;
+        const char* data_;
+        size_t size_;
+    };
+    const Section sections[] = {
+        {ImageSection::Dlls, dlls.buffer().data(), dlls.buffer().size()},
+        {ImageSection::Immediates, immediates.buffer().data(),
+         immediates.buffer().size()},
+        {ImageSection::Symbols, symbols.buffer().data(),
+         symbols.buffer().size()},
+        {ImageSection::Execs, execs.buffer().data(), execs.buffer().size()},
+        {ImageSection::Program, (const char*)program_.data(),
+         program_.size()}};
+    const size_t sectionCount = sizeof sections / sizeof sections[0];
+
+    ImageWriter header;
+    header.write(imageMagic, sizeof imageMagic);
+    header.write(imageVersion, 4);
+    header.write((uint32_t)Opcode::Count, 4);
+    header.write(sectionCount, 4);
+    uint64_t offset = 16 + sectionCount * 20;
+    for (auto& section : sections) {
+        header.write((uint32_t)section.kind_, 4);
+        header.write(offset, 8);
+        header.write(section.size_, 8);
+        offset += section.size_;
+    }
 
-        switch (id) {
-        case typeId<Integer>(): {
-            std::string value = line.substr(1);
-            storeI<Integer>(*this, std::stoi(value));
-        } break;
+    std::ofstream image(fname, std::ofstream::binary);
+    image << header.buffer();
+    for (auto& section : sections) {
+        image.write(section.data_, section.size_);
+    }
+    if (not image) {
+        throw std::runtime_error("failed to write " + fname);
+    }
+}
 
-        case typeId<String>(): {
-            std::string value = line.substr(1);
-            storeI<String>(*this, value);
-        } break;
+void Context::loadFromFile(const std::string& fname)
+{
+    // While the image runs, exec replays the statements that each call
+    // compiled, so code that eval and load compiled at runtime runs where it
+    // did originally, without compiling anything.
+    loadingImage_ = true;
+    dynamicWind([&] { loadImage(fname); }, [&] { loadingImage_ = false; });
+}
 
-        default:
-            std::cout << "garbled" << std::endl;
+void Context::loadImage(const std::string& fname)
+{
+    MappedFile file(fname);
+    ImageReader header(file.data(), file.size());
+    if (std::memcmp(header.take(sizeof imageMagic), imageMagic,
+                    sizeof imageMagic)) {
+        throw std::runtime_error(fname + " isn't an image");
+    }
+    const auto version = header.read(4);
+    if (version not_eq imageVersion) {
+        throw std::runtime_error(fname + " has image version " +
+                                 std::to_string(version) + ", expected " +
+                                 std::to_string(imageVersion));
+    }
+    const auto opcodes = header.read(4);
+    if (opcodes not_eq (uint32_t)Opcode::Count) {
+        throw std::runtime_error(fname + " has " + std::to_string(opcodes) +
+                                 " opcodes, expected " +
+                                 std::to_string((uint32_t)Opcode::Count));
+    }
+    const auto sectionCount = header.read(4);
+    std::map<ImageSection, ImageReader> sections;
+    for (size_t i = 0; i < sectionCount; ++i) {
+        const auto kind = (ImageSection)header.read(4);
+        const auto offset = header.read(8);
+        const auto size = header.read(8);
+        if (offset > file.size() or size > file.size() - offset) {
+            throw std::runtime_error("truncated image");
         }
+        sections.insert({kind, ImageReader(file.data() + offset, size)});
     }
+    const auto section = [&](ImageSection kind) -> ImageReader& {
+        auto found = sections.find(kind);
+        if (found == sections.end()) {
+            throw std::runtime_error(fname + " is missing a section");
+        }
+        return found->second;
+    };
 
-    program_ = Bytecode(std::istreambuf_iterator<char>(bc),
-                        std::istreambuf_iterator<char>());
+    auto& dlls = section(ImageSection::Dlls);
+    const auto dllCount = dlls.read(4);
+    for (size_t i = 0; i < dllCount; ++i) {
+        const auto name = dlls.readString();
+        topLevel_->openDLL(name);
+    }
 
-    callStack_.push_back({0, 0, topLevel_});
+    // The new immediates go after the old ones until they're complete.
+    const size_t previous = immediates_.size();
+    auto& immediates = section(ImageSection::Immediates);
+    const auto count = immediates.read(4);
+    for (size_t i = 0; i < count; ++i) {
+        immediates_.push_back(readImmediate(*topLevel_, immediates, fname));
+    }
+    immediates_.erase(immediates_.begin(), immediates_.begin() + previous);
+    immediateIndex_.clear();
+    for (size_t i = 0; i < immediates_.size(); ++i) {
+        auto key = immediateKeyOf(immediates_[i]);
+        if (not key.empty()) {
+            immediateIndex_.emplace(std::move(key), i);
+        }
+    }
 
-    size_t ip = 0;
-    while (ip < program_.size()) {
-        ip = VM::execute(*topLevel_, program_, ip) + 1;
+    // Natives move from their slots in this context to the image's.
+    auto root = ebl::parse("");
+    root->init(*topLevel_, *root);
+    ast::SymbolTable rootSymbols;
+    std::unordered_map<std::string, StackLoc> natives;
+    std::vector<std::pair<StackLoc, StackLoc>> moves;
+    auto& symbols = section(ImageSection::Symbols);
+    const auto symbolCount = symbols.read(4);
+    for (size_t i = 0; i < symbolCount; ++i) {
+        const auto name = symbols.readString();
+        const auto flags = symbols.read(1);
+        const auto index = root->insert(rootSymbols, name, flags & Mutable);
+        root->setDefined(index);
+        if (flags & Native) {
+            auto found = natives_.find(name);
+            if (found == natives_.end()) {
+                throw std::runtime_error(fname + " needs " + name +
+                                         ", which isn't defined");
+            }
+            natives[name] = root->slotOf(index);
+            moves.push_back({found->second, root->slotOf(index)});
+        }
+    }
+    delete astRoot_;
+    astRoot_ = root.release();
+    symbols_ = std::move(rootSymbols);
+    natives_ = std::move(natives);
+
+    // The program keeps growing as more code is compiled, so it can't stay
+    // in the mapping.
+    auto& program = section(ImageSection::Program);
+    const auto size = program.remaining();
+    const auto code = (const uint8_t*)program.take(size);
+    program_.assign(code, code + size);
+
+    auto& execs = section(ImageSection::Execs);
+    std::vector<std::vector<size_t>> calls(execs.read(4));
+    for (auto& statements : calls) {
+        statements.resize(execs.read(4));
+        for (auto& start : statements) {
+            start = execs.read(8);
+            if (start >= size) {
+                throw std::runtime_error(fname + " has a garbled exec");
+            }
+        }
+    }
+    execs_ = std::move(calls);
+    replayed_ = 0;
+    operandStack_.clear();
+    callStack_.clear();
+    auto vars = topLevel_->getVars();
+    topLevel_->clear();
+    for (auto& move : moves) {
+        topLevel_->storeGlobal(move.second, vars[move.first]);
+    }
+    if (jit_) {
+        jit_->reset();
+    }
+
+    callStack_.push_back({0, 0, topLevel_.get(), 0});
+    while (replayed_ < execs_.size()) {
+        replay();
     }
 }
 
+// Runs the statements that the next call to exec compiled, in place of
+// compiling its code again.
+ValuePtr Context::replay()
+{
+    if (replayed_ == execs_.size()) {
+        throw std::runtime_error("image has no more code to run");
+    }
+    auto result = topLevel_->getNull();
+    for (auto start : execs_[replayed_++]) {
+        const auto base = operandStack_.size();
+        callStack_.push_back({0, 0, topLevel_.get(), base});
+        VM::execute(*topLevel_, program_, start);
+        callStack_.pop_back();
+        // The first call compiles a whole top level, which discards every
+        // value.
+        if (operandStack_.size() > base) {
+            result = operandStack_.back();
+            operandStack_.pop_back();
+        }
+    }
+    return result;
+}
+
 Context* Environment::getContext()
 {
     return context_;
@@ -234,21 +906,32 @@ Context* Environment::getContext()
 
 ValuePtr Environment::exec(const std::string& code)
 {
+    if (context_->loadingImage_) {
+        return context_->replay();
+    }
     auto root = ebl::parse(code);
     auto result = getNull();
+    const auto call = context_->execs_.size();
+    context_->execs_.emplace_back();
     if (context_->astRoot_) {
         for (auto& st : root->statements_) {
-            BytecodeBuilder builder;
+            BytecodeBuilder builder(context_->config_.registerInstructions_);
             const size_t lastExecuted = context_->program_.size();
             // Splice and process each statement into the existing environment
             context_->astRoot_->statements_.push_back(std::move(st));
             context_->astRoot_->statements_.back()->init(*context_->topLevel_,
                                                          *context_->astRoot_);
+            if (context_->config_.optimize_) {
+                Optimizer optimizer(*this);
+                optimizer.optimize(context_->astRoot_->statements_.back());
+            }
             context_->astRoot_->statements_.back()->visit(builder);
             auto newCode = builder.result();
             std::copy(newCode.begin(), newCode.end(),
                       std::back_inserter(context_->program_));
-            context_->callStack().push_back({0, 0, context_->topLevel_});
+            context_->execs_[call].push_back(lastExecuted);
+            context_->callStack().push_back({0, 0, context_->topLevel_.get(),
+                                             context_->operandStack().size()});
             VM::execute(*context_->topLevel_, context_->program_, lastExecuted);
             context_->callStack().pop_back();
             result = context_->operandStack().back();
@@ -256,10 +939,15 @@ ValuePtr Environment::exec(const std::string& code)
         }
     } else {
         root->init(*this, *root);
-        BytecodeBuilder builder;
+        if (context_->config_.optimize_) {
+            Optimizer optimizer(*this);
+            root->visit(optimizer);
+        }
+        BytecodeBuilder builder(context_->config_.registerInstructions_);
         context_->astRoot_ = root.release();
         context_->astRoot_->visit(builder);
         context_->program_ = builder.result();
+        context_->execs_[call].push_back(0);
         VM::execute(*context_->topLevel_, context_->program_, 0);
     }
     return result;
@@ -268,11 +956,16 @@ ValuePtr Environment::exec(const std::string& code)
 
 void Environment::openDLL(const std::string& name)
 {
+    auto& names = context_->dllNames_;
+    if (std::find(names.begin(), names.end(), name) not_eq names.end()) {
+        return;
+    }
     DLL dll(name.c_str());
     auto sym = (void (*)(Environment&))dll.sym("__dllMain");
     if (sym) {
         sym(*this);
         context_->dlls_.push_back(std::move(dll));
+        context_->dllNames_.push_back(name);
     } else {
         throw std::runtime_error("symbol __dllMain lookup failed");
     }
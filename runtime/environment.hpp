@@ -1,12 +1,16 @@
 #pragma once
 
 #include "utility.hpp"
+#include <atomic>
+#include <chrono>
 #include <functional>
 #include <limits>
 #include <map>
 #include <new>
 #include <string>
 #include <tuple>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
 
 #include "common.hpp"
@@ -15,8 +19,11 @@
 // FIXME!!!
 #include "../extlib/smallVector.hpp"
 
+#include "ast.hpp"
 #include "gc.hpp"
+#include "jit.hpp"
 #include "memory.hpp"
+#include "profiler.hpp"
 #include "types.hpp"
 #include "vm.hpp"
 
@@ -28,22 +35,40 @@ class Context;
 class Environment;
 using EnvPtr = std::shared_ptr<Environment>;
 
+// An entry in a table of functions implemented in C++, see setGlobals.
+struct NativeFunction {
+    const char* name_;
+    const char* docstring_;
+    size_t requiredArgs_;
+    CFunction impl_;
+};
+
 class Environment : public std::enable_shared_from_this<Environment> {
 public:
-    Environment(Context* context, EnvPtr parent)
-        : context_(context), parent_(parent)
-    {
-    }
+    Environment(Context* context, EnvPtr parent);
     Environment(const Environment&) = delete;
 
     template <typename T, typename... Args> Heap::Ptr<T> create(Args&&... args);
 
-    // Load/store a variable in the root environment.
+    // Load/store a variable in the root environment. Defining a global
+    // doesn't compile or run any code, which keeps startup cheap for
+    // builtins and dlls.
     ValuePtr getGlobal(const std::string& key);
     void setGlobal(const std::string& key, ValuePtr value);
     void setGlobal(const std::string& key, const std::string& nameSpace,
                    ValuePtr value);
 
+    // Defines a global for each function in a table, within nameSpace
+    // unless it's empty.
+    void setGlobals(const std::string& nameSpace,
+                    const NativeFunction* functions, size_t count);
+    template <size_t N>
+    void setGlobals(const std::string& nameSpace,
+                    const NativeFunction (&functions)[N])
+    {
+        setGlobals(nameSpace, functions, N);
+    }
+
     // Compile and execute ebl code
     ValuePtr exec(const std::string& code);
 
@@ -55,6 +80,9 @@ public:
     void push(ValuePtr value);
     void store(VarLoc loc, ValuePtr value);
     ValuePtr load(VarLoc loc);
+    // Only for the top level, where the slot may not exist yet, if the value
+    // is a new global's definition.
+    void storeGlobal(StackLoc slot, ValuePtr value);
     void clear();
 
     void openDLL(const std::string& name);
@@ -71,12 +99,37 @@ public:
         return vars_;
     }
 
+    // A frame created since the last nursery collection is young. Young
+    // frames are only reachable from the call stack or from young values, so
+    // the collector finds them without help from the write barrier.
+    bool isYoung() const;
+
+    // Returns false if the frame was already traced during collection number
+    // cycle, so that the collector visits each frame exactly once, even when
+    // marking with several threads.
+    bool markTraced(size_t cycle)
+    {
+        return traced_.exchange(cycle, std::memory_order_relaxed) not_eq cycle;
+    }
+
+    void forget()
+    {
+        remembered_ = false;
+    }
+
+    // Needs to be called after storing a value in an existing frame, see
+    // writeBarrier in types.hpp.
+    void writeBarrier(ValuePtr value);
+
 private:
     Environment& getFrame(VarLoc loc);
 
     Context* context_;
     EnvPtr parent_;
     Variables vars_;
+    size_t epoch_;
+    std::atomic<size_t> traced_;
+    bool remembered_;
 };
 
 template <typename T> struct ConstructImpl {
@@ -87,6 +140,38 @@ template <typename T> struct ConstructImpl {
     }
 };
 
+// While the collector runs on behalf of an allocation, any heap pointers
+// passed along to the new value's constructor need to be treated as roots,
+// otherwise they'd be left dangling if the collector moves their targets.
+using ArgumentRoots = std::vector<Heap::GenericPtr*>;
+
+template <typename T>
+typename std::enable_if<std::is_base_of<Heap::GenericPtr, T>::value>::type
+gatherArgumentRoot(T& param, ArgumentRoots& roots)
+{
+    roots.push_back(&param);
+}
+
+template <typename T>
+typename std::enable_if<not std::is_base_of<Heap::GenericPtr, T>::value>::type
+gatherArgumentRoot(T&, ArgumentRoots&)
+{
+}
+
+template <size_t I = 0, typename... Params>
+typename std::enable_if<I == sizeof...(Params)>::type
+gatherArgumentRoots(std::tuple<Params...>&, ArgumentRoots&)
+{
+}
+
+template <size_t I = 0, typename... Params>
+typename std::enable_if<(I < sizeof...(Params))>::type
+gatherArgumentRoots(std::tuple<Params...>& params, ArgumentRoots& roots)
+{
+    gatherArgumentRoot(std::get<I>(params), roots);
+    gatherArgumentRoots<I + 1>(params, roots);
+}
+
 template <> struct ConstructImpl<Function> {
     template <typename... Args>
     static void construct(Function* mem, Environment& env, Args&&... args)
@@ -96,20 +181,56 @@ template <> struct ConstructImpl<Function> {
 };
 
 
-namespace ast {
-struct TopLevel;
-}
-
 class PersistentBase;
 
 
 class Context {
 public:
     struct Configuration {
+        // The heap starts out at heapSize_ bytes. After each full
+        // collection, it is resized so that live values, plus room for the
+        // nursery to be promoted, take up about heapOccupancy_ percent of it,
+        // within minHeapSize_ and maxHeapSize_.
         size_t heapSize_;
+        size_t minHeapSize_;
+        size_t maxHeapSize_;
+        size_t heapOccupancy_;
+        // Values are first allocated in the nursery, and promoted to the heap
+        // if they survive a nursery collection. A nursery size of zero
+        // allocates everything directly on the heap.
+        size_t nurserySize_;
+        // Full collections split marking and compaction across this many
+        // threads, including the thread that triggered the collection.
+        size_t gcThreads_;
+        // When non-zero, the heap is marked incrementally, in slices of
+        // roughly this many microseconds interleaved with allocation.
+        // Compacting the heap still stops the world. Requires a nursery.
+        size_t gcSliceBudget_;
+        // When true, arithmetic and comparisons on local variables and
+        // constants compile to instructions that read them directly out of
+        // the frame, instead of loading them onto the operand stack first.
+        bool registerInstructions_;
+        // When true, the compiler folds constants and drops code that can't
+        // run, or does nothing, see Optimizer.
+        bool optimize_;
+        // When true, functions called at least jitThreshold_ times are
+        // compiled to machine code, on platforms that the jit supports.
+        bool jit_;
+        size_t jitThreshold_;
+        // When true, the vm records calls, time and allocations for each
+        // function, see Profiler. Turns off the jit.
+        bool profile_;
+        // When non-zero, the call stack is sampled every sampleInterval_
+        // microseconds of cpu time, see Sampler.
+        size_t sampleInterval_;
+        // When set, the context starts from this image, see writeToFile,
+        // rather than compiling the builtins and onloads.
+        const char* image_;
     };
 
     Context(const Configuration& config = defaultConfig());
+
+    static const Configuration& defaultConfig();
     Context(const Context&) = delete;
     ~Context();
 
@@ -118,6 +239,11 @@ public:
         return immediates_;
     }
 
+    std::unordered_map<std::string, ImmediateId>& immediateIndex()
+    {
+        return immediateIndex_;
+    }
+
     std::vector<ValuePtr>& operandStack()
     {
         return operandStack_;
@@ -129,6 +255,8 @@ public:
     }
 
     friend class Environment;
+    friend class Profiler;
+    friend class Sampler;
 
     using CallStack = std::vector<StackFrame>;
     CallStack& callStack()
@@ -136,13 +264,74 @@ public:
         return callStack_;
     }
 
-    void runGC(Environment& env)
+    // Collect the whole heap, and empty the nursery.
+    void runGC(Environment& env);
+
+    // Collect only the nursery, falling back to a full collection if the
+    // heap might not have room for the survivors.
+    void collectNursery(Environment& env);
+
+    Heap& nursery()
+    {
+        return nursery_;
+    }
+
+    size_t gcEpoch() const
+    {
+        return gcEpoch_;
+    }
+
+    size_t gcCycle() const
+    {
+        return gcCycle_;
+    }
+
+    std::vector<EnvPtr>& rememberedFrames()
+    {
+        return rememberedFrames_;
+    }
+
+    // Interned names of the variables in this context's scopes.
+    ast::SymbolTable& symbols()
+    {
+        return symbols_;
+    }
+
+    // Old values that the write barrier caught pointing into the nursery,
+    // see rememberValue.
+    std::vector<Value*>& rememberedValues()
+    {
+        return rememberedValues_;
+    }
+
+    // Old values that the deletion barrier overwrote while the collector was
+    // marking incrementally, see shadeValue.
+    std::vector<Value*>& shadedValues()
+    {
+        return shadedValues_;
+    }
+
+    bool markingIncrementally() const
     {
-        collector_->run(env, heap_);
+        return collector_ and collector_->incrementalMarking();
     }
 
+    bool owns(const Value* val) const
+    {
+        return heap_.contains(val);
+    }
+
+    ArgumentRoots& argumentRoots()
+    {
+        return argumentRoots_;
+    }
+
+    // Writes the program, along with its immediates and top level names, to
+    // an image, which loadFromFile can run without compiling anything.
     void writeToFile(const std::string& fname);
 
+    // Replaces the program with an image's, and runs it. Builtins and dll
+    // functions come from this context, which opens the image's dlls first.
     void loadFromFile(const std::string& fname);
 
     const Bytecode& getProgram() const
@@ -150,6 +339,31 @@ public:
         return program_;
     }
 
+    // Null when the jit is disabled.
+    Jit* jit()
+    {
+        return jit_.get();
+    }
+
+    // Null unless profiling.
+    Profiler* profiler()
+    {
+        return profiler_.get();
+    }
+
+    // Null unless sampling.
+    Sampler* sampler()
+    {
+        return sampler_.get();
+    }
+
+    // Set by the sampler's signal handler, and cleared once the sample has
+    // been taken.
+    volatile std::sig_atomic_t& sampleRequested()
+    {
+        return sampleRequested_;
+    }
+
     PersistentBase*& getPersistentsList()
     {
         return persistentsList_;
@@ -160,45 +374,157 @@ public:
         size_t remaining_;
     };
 
+    struct GCStat {
+        size_t collections_ = 0;
+        size_t nurseryCollections_ = 0;
+        std::chrono::nanoseconds totalPause_{0};
+        std::chrono::nanoseconds maxPause_{0};
+        // Time spent in each phase of full collections.
+        std::chrono::nanoseconds markTime_{0};
+        std::chrono::nanoseconds compactTime_{0};
+        std::chrono::nanoseconds fixupTime_{0};
+        size_t markSlices_ = 0;
+    };
+
+    const GCStat& gcStat() const
+    {
+        return gcStat_;
+    }
+
+    GCStat& gcStat()
+    {
+        return gcStat_;
+    }
+
+    // The capacity that the heap should have after a full collection,
+    // following the growth policy in Configuration.
+    size_t heapCapacityFor(size_t liveBytes) const;
+
     MemoryStat memoryStat() const
     {
-        return {heap_.size(), heap_.capacity() - heap_.size()};
+        return {heap_.size() + nursery_.size(), heap_.capacity() - heap_.size()};
     }
 
 private:
+    // Immediates live within the pointer, and only touch the heap when they
+    // don't fit.
     template <typename T, typename... Args>
-    Heap::Ptr<T> create(Environment& env, Args&&... args)
+    typename std::enable_if<IsImmediate<T>::value, Heap::Ptr<T>>::type
+    create(Environment& env, Args&&... args)
     {
-        auto allocVal = [&] { return heap_.alloc<T>().template cast<T>(); };
-        auto mem = alloc<T>(env, allocVal);
-        ConstructImpl<T>::construct(mem.get(), env,
-                                    std::forward<Args>(args)...);
+        if (LIKELY(PtrTraits<T>::fits(args...))) {
+            return makeImmediate<T>(std::forward<Args>(args)...);
+        }
+        return allocate<T>(env, std::forward<Args>(args)...);
+    }
+
+    template <typename T, typename... Args>
+    typename std::enable_if<not IsImmediate<T>::value, Heap::Ptr<T>>::type
+    create(Environment& env, Args&&... args)
+    {
+        return allocate<T>(env, std::forward<Args>(args)...);
+    }
+
+    template <typename T, typename... Args>
+    Heap::Ptr<T> allocate(Environment& env, Args&&... args)
+    {
+        if (UNLIKELY(allocsUntilSlice_) and --allocsUntilSlice_ == 0) {
+            markSlice(env);
+        }
+        if (UNLIKELY(profiler_ not_eq nullptr)) {
+            profiler_->allocated();
+        }
+        std::tuple<typename std::decay<Args>::type...> params(
+            std::forward<Args>(args)...);
+        auto mem = alloc<T>(env, params);
+        // NOTE: boxed immediates, like large floats, dereference to a copy,
+        // so work with the raw pointer instead.
+        auto obj = (T*)mem.handle();
+        construct(obj, env, params,
+                  typename MakeIndexSequence<sizeof...(Args)>::type{});
+        if (allocator_ == &nursery_) {
+            obj->setYoung(true);
+        } else if (collector_->incrementalMarking()) {
+            obj->mark();
+        }
         return mem;
     }
 
-    template <typename T, typename F>
-    Heap::Ptr<T> alloc(Environment& env, F&& allocImpl)
+    template <typename T, typename... Params, size_t... Indices>
+    void construct(T* obj, Environment& env, std::tuple<Params...>& params,
+                   IndexSequence<Indices...>)
+    {
+        ConstructImpl<T>::construct(obj, env,
+                                    std::move(std::get<Indices>(params))...);
+    }
+
+    template <typename T, typename Params>
+    Heap::Ptr<T> alloc(Environment& env, Params& params)
     {
         try {
-            return allocImpl();
+            return allocator_->alloc<T>().template cast<T>();
         } catch (const Heap::OOM& oom) {
-            runGC(env);
-            return allocImpl();
+            const auto rootsCount = argumentRoots_.size();
+            gatherArgumentRoots(params, argumentRoots_);
+            dynamicWind(
+                [&] {
+                    if (allocator_ == &nursery_) {
+                        collectNursery(env);
+                    } else {
+                        runGC(env);
+                    }
+                },
+                [&] { argumentRoots_.resize(rootsCount); });
+            return allocator_->alloc<T>().template cast<T>();
         }
     }
 
-    static const Configuration& defaultConfig();
+    template <typename F> void recordPause(F&& collect);
+
+    void defineNative(const std::string& name, ValuePtr value);
+
+    void loadImage(const std::string& fname);
 
+    ValuePtr replay();
+
+    void markSlice(Environment& env);
+
+    const Configuration config_;
+    size_t gcEpoch_ = 0;
+    size_t gcCycle_ = 0;
     Heap heap_;
+    Heap nursery_;
+    Heap* allocator_;
     EnvPtr topLevel_;
-    Heap::Ptr<Boolean> booleans_[2];
-    Heap::Ptr<Null> nullValue_;
     std::vector<ValuePtr> immediates_;
+    // Immediates stored by storeI, by immediateKey.
+    std::unordered_map<std::string, ImmediateId> immediateIndex_;
     std::vector<ValuePtr> operandStack_;
     std::vector<DLL> dlls_;
+    std::vector<std::string> dllNames_;
+    // Top level slots of the values defined by builtins and dlls, which
+    // images refer to by name.
+    std::unordered_map<std::string, StackLoc> natives_;
     ast::TopLevel* astRoot_ = nullptr;
+    ast::SymbolTable symbols_;
     Bytecode program_;
-    std::unique_ptr<GC> collector_;
+    std::unique_ptr<MarkCompact> collector_;
+    std::unique_ptr<Jit> jit_;
+    std::unique_ptr<Profiler> profiler_;
+    volatile std::sig_atomic_t sampleRequested_ = 0;
+    std::unique_ptr<Sampler> sampler_;
+    bool loadingImage_ = false;
+    // Where the statements that each call to exec compiled start in the
+    // program, in the order that the calls began, see replay.
+    std::vector<std::vector<size_t>> execs_;
+    size_t replayed_ = 0;
+    size_t allocsUntilSlice_ = 0;
+    Scavenger scavenger_;
+    GCStat gcStat_;
+    std::vector<EnvPtr> rememberedFrames_;
+    std::vector<Value*> rememberedValues_;
+    std::vector<Value*> shadedValues_;
+    ArgumentRoots argumentRoots_;
     CallStack callStack_;
     PersistentBase* persistentsList_;
 };
@@ -209,35 +535,31 @@ Heap::Ptr<T> Environment::create(Args&&... args)
     return context_->create<T>(*this, std::forward<Args>(args)...);
 }
 
-template <typename T>
-ImmediateId storeI(Context& context, const typename T::Input& val)
+// Identifies an immediate by its type and value, so that storeI can find an
+// equal immediate without comparing against each of them.
+template <typename T> std::string immediateKey(const typename T::Input& val)
 {
-    auto& immediates = context.immediates();
-    const auto ret = immediates.size();
-    for (size_t i = 0; i < immediates.size(); ++i) {
-        if (isType<T>(immediates[i])) {
-            if (immediates[i].cast<T>()->value() == val) {
-                return i;
-            }
-        }
-    }
-    immediates.push_back(context.topLevel().create<T>(val));
-    return ret;
+    std::string key(1, (char)typeId<T>());
+    key.append(reinterpret_cast<const char*>(&val), sizeof val);
+    return key;
 }
 
-template <>
-inline ImmediateId storeI<Symbol>(Context& context, const Heap::Ptr<String>& val)
+template <> std::string immediateKey<String>(const std::string& val);
+template <> std::string immediateKey<Symbol>(const Heap::Ptr<String>& val);
+
+template <typename T>
+ImmediateId storeI(Context& context, const typename T::Input& val)
 {
     auto& immediates = context.immediates();
-    const auto ret = immediates.size();
-    for (size_t i = 0; i < immediates.size(); ++i) {
-        if (isType<Symbol>(immediates[i])) {
-            if (*immediates[i].cast<Symbol>()->value() == *val) {
-                return i;
-            }
-        }
+    auto& index = context.immediateIndex();
+    auto key = immediateKey<T>(val);
+    auto found = index.find(key);
+    if (found not_eq index.end()) {
+        return found->second;
     }
-    immediates.push_back(context.topLevel().create<Symbol>(val));
+    const ImmediateId ret = immediates.size();
+    immediates.push_back(context.topLevel().create<T>(val));
+    index.emplace(std::move(key), ret);
     return ret;
 }
 
@@ -2,8 +2,15 @@
 #include "environment.hpp"
 #include "memory.hpp"
 #include "persistent.hpp"
+#include "spinlock.hpp"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
 #include <deque>
-#include <set>
+#include <functional>
+#include <iterator>
+#include <mutex>
+#include <thread>
 
 // FIXME: This code could use a good deal of work! On the one hand,
 // it's a reasonably performant mark/compact collector in less than
@@ -11,208 +18,911 @@
 
 namespace ebl {
 
-static void markFrame(Environment& frame);
+// Guards the list of contexts, along with their remembered and shaded sets,
+// which parallel compaction adds to from several threads at once.
+static Spinlock contextsLock;
+static std::vector<Context*> contexts;
 
-static void markValue(ValuePtr val)
+void registerContext(Context& ctx)
 {
-    if (val->marked()) {
-        return;
+    std::lock_guard<Spinlock> guard(contextsLock);
+    contexts.push_back(&ctx);
+}
+
+void unregisterContext(Context& ctx)
+{
+    std::lock_guard<Spinlock> guard(contextsLock);
+    contexts.erase(std::find(contexts.begin(), contexts.end(), &ctx));
+}
+
+// Callers hold contextsLock.
+static Context* owningContext(const Value* val)
+{
+    for (auto ctx : contexts) {
+        if (ctx->owns(val)) {
+            return ctx;
+        }
     }
-    val->mark();
-    switch (val->typeId()) {
-    case typeId<Pair>():
-        markValue(val.cast<Pair>()->getCar());
-        markValue(val.cast<Pair>()->getCdr());
-        break;
+    return nullptr;
+}
 
-    case typeId<Function>():
-        markFrame(*val.cast<Function>()->definitionEnvironment());
-        markValue(val.cast<Function>()->getDocstring());
-        break;
+// The write barrier only calls this the first time that an old value points
+// into the nursery, so the lookup stays off of the fast path.
+void rememberValue(Value* owner)
+{
+    std::lock_guard<Spinlock> guard(contextsLock);
+    if (auto ctx = owningContext(owner)) {
+        owner->setRemembered(true);
+        ctx->rememberedValues().push_back(owner);
+    }
+}
 
-    case typeId<Symbol>():
-        markValue(val.cast<Symbol>()->value());
-        break;
+std::atomic<int> incrementalMarkers{0};
 
-    case typeId<Box>():
-        markValue(val.cast<Box>()->get());
-        break;
+// Like the write barrier, the deletion barrier only runs this while some
+// context is marking, so the lookup stays off of the fast path.
+void shadeValue(Value* val)
+{
+    std::lock_guard<Spinlock> guard(contextsLock);
+    auto ctx = owningContext(val);
+    if (ctx and ctx->markingIncrementally()) {
+        ctx->shadedValues().push_back(val);
     }
 }
 
-static void markFrame(Environment& frame)
+// Empties the context's remembered set, and returns its entries.
+static std::vector<Value*> takeRemembered(Context& ctx)
 {
-    for (auto& val : frame.getVars()) {
-        markValue(val);
+    std::vector<Value*> taken;
+    std::swap(taken, ctx.rememberedValues());
+    for (auto val : taken) {
+        val->setRemembered(false);
+    }
+    return taken;
+}
+
+template <typename F> static void forEachValue(Heap& heap, F&& callback)
+{
+    size_t index = 0;
+    while (index < heap.size()) {
+        auto current = (Value*)(heap.begin() + index);
+        index += typeInfo(current).size_;
+        callback(current);
+    }
+}
+
+// Adapts callbacks to the Tracer interface. OnFrame receives the definition
+// environments of functions.
+template <typename Update, typename OnFrame>
+class CallbackTracer : public Tracer {
+public:
+    CallbackTracer(Update& update, OnFrame& onFrame)
+        : Tracer(true), update_(update), onFrame_(onFrame)
+    {
+    }
+
+    ValuePtr visit(ValuePtr val) override
+    {
+        return update_(val);
+    }
+
+    void visitFrame(Environment& frame) override
+    {
+        onFrame_(frame);
+    }
+
+private:
+    Update& update_;
+    OnFrame& onFrame_;
+};
+
+// Replaces each heap pointer stored within val with the result of
+// update(pointer), and passes any environment that val references to onFrame.
+// The setters run the write barrier, so updating an old value with pointers
+// into the nursery re-adds it to the remembered set.
+template <typename F, typename G>
+static void updateFields(Value* val, F&& update, G&& onFrame)
+{
+    if (auto trace = typeInfo(val).trace) {
+        CallbackTracer<F, G> tracer(update, onFrame);
+        trace(val, tracer);
     }
 }
 
-void MarkCompact::mark(Environment& env)
+template <typename F> static void updateFields(Value* val, F&& update)
+{
+    updateFields(val, update, [](Environment&) {});
+}
+
+template <typename F> static void updateFrame(Environment& frame, F&& update)
 {
-    for (auto& frameInfo : env.getContext()->callStack()) {
-        markFrame(*frameInfo.env_);
+    for (auto& val : frame.getVars()) {
+        val = update(val);
+        frame.writeBarrier(val);
     }
-    for (auto& val : env.getContext()->immediates()) {
-        markValue(val);
+}
+
+template <typename F> static void updateRoots(Context& ctx, F&& update)
+{
+    for (auto& val : ctx.immediates()) {
+        val = update(val);
     }
-    for (auto& val : env.getContext()->operandStack()) {
-        markValue(val);
+    for (auto& val : ctx.operandStack()) {
+        val = update(val);
     }
-    auto plist = env.getContext()->getPersistentsList();
+    auto plist = ctx.getPersistentsList();
     while (plist) {
-        markValue(plist->getUntypedVal());
-        plist = plist->next();
+        plist->UNSAFE_overwrite(update(plist->getUntypedVal()));
+        plist = plist->prev();
+    }
+    for (auto root : ctx.argumentRoots()) {
+        root->UNSAFE_overwrite(update(root->cast<Value>()).handle());
     }
-    env.getBool(true)->mark();
-    env.getBool(false)->mark();
-    env.getNull()->mark();
 }
 
-using BreakList = std::vector<std::pair<Value*, size_t>>;
+// Runs a task on several threads at once, the calling thread included.
+class WorkerPool {
+public:
+    using Task = std::function<void(size_t)>;
 
-static void* remapValueAddress(void* val, const BreakList& breaks)
+    WorkerPool(size_t helpers)
+    {
+        for (size_t i = 0; i < helpers; ++i) {
+            threads_.emplace_back([this, i] { loop(i + 1); });
+        }
+    }
+
+    ~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            exit_ = true;
+        }
+        wake_.notify_all();
+        for (auto& thread : threads_) {
+            thread.join();
+        }
+    }
+
+    // Calls task(workerIndex) on every thread, and waits for all of them to
+    // finish. The calling thread is worker zero.
+    void run(const Task& task)
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            task_ = &task;
+            pending_ = threads_.size();
+            ++generation_;
+        }
+        wake_.notify_all();
+        task(0);
+        std::unique_lock<std::mutex> guard(lock_);
+        done_.wait(guard, [this] { return pending_ == 0; });
+    }
+
+private:
+    void loop(size_t index)
+    {
+        size_t generation = 0;
+        std::unique_lock<std::mutex> guard(lock_);
+        while (true) {
+            wake_.wait(guard,
+                       [&] { return exit_ or generation not_eq generation_; });
+            if (exit_) {
+                return;
+            }
+            generation = generation_;
+            auto task = task_;
+            guard.unlock();
+            (*task)(index);
+            guard.lock();
+            if (--pending_ == 0) {
+                done_.notify_one();
+            }
+        }
+    }
+
+    std::vector<std::thread> threads_;
+    std::mutex lock_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    const Task* task_ = nullptr;
+    size_t generation_ = 0;
+    size_t pending_ = 0;
+    bool exit_ = false;
+};
+
+struct MarkCompact::Worker {
+    size_t index_;
+    std::vector<Value*> markStack_;
+    // Values that other workers may steal, see publish().
+    std::mutex lock_;
+    std::deque<Value*> shared_;
+    std::vector<Environment*> frames_;
+};
+
+MarkCompact::MarkCompact(size_t threads)
+    : pool_(threads > 1 ? new WorkerPool(threads - 1) : nullptr),
+      markStackOverflowed_(false), sharedValues_(0), idleWorkers_(0)
 {
-    size_t shiftAmount = 0;
-    auto iter = breaks.begin();
-    while (iter not_eq breaks.end() and iter->first < val) {
-        shiftAmount += iter->second;
-        ++iter;
+    for (size_t i = 0; i < std::max(threads, size_t(1)); ++i) {
+        workers_.emplace_back(new Worker);
+        workers_.back()->index_ = i;
     }
-    return (uint8_t*)val - shiftAmount;
 }
 
-// Frames must be visited exactly once! FIXME: but the var shouldn't be global.
-thread_local std::set<Environment*> frameSet;
+MarkCompact::~MarkCompact()
+{
+    if (incremental_) {
+        endIncrementalMark();
+    }
+}
 
-static void remapFrame(Environment& frame, const BreakList& breaks)
+template <typename F> static void runWorkers(WorkerPool* pool, F&& task)
 {
-    for (auto& val : frame.getVars()) {
-        val.UNSAFE_overwrite(remapValueAddress(val.handle(), breaks));
+    if (pool) {
+        pool->run(task);
+    } else {
+        task(0);
+    }
+}
+
+// Hands out work units numbered from zero, in increasing order.
+class WorkCounter {
+public:
+    WorkCounter(size_t count) : next_(0), count_(count)
+    {
+    }
+
+    bool take(size_t& unit)
+    {
+        unit = next_++;
+        return unit < count_;
+    }
+
+private:
+    std::atomic<size_t> next_;
+    const size_t count_;
+};
+
+void MarkCompact::markValue(Worker& worker, Value* val)
+{
+    if (incremental_ and val->young()) {
+        // Values created since marking began are live, and they'd be gone
+        // from the nursery by the next slice anyway.
+        return;
+    }
+    if (parallel()) {
+        if (not val->tryMark()) {
+            return;
+        }
+    } else if (val->marked()) {
+        return;
+    } else {
+        val->mark();
+    }
+    if (not typeInfo(val).trace) {
+        return;
+    }
+    if (worker.markStack_.size() < markStackCapacity) {
+        worker.markStack_.push_back(val);
+    } else {
+        // The value stays marked, and gets traced when we rescan the heap, see
+        // mark().
+        markStackOverflowed_ = true;
     }
 }
 
-static void gatherFrames(Environment& env)
+void MarkCompact::markFrame(Worker& worker, Environment& frame)
 {
-    auto current = env.reference();
-    while (current) {
-        frameSet.insert(current.get());
-        current = current->parent();
+    auto current = &frame;
+    while (current and current->markTraced(cycle_)) {
+        worker.frames_.push_back(current);
+        for (auto& val : current->getVars()) {
+            markValue(worker, val);
+        }
+        current = current->parent().get();
     }
 }
 
-static void remapInternalPointers(Value* val, const BreakList& breaks)
+struct MarkCompact::MarkTracer : public Tracer {
+    MarkTracer(MarkCompact& collector, Worker& worker)
+        : Tracer(false), collector_(collector), worker_(worker)
+    {
+    }
+
+    ValuePtr visit(ValuePtr val) override
+    {
+        collector_.markValue(worker_, val);
+        return val;
+    }
+
+    void visitFrame(Environment& frame) override
+    {
+        collector_.markFrame(worker_, frame);
+    }
+
+    MarkCompact& collector_;
+    Worker& worker_;
+};
+
+void MarkCompact::trace(Worker& worker, Value* val)
 {
-    switch (val->typeId()) {
-    case typeId<Pair>(): {
+    // Lists are marked by looping down the cdr chain, so only the cars go on
+    // the mark stack.
+    while (isType<Pair>(val)) {
         auto p = (Pair*)val;
-        auto car = p->getCar();
+        markValue(worker, p->getCar());
         auto cdr = p->getCdr();
-        car.UNSAFE_overwrite(remapValueAddress(car.handle(), breaks));
-        cdr.UNSAFE_overwrite(remapValueAddress(cdr.handle(), breaks));
-        p->setCar(car);
-        p->setCdr(cdr);
-    } break;
+        if (isImmediate(cdr) or
+            not(parallel() ? cdr->tryMark()
+                           : (not cdr->marked() and (cdr->mark(), true)))) {
+            return;
+        }
+        val = cdr.get();
+    }
+    if (auto traceFn = typeInfo(val).trace) {
+        MarkTracer tracer(*this, worker);
+        traceFn(val, tracer);
+    }
+}
 
-    case typeId<Symbol>(): {
-        auto s = (Symbol*)val;
-        auto val = s->value();
-        val.UNSAFE_overwrite(remapValueAddress(val.handle(), breaks));
-        s->set(val);
-    } break;
+void MarkCompact::drain(Worker& worker)
+{
+    static const size_t publishThreshold = 256;
+    while (not worker.markStack_.empty()) {
+        auto val = worker.markStack_.back();
+        worker.markStack_.pop_back();
+        trace(worker, val);
+        if (sharing_ and worker.markStack_.size() >= publishThreshold) {
+            publish(worker);
+        }
+    }
+}
 
-    case typeId<Box>(): {
-        auto b = (Box*)val;
-        auto val = b->get();
-        val.UNSAFE_overwrite(remapValueAddress(val.handle(), breaks));
-        b->set(val);
-    } break;
+void MarkCompact::publish(Worker& worker)
+{
+    // The oldest entries on the stack tend to lead to the most unmarked
+    // values, so those are the ones worth handing to other workers.
+    auto& stack = worker.markStack_;
+    const auto count = stack.size() / 2;
+    {
+        std::lock_guard<std::mutex> guard(worker.lock_);
+        worker.shared_.insert(worker.shared_.end(), stack.begin(),
+                              stack.begin() + count);
+    }
+    stack.erase(stack.begin(), stack.begin() + count);
+    sharedValues_ += count;
+}
 
-    case typeId<Function>(): {
-        auto f = (Function*)val;
-        auto doc = f->getDocstring();
-        doc.UNSAFE_overwrite(remapValueAddress(doc.handle(), breaks));
-        f->setDocstring(doc);
-        gatherFrames(*f->definitionEnvironment());
-        break;
+bool MarkCompact::steal(Worker& worker)
+{
+    for (size_t i = 0; i < workers_.size(); ++i) {
+        auto& victim = *workers_[(worker.index_ + i) % workers_.size()];
+        std::lock_guard<std::mutex> guard(victim.lock_);
+        if (victim.shared_.empty()) {
+            continue;
+        }
+        const auto count = std::max(victim.shared_.size() / 2, size_t(1));
+        worker.markStack_.insert(worker.markStack_.end(),
+                                 victim.shared_.begin(),
+                                 victim.shared_.begin() + count);
+        victim.shared_.erase(victim.shared_.begin(),
+                             victim.shared_.begin() + count);
+        sharedValues_ -= count;
+        return true;
     }
+    return false;
+}
+
+void MarkCompact::markInParallel(Worker& worker)
+{
+    while (true) {
+        drain(worker);
+        if (steal(worker)) {
+            continue;
+        }
+        // Marking is finished once every worker has run out of values, as
+        // idle workers never share anything new.
+        ++idleWorkers_;
+        while (true) {
+            if (idleWorkers_ == workers_.size()) {
+                return;
+            }
+            if (sharedValues_ > 0) {
+                --idleWorkers_;
+                if (steal(worker)) {
+                    break;
+                }
+                ++idleWorkers_;
+            }
+            std::this_thread::yield();
+        }
     }
 }
 
-void MarkCompact::compact(Environment& env, Heap& heap)
+void MarkCompact::mark(Environment& env, Heap& heap)
+{
+    auto ctx = env.getContext();
+    auto& first = *workers_.front();
+    frames_.clear();
+    markStackOverflowed_ = false;
+    cycle_ = ctx->gcCycle();
+    for (auto& frameInfo : ctx->callStack()) {
+        markFrame(first, *frameInfo.env_);
+    }
+    updateRoots(*ctx, [&](ValuePtr val) {
+        markValue(first, val);
+        return val;
+    });
+
+    if (parallel()) {
+        // Make the roots available to every worker.
+        first.shared_.assign(first.markStack_.begin(), first.markStack_.end());
+        sharedValues_ = first.markStack_.size();
+        first.markStack_.clear();
+        idleWorkers_ = 0;
+        sharing_ = true;
+        runWorkers(pool_.get(),
+                   [this](size_t index) { markInParallel(*workers_[index]); });
+        sharing_ = false;
+    } else {
+        drain(first);
+    }
+    retraceOverflow(env, heap);
+
+    for (auto& worker : workers_) {
+        frames_.insert(frames_.end(), worker->frames_.begin(),
+                       worker->frames_.end());
+        worker->frames_.clear();
+    }
+}
+
+void MarkCompact::retraceOverflow(Environment& env, Heap& heap)
+{
+    // If a mark stack filled up, some marked values never had their contents
+    // traced. Tracing every marked value again finds them, and the stack is
+    // bounded, so each pass either makes progress or finishes.
+    auto& first = *workers_.front();
+    while (markStackOverflowed_) {
+        markStackOverflowed_ = false;
+        auto retrace = [&](Value* val) {
+            if (val->marked()) {
+                trace(first, val);
+                drain(first);
+            }
+        };
+        forEachValue(heap, retrace);
+        forEachValue(env.getContext()->nursery(), retrace);
+    }
+}
+
+void MarkCompact::beginIncrementalMark(Environment& env)
+{
+    auto ctx = env.getContext();
+    auto& first = *workers_.front();
+    markStackOverflowed_ = false;
+    // NOTE: nursery collections will bump the context's cycle while we're
+    // still marking, and the scavenger stops tracing at old frames, so the
+    // marker can't share its cycle number with the scavenger.
+    cycle_ = ctx->gcCycle();
+    for (auto& frameInfo : ctx->callStack()) {
+        markFrame(first, *frameInfo.env_);
+    }
+    updateRoots(*ctx, [&](ValuePtr val) {
+        markValue(first, val);
+        return val;
+    });
+    incremental_ = true;
+    incrementalFinished_ = false;
+    ++incrementalMarkers;
+}
+
+void MarkCompact::endIncrementalMark()
+{
+    incremental_ = false;
+    --incrementalMarkers;
+}
+
+void MarkCompact::abortIncrementalMark(Environment& env, Heap& heap)
+{
+    endIncrementalMark();
+    {
+        std::lock_guard<Spinlock> guard(contextsLock);
+        env.getContext()->shadedValues().clear();
+    }
+    for (auto& worker : workers_) {
+        worker->markStack_.clear();
+        worker->frames_.clear();
+    }
+    auto unmark = [](Value* val) { val->unmark(); };
+    forEachValue(heap, unmark);
+    forEachValue(env.getContext()->nursery(), unmark);
+}
+
+void MarkCompact::markShaded(Worker& worker, Context& ctx)
+{
+    std::vector<Value*> shaded;
+    {
+        std::lock_guard<Spinlock> guard(contextsLock);
+        std::swap(shaded, ctx.shadedValues());
+    }
+    for (auto val : shaded) {
+        markValue(worker, val);
+    }
+}
+
+bool MarkCompact::markSlice(Environment& env, Heap& heap,
+                            std::chrono::nanoseconds budget)
+{
+    using namespace std::chrono;
+    const auto deadline = steady_clock::now() + budget;
+    auto& first = *workers_.front();
+    markShaded(first, *env.getContext());
+    size_t traced = 0;
+    while (not first.markStack_.empty()) {
+        auto val = first.markStack_.back();
+        first.markStack_.pop_back();
+        trace(first, val);
+        if (++traced % 64 == 0 and steady_clock::now() > deadline) {
+            return false;
+        }
+    }
+    retraceOverflow(env, heap);
+    incrementalFinished_ = true;
+    return true;
+}
+
+void MarkCompact::finishIncrementalMark(Environment& env, Heap& heap)
+{
+    auto ctx = env.getContext();
+    auto& first = *workers_.front();
+    markShaded(first, *ctx);
+    drain(first);
+    retraceOverflow(env, heap);
+    endIncrementalMark();
+
+    // Values created while marking are live, but they were never traced, so
+    // we have to search for the frames that compaction needs to fix up.
+    for (auto& worker : workers_) {
+        worker->frames_.clear();
+    }
+    frames_.clear();
+    const auto cycle = ctx->gcCycle();
+    auto gather = [&](Environment* frame) {
+        while (frame and frame->markTraced(cycle)) {
+            frames_.push_back(frame);
+            frame = frame->parent().get();
+        }
+    };
+    for (auto& frameInfo : ctx->callStack()) {
+        gather(frameInfo.env_);
+    }
+    forEachValue(heap, [&](Value* val) {
+        if (val->marked() and isType<Function>(val)) {
+            gather(((Function*)val)->definitionEnvironment().get());
+        }
+    });
+    // Everything in the nursery was created after marking began.
+    forEachValue(ctx->nursery(), [&](Value* val) {
+        val->mark();
+        if (isType<Function>(val)) {
+            gather(((Function*)val)->definitionEnvironment().get());
+        }
+    });
+}
+
+// Each entry holds the address of a run of dead values, along with the total
+// number of bytes freed up to and including the run. Entries are sorted by
+// address, so remapping a pointer is a binary search for the closest break
+// below it.
+using BreakList = std::vector<std::pair<Value*, size_t>>;
+
+static void* remapValueAddress(void* val, const BreakList& breaks)
+{
+    auto iter = std::lower_bound(
+        breaks.begin(), breaks.end(), val,
+        [](const BreakList::value_type& brk, void* v) { return brk.first < v; });
+    if (iter == breaks.begin()) {
+        return val;
+    }
+    return (uint8_t*)val - std::prev(iter)->second;
+}
+
+// A slice of the heap that one worker compacts. Values only ever slide
+// towards the beginning of the heap, so a region's destination can only
+// overlap with regions that come before it. When the heap is resized,
+// regions move to a new block instead, and never overlap.
+struct Region {
+    uint8_t* begin_;
+    uint8_t* end_;
+    uint8_t* dest_;
+    size_t live_;
+    BreakList breaks_;
+    std::atomic<bool> moved_;
+};
+
+template <typename F>
+static void forEachValue(uint8_t* begin, uint8_t* end, F&& callback)
+{
+    while (begin < end) {
+        auto current = (Value*)begin;
+        begin += typeInfo(current).size_;
+        callback(current);
+    }
+}
+
+// Finalizes the dead values in a region, and records where the dead runs are.
+static void sweep(Region& region)
 {
-    BreakList breakList;
     size_t bytesCompacted = 0;
-    size_t index = 0;
     bool collapse = false; // collapse consecutive vals
-    while (index < heap.size()) {
-        auto current = (Value*)(heap.begin() + index);
+    region.live_ = 0;
+    forEachValue(region.begin_, region.end_, [&](Value* current) {
         const size_t currentSize = typeInfo(current).size_;
         if (current->marked()) {
-        PRESERVE:
-            current->unmark();
             collapse = false;
-            if (bytesCompacted) {
-                uint8_t* const dest = ((uint8_t*)current) - bytesCompacted;
-                typeInfo(current).relocatePolicy(current, dest);
-            }
+            region.live_ += currentSize;
         } else {
-            if (isType<String>(current)) {
-                auto s = (String*)current;
-                for (size_t i = 0; i < s->length(); ++i) {
-                    // If there are any outstanding references to the characters
-                    // belonging to the string, we can't collect it yet.
-                    if ((*s)[i]->marked())
-                        goto PRESERVE;
-                }
-            }
+            typeInfo(current).finalizer(current);
+            bytesCompacted += currentSize;
             if (not collapse) {
-                breakList.push_back({current, currentSize});
+                region.breaks_.push_back({current, bytesCompacted});
                 collapse = true;
             } else {
-                breakList.back().second += currentSize;
+                region.breaks_.back().second = bytesCompacted;
+            }
+        }
+    });
+}
+
+static void slide(std::vector<Region>& regions, size_t index, bool inPlace)
+{
+    auto& region = regions[index];
+    for (size_t i = 0; inPlace and i < index; ++i) {
+        if (regions[i].end_ > region.dest_) {
+            while (not regions[i].moved_.load(std::memory_order_acquire)) {
+                std::this_thread::yield();
             }
-            bytesCompacted += currentSize;
         }
-        index += currentSize;
     }
-    heap.compacted(bytesCompacted);
-    index = 0;
-    while (index < heap.size()) {
-        auto current = (Value*)(heap.begin() + index);
+    auto dest = region.dest_;
+    // NOTE: dead values were finalized during the sweep, but their headers
+    // are still intact, so we can still step over them.
+    forEachValue(region.begin_, region.end_, [&](Value* current) {
         const size_t currentSize = typeInfo(current).size_;
-        remapInternalPointers(current, breakList);
-        index += currentSize;
+        if (current->marked()) {
+            current->unmark();
+            if (dest not_eq (uint8_t*)current) {
+                typeInfo(current).relocatePolicy(current, dest);
+            }
+            dest += currentSize;
+        }
+    });
+    region.moved_.store(true, std::memory_order_release);
+}
+
+void MarkCompact::compact(Environment& env, Heap& heap)
+{
+    using namespace std::chrono;
+    auto ctx = env.getContext();
+    auto start = steady_clock::now();
+
+    // Compaction rebuilds the remembered set from scratch, see updateFields.
+    takeRemembered(*ctx);
+    for (auto& frame : ctx->rememberedFrames()) {
+        frame->forget();
+    }
+    ctx->rememberedFrames().clear();
+
+    // Split the heap into a few regions per worker, so that workers waiting
+    // on a region's destination to be vacated have something else to do.
+    const size_t regionCount = parallel() ? workers_.size() * 4 : 1;
+    const size_t regionSize = heap.size() / regionCount + 1;
+    std::vector<uint8_t*> bounds{heap.begin()};
+    if (parallel()) {
+        forEachValue(heap, [&](Value* current) {
+            if ((uint8_t*)current - bounds.back() >= (ptrdiff_t)regionSize) {
+                bounds.push_back((uint8_t*)current);
+            }
+        });
     }
-    for (auto& frameInfo : env.getContext()->callStack()) {
-        gatherFrames(*frameInfo.env_);
+    bounds.push_back(heap.end());
+    std::vector<Region> regions(bounds.size() - 1);
+    for (size_t i = 0; i < regions.size(); ++i) {
+        regions[i].begin_ = bounds[i];
+        regions[i].end_ = bounds[i + 1];
     }
-    for (auto& frame : frameSet) {
-        remapFrame(*frame, breakList);
+
+    WorkCounter sweepCounter(regions.size());
+    runWorkers(pool_.get(), [&](size_t) {
+        size_t index;
+        while (sweepCounter.take(index)) {
+            sweep(regions[index]);
+        }
+    });
+
+    size_t liveBytes = 0;
+    for (auto& region : regions) {
+        liveBytes += region.live_;
     }
-    frameSet.clear();
-    for (auto& val : env.getContext()->immediates()) {
-        auto target = remapValueAddress(val.handle(), breakList);
-        val.UNSAFE_overwrite(target);
+    Heap resized;
+    const auto capacity = ctx->heapCapacityFor(liveBytes);
+    if (capacity not_eq heap.capacity()) {
+        resized.init(capacity);
     }
-    for (auto& val : env.getContext()->operandStack()) {
-        auto target = remapValueAddress(val.handle(), breakList);
-        val.UNSAFE_overwrite(target);
+    const bool inPlace = resized.capacity() == 0;
+    const auto destBegin = inPlace ? heap.begin() : resized.begin();
+
+    BreakList breakList;
+    size_t bytesCompacted = 0;
+    auto dest = destBegin;
+    for (auto& region : regions) {
+        region.dest_ = dest;
+        region.moved_ = false;
+        dest += region.live_;
+        for (auto& brk : region.breaks_) {
+            breakList.push_back({brk.first, brk.second + bytesCompacted});
+        }
+        bytesCompacted += (region.end_ - region.begin_) - region.live_;
     }
-    auto plist = env.getContext()->getPersistentsList();
-    while (plist) {
-        auto val = plist->getUntypedVal();
-        auto target = remapValueAddress(val.handle(), breakList);
-        val.UNSAFE_overwrite(target);
-        plist->UNSAFE_overwrite(val);
-        plist = plist->next();
+
+    WorkCounter slideCounter(regions.size());
+    runWorkers(pool_.get(), [&](size_t) {
+        size_t index;
+        while (slideCounter.take(index)) {
+            slide(regions, index, inPlace);
+        }
+    });
+
+    const auto oldBegin = heap.begin();
+    const auto oldEnd = heap.end();
+    if (inPlace) {
+        heap.compacted(bytesCompacted);
+    } else {
+        // NOTE: remapping only does arithmetic on the old addresses, so the
+        // old block can go away before the fixup.
+        resized.alloc(liveBytes);
+        heap = std::move(resized);
     }
+
+    auto fixupStart = steady_clock::now();
+    ctx->gcStat().compactTime_ += duration_cast<nanoseconds>(fixupStart - start);
+
+    // Only pointers into the heap need to be remapped. Values in the nursery,
+    // along with characters stored within strings, stay where they are.
+    auto remap = [&](ValuePtr val) {
+        if (not isImmediate(val) and val.handle() >= oldBegin and
+            val.handle() < oldEnd) {
+            auto addr = (uint8_t*)remapValueAddress(val.handle(), breakList);
+            val.UNSAFE_overwrite(destBegin + (addr - oldBegin));
+        }
+        return val;
+    };
+    WorkCounter fixupCounter(regions.size());
+    runWorkers(pool_.get(), [&](size_t) {
+        size_t index;
+        while (fixupCounter.take(index)) {
+            auto& region = regions[index];
+            forEachValue(region.dest_, region.dest_ + region.live_,
+                         [&](Value* val) { updateFields(val, remap); });
+        }
+    });
+    forEachValue(ctx->nursery(), [&](Value* val) {
+        if (val->marked()) {
+            val->unmark();
+            updateFields(val, remap);
+        }
+    });
+    for (auto frame : frames_) {
+        updateFrame(*frame, remap);
+    }
+    frames_.clear();
+    updateRoots(*ctx, remap);
+    ctx->gcStat().fixupTime_ +=
+        duration_cast<nanoseconds>(steady_clock::now() - fixupStart);
 }
 
 
 void MarkCompact::run(Environment& env, Heap& heap)
 {
-    mark(env);
+    using namespace std::chrono;
+    const auto start = steady_clock::now();
+    if (incrementalMarkFinished()) {
+        finishIncrementalMark(env, heap);
+    } else {
+        if (incremental_) {
+            abortIncrementalMark(env, heap);
+        }
+        mark(env, heap);
+    }
+    env.getContext()->gcStat().markTime_ +=
+        duration_cast<nanoseconds>(steady_clock::now() - start);
     compact(env, heap);
 }
 
+
+// Once a value has been evacuated, the scavenger reuses the value's old
+// storage to record where it went. Values are at least eight bytes, so there's
+// room for a word offset after the header.
+static uint32_t& forwardingIndex(Value* val)
+{
+    static_assert(sizeof(Value) <= sizeof(uint32_t), "no room for forwarding");
+    return *(uint32_t*)((uint8_t*)val + sizeof(uint32_t));
+}
+
+void Scavenger::run(Environment& env, Heap& nursery, Heap& heap,
+                    bool markPromoted)
+{
+    auto ctx = env.getContext();
+    const auto cycle = ctx->gcCycle();
+    uint8_t* scan = heap.end();
+
+    auto promote = [&](Value* src) {
+        const auto& info = typeInfo(src);
+        auto dest = heap.alloc(info.size_).handle();
+        info.relocatePolicy(src, dest);
+        ((Value*)dest)->setYoung(false);
+        if (markPromoted) {
+            ((Value*)dest)->mark();
+        }
+        src->setForwarded();
+        forwardingIndex(src) = (dest - heap.begin()) / Heap::Align;
+    };
+
+    auto evacuate = [&](ValuePtr val) {
+        const auto handle = val.handle();
+        if (not isImmediate(handle) and nursery.contains(handle)) {
+            auto src = (Value*)handle;
+            if (not src->forwarded()) {
+                promote(src);
+            }
+            val.UNSAFE_overwrite(heap.begin() +
+                                 size_t(forwardingIndex(src)) * Heap::Align);
+        }
+        return val;
+    };
+
+    // Frames created since the last scavenge are traced along with the values
+    // that reference them. Older frames only need to be traced if the write
+    // barrier remembered them.
+    auto traceFrame = [&](Environment* frame) {
+        while (frame and frame->isYoung() and frame->markTraced(cycle)) {
+            updateFrame(*frame, evacuate);
+            frame = frame->parent().get();
+        }
+    };
+
+    auto traceValue = [&](Value* val) {
+        updateFields(val, evacuate,
+                     [&](Environment& frame) { traceFrame(&frame); });
+    };
+
+    for (auto& frameInfo : ctx->callStack()) {
+        traceFrame(frameInfo.env_);
+    }
+    updateRoots(*ctx, evacuate);
+    for (auto val : takeRemembered(*ctx)) {
+        traceValue(val);
+    }
+    for (auto& frame : ctx->rememberedFrames()) {
+        frame->forget();
+        updateFrame(*frame, evacuate);
+    }
+    ctx->rememberedFrames().clear();
+
+    while (scan < heap.end()) {
+        auto current = (Value*)scan;
+        scan += typeInfo(current).size_;
+        traceValue(current);
+    }
+
+    forEachValue(nursery, [&](Value* val) {
+        if (not val->forwarded()) {
+            typeInfo(val).finalizer(val);
+        }
+    });
+    nursery.clear();
+}
+
 } // namespace ebl
@@ -1,11 +1,22 @@
 #pragma once
 
 #include "memory.hpp"
+#include "types.hpp"
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <vector>
 
 namespace ebl {
 
+class Context;
 class Environment;
 
+// The write barrier only sees values, so it looks up the context whose heap
+// holds a value among the live contexts, which register themselves here.
+void registerContext(Context& ctx);
+void unregisterContext(Context& ctx);
+
 class GC {
 public:
     virtual void run(Environment& env, Heap& heap) = 0;
@@ -14,11 +25,100 @@ public:
     }
 };
 
+class WorkerPool;
+
+// Collects the whole heap. Values in the nursery are traced, but not moved,
+// the Scavenger takes care of them afterwards.
+//
+// With more than one thread, marking is split across workers that steal
+// values from each other's mark stacks, and the heap is split into regions
+// that are compacted and fixed up in parallel.
 class MarkCompact : public GC {
 public:
+    MarkCompact(size_t threads = 1);
+    ~MarkCompact();
+
     void run(Environment& env, Heap& heap) override;
-    void mark(Environment& env);
+    void mark(Environment& env, Heap& heap);
     void compact(Environment& env, Heap& heap);
+
+    // Incremental marking takes a snapshot of the roots, and then marks in
+    // slices between runs of the mutator. The deletion barrier makes sure that
+    // everything reachable from the snapshot gets marked, and values created
+    // since then are implicitly live, so the collector must only begin
+    // marking when the nursery is empty. Compaction is not incremental: once
+    // marking finishes, the next call to run() compacts the heap. If run() is
+    // called before then, the collector starts over and marks the whole heap
+    // at once, rather than keeping everything promoted during the cycle.
+    void beginIncrementalMark(Environment& env);
+
+    // Marks for roughly budget, and returns true once marking has finished.
+    bool markSlice(Environment& env, Heap& heap,
+                   std::chrono::nanoseconds budget);
+
+    bool incrementalMarking() const
+    {
+        return incremental_;
+    }
+
+    bool incrementalMarkFinished() const
+    {
+        return incremental_ and incrementalFinished_;
+    }
+
+    // Limits each worker's mark stack to half a megabyte, past that, marking
+    // falls back to rescanning the heap.
+    static constexpr const size_t markStackCapacity = 65536;
+
+private:
+    struct Worker;
+    struct MarkTracer;
+
+    bool parallel() const
+    {
+        return workers_.size() > 1;
+    }
+
+    void markValue(Worker& worker, Value* val);
+    void markValue(Worker& worker, ValuePtr val)
+    {
+        if (not isImmediate(val)) {
+            markValue(worker, val.get());
+        }
+    }
+    void markFrame(Worker& worker, Environment& frame);
+    void trace(Worker& worker, Value* val);
+    void drain(Worker& worker);
+    void publish(Worker& worker);
+    bool steal(Worker& worker);
+    void markInParallel(Worker& worker);
+    void retraceOverflow(Environment& env, Heap& heap);
+    void markShaded(Worker& worker, Context& ctx);
+    void finishIncrementalMark(Environment& env, Heap& heap);
+    void endIncrementalMark();
+    void abortIncrementalMark(Environment& env, Heap& heap);
+
+    std::unique_ptr<WorkerPool> pool_;
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::atomic<bool> markStackOverflowed_;
+    std::atomic<size_t> sharedValues_;
+    std::atomic<size_t> idleWorkers_;
+    bool sharing_ = false;
+    bool incremental_ = false;
+    bool incrementalFinished_ = false;
+    size_t cycle_ = 0;
+    std::vector<Environment*> frames_;
+};
+
+// Copies values that survived their stay in the nursery over to the heap,
+// then empties the nursery. The Scavenger only traces the roots and values
+// that the write barrier recorded as pointing into the nursery, so its cost
+// scales with the number of survivors rather than with the size of the heap.
+class Scavenger {
+public:
+    // While the heap is being marked incrementally, promoted values must be
+    // marked too, see MarkCompact::beginIncrementalMark.
+    void run(Environment& env, Heap& nursery, Heap& heap, bool markPromoted);
 };
 
 } // namespace ebl
@@ -0,0 +1,847 @@
+#include "jit.hpp"
+#include "bytecode.hpp"
+#include "ebl.hpp"
+#include "listBuilder.hpp"
+#include "operations.hpp"
+#include "persistent.hpp"
+#include <cstring>
+#include <exception>
+
+#if defined(__x86_64__) and not defined(_WIN32)
+#define EBL_JIT_X86_64
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace ebl {
+
+// The state of compiled code's current frame, which it keeps in rbx.
+struct JitFrame {
+    Environment* env_;
+    Context* context_;
+    std::vector<ValuePtr>* operandStack_;
+    size_t base_;
+    Environment* parent_;
+    std::exception_ptr error_;
+    // Set when compiled code makes a tail call, see Jit::enter.
+    Function* tailCallee_;
+};
+
+namespace {
+
+// How compiled code exits.
+enum Status : uint32_t { Returned, Failed, TailCalled };
+
+// Helpers can't let exceptions escape into compiled code, which has no
+// unwind info. Instead, they hold on to the exception and return -1, and
+// compiled code returns to Jit::enter, which rethrows it. Otherwise, plain
+// helpers return zero, and branches return one to take the branch.
+using Helper = void (*)(JitFrame&, uint32_t, uint32_t);
+using Branch = bool (*)(JitFrame&, uint32_t, uint32_t);
+using Guarded = int (*)(JitFrame&, uint32_t, uint32_t);
+
+template <Helper helper> int guarded(JitFrame& frame, uint32_t a, uint32_t b)
+{
+    try {
+        helper(frame, a, b);
+        return 0;
+    } catch (...) {
+        frame.error_ = std::current_exception();
+        return -1;
+    }
+}
+
+template <Branch branch>
+int guardedBranch(JitFrame& frame, uint32_t a, uint32_t b)
+{
+    try {
+        return branch(frame, a, b) ? 1 : 0;
+    } catch (...) {
+        frame.error_ = std::current_exception();
+        return -1;
+    }
+}
+
+ValuePtr& slot(JitFrame& frame, uint32_t offset)
+{
+    return (*frame.operandStack_)[frame.base_ + offset];
+}
+
+ValuePtr pop(JitFrame& frame)
+{
+    auto result = frame.operandStack_->back();
+    frame.operandStack_->pop_back();
+    return result;
+}
+
+void push(JitFrame& frame, ValuePtr value)
+{
+    frame.operandStack_->push_back(value);
+}
+
+void load0(JitFrame& frame, uint32_t offset, uint32_t)
+{
+    push(frame, slot(frame, offset));
+}
+
+void load1(JitFrame& frame, uint32_t offset, uint32_t)
+{
+    push(frame, frame.parent_->getVars()[offset]);
+}
+
+void loadGlobal(JitFrame& frame, uint32_t slot, uint32_t)
+{
+    push(frame, frame.context_->topLevel().getVars()[slot]);
+}
+
+void storeGlobal(JitFrame& frame, uint32_t slot, uint32_t)
+{
+    frame.context_->topLevel().storeGlobal(slot, pop(frame));
+}
+
+void load0Fast2(JitFrame& frame, uint32_t first, uint32_t second)
+{
+    push(frame, slot(frame, first));
+    push(frame, slot(frame, second));
+}
+
+void load0Car(JitFrame& frame, uint32_t offset, uint32_t)
+{
+    push(frame, checkedCast<Pair>(slot(frame, offset))->getCar());
+}
+
+void load0Cdr(JitFrame& frame, uint32_t offset, uint32_t)
+{
+    push(frame, checkedCast<Pair>(slot(frame, offset))->getCdr());
+}
+
+void pushI(JitFrame& frame, uint32_t id, uint32_t)
+{
+    push(frame, frame.context_->immediates()[id]);
+}
+
+void load0PushI(JitFrame& frame, uint32_t offset, uint32_t id)
+{
+    push(frame, slot(frame, offset));
+    pushI(frame, id, 0);
+}
+
+void pushNull(JitFrame& frame, uint32_t, uint32_t)
+{
+    push(frame, frame.env_->getNull());
+}
+
+void pushTrue(JitFrame& frame, uint32_t, uint32_t)
+{
+    push(frame, frame.env_->getBool(true));
+}
+
+void pushFalse(JitFrame& frame, uint32_t, uint32_t)
+{
+    push(frame, frame.env_->getBool(false));
+}
+
+void discard(JitFrame& frame, uint32_t, uint32_t)
+{
+    frame.operandStack_->pop_back();
+}
+
+void dup(JitFrame& frame, uint32_t, uint32_t)
+{
+    push(frame, frame.operandStack_->back());
+}
+
+void rebind(JitFrame& frame, uint32_t dist, uint32_t offset)
+{
+    const auto value = pop(frame);
+    if (dist == 0) {
+        slot(frame, offset) = value;
+    } else {
+        frame.parent_->store({FrameDist(dist - 1), StackLoc(offset)}, value);
+    }
+}
+
+void reserve(JitFrame& frame, uint32_t count, uint32_t)
+{
+    auto& operandStack = *frame.operandStack_;
+    operandStack.insert(operandStack.end(), count, frame.env_->getNull());
+}
+
+void box(JitFrame& frame, uint32_t, uint32_t)
+{
+    auto box = frame.env_->create<Box>(frame.operandStack_->back());
+    frame.operandStack_->back() = box;
+}
+
+void unbox(JitFrame& frame, uint32_t, uint32_t)
+{
+    auto& top = frame.operandStack_->back();
+    top = top.cast<Box>()->get();
+}
+
+void setBox(JitFrame& frame, uint32_t, uint32_t)
+{
+    auto box = pop(frame).cast<Box>();
+    box->set(pop(frame));
+}
+
+void cons(JitFrame& frame, uint32_t, uint32_t)
+{
+    auto& operandStack = *frame.operandStack_;
+    auto cell = frame.env_->create<Pair>(operandStack.end()[-2],
+                                         operandStack.end()[-1]);
+    operandStack.pop_back();
+    operandStack.back() = cell;
+}
+
+void car(JitFrame& frame, uint32_t, uint32_t)
+{
+    auto& top = frame.operandStack_->back();
+    top = checkedCast<Pair>(top)->getCar();
+}
+
+void cdr(JitFrame& frame, uint32_t, uint32_t)
+{
+    auto& top = frame.operandStack_->back();
+    top = checkedCast<Pair>(top)->getCdr();
+}
+
+void isNull(JitFrame& frame, uint32_t, uint32_t)
+{
+    auto& top = frame.operandStack_->back();
+    top = frame.env_->getBool(isType<Null>(top));
+}
+
+void logicalNot(JitFrame& frame, uint32_t, uint32_t)
+{
+    auto& top = frame.operandStack_->back();
+    top = frame.env_->getBool(top == frame.env_->getBool(false));
+}
+
+template <typename Compare>
+ValuePtr comparison(Environment& env, ValuePtr lhs, ValuePtr rhs)
+{
+    return env.getBool(compare<Compare>(env, lhs, rhs));
+}
+
+using Unary = ValuePtr (*)(Environment&, ValuePtr);
+using Binary = ValuePtr (*)(Environment&, ValuePtr, ValuePtr);
+
+template <Unary operation> void unary(JitFrame& frame, uint32_t, uint32_t)
+{
+    const auto val = pop(frame);
+    push(frame, operation(*frame.env_, val));
+}
+
+template <Binary operation> void binary(JitFrame& frame, uint32_t, uint32_t)
+{
+    const auto rhs = pop(frame);
+    const auto lhs = pop(frame);
+    push(frame, operation(*frame.env_, lhs, rhs));
+}
+
+// The register forms have a register or a constant on the right hand side.
+template <bool constant> ValuePtr operand(JitFrame& frame, uint32_t param)
+{
+    if (constant) {
+        return frame.context_->immediates()[param];
+    }
+    return slot(frame, param);
+}
+
+template <Unary operation>
+void unaryR(JitFrame& frame, uint32_t reg, uint32_t)
+{
+    push(frame, operation(*frame.env_, slot(frame, reg)));
+}
+
+template <Binary operation, bool constant>
+void binaryR(JitFrame& frame, uint32_t reg, uint32_t param)
+{
+    const auto lhs = slot(frame, reg);
+    const auto rhs = operand<constant>(frame, param);
+    push(frame, operation(*frame.env_, lhs, rhs));
+}
+
+bool jumpIfFalse(JitFrame& frame, uint32_t, uint32_t)
+{
+    return pop(frame) == frame.env_->getBool(false);
+}
+
+bool jumpIfNotNull(JitFrame& frame, uint32_t, uint32_t)
+{
+    return not isType<Null>(pop(frame));
+}
+
+template <typename Compare>
+bool jumpIfNot(JitFrame& frame, uint32_t, uint32_t)
+{
+    const auto rhs = pop(frame);
+    const auto lhs = pop(frame);
+    return not compare<Compare>(*frame.env_, lhs, rhs);
+}
+
+template <typename Compare, bool constant>
+bool jumpIfNotR(JitFrame& frame, uint32_t reg, uint32_t param)
+{
+    const auto lhs = slot(frame, reg);
+    const auto rhs = operand<constant>(frame, param);
+    return not compare<Compare>(*frame.env_, lhs, rhs);
+}
+
+// The first parameter packs argc, the number of captures, and the docstring.
+template <Opcode op>
+void pushLambda(JitFrame& frame, uint32_t packed, uint32_t addr)
+{
+    Context& context = *frame.context_;
+    const uint8_t argc = packed;
+    const uint8_t captures = packed >> 8;
+    auto docstring = frame.env_->getNull();
+    if (op == Opcode::PushDocumentedLambda) {
+        docstring = context.immediates()[packed >> 16];
+    }
+    auto lambda = makeClosure(context, captures, docstring, (size_t)argc,
+                              (size_t)addr, op == Opcode::PushVariadicLambda);
+    push(frame, lambda);
+}
+
+// Runs a bytecode function whose frame is ready on the operand stack.
+void run(JitFrame& frame, Function& fn, size_t base, Environment* parent)
+{
+    Context& context = *frame.context_;
+    const auto addr = fn.getBytecodeAddress();
+    context.callStack().push_back(
+        {context.getProgram().size() - 1, addr, parent, base});
+    auto code = context.jit()->hot(fn);
+    if (not code or not context.jit()->enter(code, base, parent)) {
+        VM::execute(*frame.env_, context.getProgram(),
+                    context.callStack().back().functionTop_);
+    }
+}
+
+void call(JitFrame& frame, uint32_t argc, uint32_t)
+{
+    auto& operandStack = *frame.operandStack_;
+    Environment& env = *frame.env_;
+    auto fn = checkedCast<Function>(operandStack.back());
+    switch (fn->getInvocationModel()) {
+    case Function::InvocationModel::Wrapped:
+        callWrapped(env, fn, argc);
+        break;
+
+    case Function::InvocationModel::BytecodeVariadic:
+        fn = gatherRestArgs(env, fn, argc);
+        argc = fn->argCount();
+    // fallthrough
+    case Function::InvocationModel::Bytecode:
+        if (UNLIKELY(argc not_eq fn->argCount())) {
+            failedToApply(env, fn.get(), argc, fn->argCount());
+        }
+        run(frame, *fn, operandStack.size() - (argc + 1),
+            fn->definitionEnvironment().get());
+        break;
+    }
+}
+
+// Returns true once the callee has taken over the frame, and leaves the
+// compiled code to exit, for Jit::enter to carry on with the callee.
+bool tailCall(JitFrame& frame, uint32_t argc, uint32_t)
+{
+    Environment& env = *frame.env_;
+    auto fn = checkedCast<Function>(frame.operandStack_->back());
+    const auto model = fn->getInvocationModel();
+    if (model == Function::InvocationModel::Wrapped) {
+        callWrapped(env, fn, argc);
+        return false;
+    }
+    if (model == Function::InvocationModel::BytecodeVariadic) {
+        fn = gatherRestArgs(env, fn, argc);
+    } else if (UNLIKELY(argc not_eq fn->argCount())) {
+        failedToApply(env, fn.get(), argc, fn->argCount());
+    }
+    replaceFrame(*frame.context_, *fn, frame.base_);
+    frame.parent_ = frame.context_->callStack().back().env_;
+    frame.tailCallee_ = fn.get();
+    return true;
+}
+
+// Compiled code doesn't dispatch through the vm, so it takes the sampler's
+// pending samples itself, on entry and on each recur.
+static void takeSample(Context& context)
+{
+    if (UNLIKELY(context.sampleRequested()) and context.sampler()) {
+        context.sampler()->sample();
+    }
+}
+
+void recur(JitFrame& frame, uint32_t argc, uint32_t)
+{
+    takeSample(*frame.context_);
+    auto& operandStack = *frame.operandStack_;
+    std::copy(operandStack.end() - argc, operandStack.end(),
+              operandStack.begin() + frame.base_);
+    operandStack.erase(operandStack.begin() + frame.base_ + argc + 1,
+                       operandStack.end());
+}
+
+void ret(JitFrame& frame, uint32_t, uint32_t)
+{
+    auto& operandStack = *frame.operandStack_;
+    const auto result = operandStack.back();
+    operandStack.erase(operandStack.begin() + frame.base_, operandStack.end());
+    operandStack.push_back(result);
+    frame.context_->callStack().pop_back();
+}
+
+// Emits x86-64 machine code. Helpers are called with the frame in rdi, and
+// their parameters in esi and edx.
+class Assembler {
+public:
+    size_t size() const
+    {
+        return code_.size();
+    }
+
+    const std::vector<uint8_t>& code() const
+    {
+        return code_;
+    }
+
+    void prologue()
+    {
+        emit({0x53});             // push rbx
+        emit({0x48, 0x89, 0xfb}); // mov rbx, rdi
+    }
+
+    void epilogue(uint32_t result)
+    {
+        emit({0xb8});  // mov eax, result
+        imm32(result); //
+        emit({0x5b});  // pop rbx
+        emit({0xc3});  // ret
+    }
+
+    void call(Guarded helper, uint32_t a = 0, uint32_t b = 0)
+    {
+        emit({0x48, 0x89, 0xdf}); // mov rdi, rbx
+        emit({0xbe});             // mov esi, a
+        imm32(a);
+        emit({0xba}); // mov edx, b
+        imm32(b);
+        emit({0x48, 0xb8}); // mov rax, helper
+        imm64((uint64_t)helper);
+        emit({0xff, 0xd0}); // call rax
+        emit({0x85, 0xc0}); // test eax, eax
+    }
+
+    // Each jump returns the location of its rel32, see patch().
+    size_t jmp()
+    {
+        emit({0xe9});
+        return rel32();
+    }
+
+    size_t jnz()
+    {
+        emit({0x0f, 0x85});
+        return rel32();
+    }
+
+    size_t js()
+    {
+        emit({0x0f, 0x88});
+        return rel32();
+    }
+
+    void patch(size_t loc, size_t target)
+    {
+        const int32_t rel = int32_t(target) - int32_t(loc + 4);
+        memcpy(&code_[loc], &rel, sizeof rel);
+    }
+
+private:
+    void emit(std::initializer_list<uint8_t> bytes)
+    {
+        code_.insert(code_.end(), bytes);
+    }
+
+    void imm32(uint32_t value)
+    {
+        const auto bytes = (const uint8_t*)&value;
+        code_.insert(code_.end(), bytes, bytes + sizeof value);
+    }
+
+    void imm64(uint64_t value)
+    {
+        const auto bytes = (const uint8_t*)&value;
+        code_.insert(code_.end(), bytes, bytes + sizeof value);
+    }
+
+    size_t rel32()
+    {
+        const size_t loc = code_.size();
+        imm32(0);
+        return loc;
+    }
+
+    std::vector<uint8_t> code_;
+};
+
+uint16_t readU16(const Bytecode& bc, size_t pos)
+{
+    return ((uint16_t)bc[pos]) | (((uint16_t)bc[pos + 1]) << 8);
+}
+
+// The helper for an instruction that doesn't jump, or null if there isn't a
+// template for it. Parameters are read from the bytecode.
+Guarded helperFor(Opcode op)
+{
+    switch (op) {
+    case Opcode::Load0Fast:
+    case Opcode::Load0:
+        return guarded<load0>;
+    case Opcode::Load1Fast:
+    case Opcode::Load1:
+        return guarded<load1>;
+    case Opcode::LoadGlobal:
+        return guarded<loadGlobal>;
+    case Opcode::StoreGlobal:
+        return guarded<storeGlobal>;
+    case Opcode::Load0Fast2:
+        return guarded<load0Fast2>;
+    case Opcode::Load0Car:
+        return guarded<load0Car>;
+    case Opcode::Load0Cdr:
+        return guarded<load0Cdr>;
+    case Opcode::Load0PushI:
+        return guarded<load0PushI>;
+    case Opcode::PushI:
+        return guarded<pushI>;
+    case Opcode::PushNull:
+        return guarded<pushNull>;
+    case Opcode::PushTrue:
+        return guarded<pushTrue>;
+    case Opcode::PushFalse:
+        return guarded<pushFalse>;
+    case Opcode::Discard:
+        return guarded<discard>;
+    case Opcode::Dup:
+        return guarded<dup>;
+    case Opcode::Rebind:
+        return guarded<rebind>;
+    case Opcode::Reserve:
+        return guarded<reserve>;
+    case Opcode::Box:
+        return guarded<box>;
+    case Opcode::Unbox:
+        return guarded<unbox>;
+    case Opcode::SetBox:
+        return guarded<setBox>;
+    case Opcode::Cons:
+        return guarded<cons>;
+    case Opcode::Car:
+        return guarded<car>;
+    case Opcode::Cdr:
+        return guarded<cdr>;
+    case Opcode::IsNull:
+        return guarded<isNull>;
+    case Opcode::Not:
+        return guarded<logicalNot>;
+    case Opcode::Add:
+        return guarded<binary<add>>;
+    case Opcode::Sub:
+        return guarded<binary<subtract>>;
+    case Opcode::Lt:
+        return guarded<binary<comparison<Less>>>;
+    case Opcode::Gt:
+        return guarded<binary<comparison<Greater>>>;
+    case Opcode::Eq:
+        return guarded<binary<equal>>;
+    case Opcode::Mod:
+        return guarded<binary<modulo>>;
+    case Opcode::Incr:
+        return guarded<unary<increment>>;
+    case Opcode::Decr:
+        return guarded<unary<decrement>>;
+    case Opcode::AddRR:
+        return guarded<binaryR<add, false>>;
+    case Opcode::AddRK:
+        return guarded<binaryR<add, true>>;
+    case Opcode::SubRR:
+        return guarded<binaryR<subtract, false>>;
+    case Opcode::SubRK:
+        return guarded<binaryR<subtract, true>>;
+    case Opcode::LtRR:
+        return guarded<binaryR<comparison<Less>, false>>;
+    case Opcode::LtRK:
+        return guarded<binaryR<comparison<Less>, true>>;
+    case Opcode::GtRR:
+        return guarded<binaryR<comparison<Greater>, false>>;
+    case Opcode::GtRK:
+        return guarded<binaryR<comparison<Greater>, true>>;
+    case Opcode::IncrR:
+        return guarded<unaryR<increment>>;
+    case Opcode::DecrR:
+        return guarded<unaryR<decrement>>;
+    case Opcode::Call:
+        return guarded<call>;
+    default:
+        return nullptr;
+    }
+}
+
+// The helper for a conditional jump, which leaves the offset for last.
+Guarded branchFor(Opcode op)
+{
+    switch (op) {
+    case Opcode::JumpIfFalse:
+        return guardedBranch<jumpIfFalse>;
+    case Opcode::JumpIfNotNull:
+        return guardedBranch<jumpIfNotNull>;
+    case Opcode::JumpIfNotLt:
+        return guardedBranch<jumpIfNot<Less>>;
+    case Opcode::JumpIfNotGt:
+        return guardedBranch<jumpIfNot<Greater>>;
+    case Opcode::JumpIfNotLtRR:
+        return guardedBranch<jumpIfNotR<Less, false>>;
+    case Opcode::JumpIfNotLtRK:
+        return guardedBranch<jumpIfNotR<Less, true>>;
+    case Opcode::JumpIfNotGtRR:
+        return guardedBranch<jumpIfNotR<Greater, false>>;
+    case Opcode::JumpIfNotGtRK:
+        return guardedBranch<jumpIfNotR<Greater, true>>;
+    default:
+        return nullptr;
+    }
+}
+
+// Reads an instruction's parameters, other than a jump offset. A u8 or u16
+// parameter is followed by another u8 or u16, or nothing.
+void readParams(const Bytecode& bc, size_t ip, size_t bytes, uint32_t& a,
+                uint32_t& b)
+{
+    const auto op = (Opcode)bc[ip];
+    a = b = 0;
+    switch (op) {
+    case Opcode::Load0Fast2:
+    case Opcode::AddRR:
+    case Opcode::SubRR:
+    case Opcode::LtRR:
+    case Opcode::GtRR:
+    case Opcode::JumpIfNotLtRR:
+    case Opcode::JumpIfNotGtRR:
+        a = bc[ip + 1];
+        b = bc[ip + 2];
+        break;
+
+    case Opcode::Load0PushI:
+    case Opcode::AddRK:
+    case Opcode::SubRK:
+    case Opcode::LtRK:
+    case Opcode::GtRK:
+    case Opcode::JumpIfNotLtRK:
+    case Opcode::JumpIfNotGtRK:
+        a = bc[ip + 1];
+        b = readU16(bc, ip + 2);
+        break;
+
+    case Opcode::Rebind:
+        a = readU16(bc, ip + 1);
+        b = readU16(bc, ip + 3);
+        break;
+
+    default:
+        if (bytes == 1) {
+            a = bc[ip + 1];
+        } else if (bytes == 2) {
+            a = readU16(bc, ip + 1);
+        }
+        break;
+    }
+}
+
+} // namespace
+
+Jit::Jit(Context& context, size_t threshold)
+    : context_(context), threshold_(threshold), depth_(0)
+{
+}
+
+Jit::~Jit()
+{
+    reset();
+}
+
+bool Jit::supported()
+{
+#ifdef EBL_JIT_X86_64
+    return true;
+#else
+    return false;
+#endif
+}
+
+Jit::Code Jit::hot(Function& fn)
+{
+    auto entry = fn.jitEntry();
+    if (UNLIKELY(entry == nullptr)) {
+        entry = &entries_[fn.getBytecodeAddress()];
+        fn.setJitEntry(entry);
+    }
+    if (UNLIKELY(not entry->compiled_) and ++entry->calls_ >= threshold_) {
+        entry->compiled_ = true;
+        entry->code_ = compile(fn.getBytecodeAddress());
+    }
+    if (depth_ >= 1000) {
+        return nullptr;
+    }
+    return entry->code_;
+}
+
+bool Jit::enter(Code code, size_t base, Environment* parent)
+{
+    JitFrame frame{&context_.topLevel(), &context_, &context_.operandStack(),
+                   base, parent, nullptr, nullptr};
+    while (true) {
+        takeSample(context_);
+        ++depth_;
+        const int status = code(frame);
+        --depth_;
+        if (status == Returned) {
+            return true;
+        } else if (status == Failed) {
+            std::rethrow_exception(frame.error_);
+        }
+        // The callee of a tail call runs in the same frame, so a chain of
+        // tail calls between compiled functions takes no native stack.
+        code = hot(*frame.tailCallee_);
+        if (code == nullptr) {
+            return false;
+        }
+    }
+}
+
+void Jit::reset()
+{
+    for (auto& entry : entries_) {
+        entry.second = JitEntry{};
+    }
+#ifdef EBL_JIT_X86_64
+    for (auto& mapping : mappings_) {
+        munmap(mapping.first, mapping.second);
+    }
+#endif
+    mappings_.clear();
+}
+
+// Compiles a function's body, which starts at addr and ends with the first
+// Return that nothing jumps past. Nested functions are skipped over.
+Jit::Code Jit::compile(InstructionAddress addr)
+{
+#ifdef EBL_JIT_X86_64
+    const Bytecode& bc = context_.getProgram();
+    Assembler as;
+    std::unordered_map<InstructionAddress, size_t> labels;
+    std::vector<std::pair<size_t, InstructionAddress>> jumps;
+    std::vector<size_t> failures;
+    std::vector<size_t> tailCalls;
+    as.prologue();
+    InstructionAddress end = addr;
+    size_t ip = addr;
+    while (true) {
+        const auto op = (Opcode)bc[ip];
+        const size_t bytes = paramSize(op);
+        const size_t next = ip + 1 + bytes;
+        labels[ip] = as.size();
+        uint32_t a, b;
+        readParams(bc, ip, bytes, a, b);
+        if (auto helper = helperFor(op)) {
+            as.call(helper, a, b);
+            failures.push_back(as.jnz());
+        } else if (auto branch = branchFor(op)) {
+            as.call(branch, a, b);
+            failures.push_back(as.js());
+            const auto target = next + readU16(bc, next - 2);
+            jumps.push_back({as.jnz(), target});
+            end = std::max(end, target);
+        } else if (op == Opcode::Jump) {
+            const auto target = next + readU16(bc, next - 2);
+            jumps.push_back({as.jmp(), target});
+            end = std::max(end, target);
+        } else if (op == Opcode::PushLambda or
+                   op == Opcode::PushDocumentedLambda or
+                   op == Opcode::PushVariadicLambda) {
+            // The function's body follows a jump over it.
+            uint32_t packed = bc[ip + 1] | (bc[ip + 2] << 8);
+            if (op == Opcode::PushDocumentedLambda) {
+                packed |= readU16(bc, ip + 3) << 16;
+            }
+            const auto body = next + 1 + paramSize(Opcode::Jump);
+            if (op == Opcode::PushLambda) {
+                as.call(guarded<pushLambda<Opcode::PushLambda>>, packed, body);
+            } else if (op == Opcode::PushDocumentedLambda) {
+                as.call(guarded<pushLambda<Opcode::PushDocumentedLambda>>,
+                        packed, body);
+            } else {
+                as.call(guarded<pushLambda<Opcode::PushVariadicLambda>>,
+                        packed, body);
+            }
+            failures.push_back(as.jnz());
+            ip = body + readU16(bc, body - 2);
+            end = std::max(end, ip);
+            continue;
+        } else if (op == Opcode::Recur) {
+            as.call(guarded<recur>, a);
+            failures.push_back(as.jnz());
+            jumps.push_back({as.jmp(), addr});
+        } else if (op == Opcode::TailCall) {
+            as.call(guardedBranch<tailCall>, a);
+            failures.push_back(as.js());
+            tailCalls.push_back(as.jnz());
+        } else if (op == Opcode::Return) {
+            as.call(guarded<ret>);
+            failures.push_back(as.jnz());
+            as.epilogue(Returned);
+            if (next > end) {
+                break;
+            }
+        } else {
+            // No template, leave the function to the interpreter.
+            return nullptr;
+        }
+        ip = next;
+    }
+    const size_t failure = as.size();
+    as.epilogue(Failed);
+    const size_t tailCalled = as.size();
+    as.epilogue(TailCalled);
+    for (auto& jump : jumps) {
+        as.patch(jump.first, labels.at(jump.second));
+    }
+    for (auto loc : failures) {
+        as.patch(loc, failure);
+    }
+    for (auto loc : tailCalls) {
+        as.patch(loc, tailCalled);
+    }
+
+    const size_t page = sysconf(_SC_PAGESIZE);
+    const size_t length = (as.size() + page - 1) & ~(page - 1);
+    void* mem = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        return nullptr;
+    }
+    memcpy(mem, as.code().data(), as.size());
+    if (mprotect(mem, length, PROT_READ | PROT_EXEC)) {
+        munmap(mem, length);
+        return nullptr;
+    }
+    mappings_.push_back({mem, length});
+    return (Code)mem;
+#else
+    return nullptr;
+#endif
+}
+
+} // namespace ebl
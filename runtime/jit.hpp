@@ -0,0 +1,62 @@
+#pragma once
+
+#include "vm.hpp"
+#include <unordered_map>
+#include <vector>
+
+namespace ebl {
+
+class Context;
+class Function;
+struct JitFrame;
+
+struct JitEntry {
+    size_t calls_ = 0;
+    bool compiled_ = false;
+    int (*code_)(JitFrame&) = nullptr;
+};
+
+// A baseline jit for x86-64. Once a function has been called often enough,
+// its bytecode is translated to machine code by stitching together a
+// template for each instruction. Most templates call a helper for their
+// opcode, while jumps, branches and recur become native jumps. Compiled code
+// keeps its frame on the operand stack, like the interpreter does, so the
+// two can call each other freely. Functions using an instruction without a
+// template stay interpreted.
+class Jit {
+public:
+    using Code = int (*)(JitFrame&);
+
+    Jit(Context& context, size_t threshold);
+    Jit(const Jit&) = delete;
+    ~Jit();
+
+    // False on platforms that the jit can't generate code for.
+    static bool supported();
+
+    // Counts a call to fn, and returns fn's code once it's been compiled.
+    Code hot(Function& fn);
+
+    // Runs code for the frame on top of the call stack, leaving the result
+    // on the operand stack. Returns false if the code made a tail call to a
+    // function that isn't compiled, which the caller then needs to interpret
+    // from the frame's functionTop_.
+    bool enter(Code code, size_t base, Environment* parent);
+
+    // Discards all compiled code, for when the program is replaced.
+    void reset();
+
+private:
+    Code compile(InstructionAddress addr);
+
+    Context& context_;
+    const size_t threshold_;
+    // Compiled code calls back into the interpreter, and vice versa, on the
+    // native stack. Past this depth, calls stay in the interpreter, which
+    // keeps deep recursion off of the native stack.
+    size_t depth_;
+    std::unordered_map<InstructionAddress, JitEntry> entries_;
+    std::vector<std::pair<void*, size_t>> mappings_;
+};
+
+} // namespace ebl
@@ -5,7 +5,7 @@ namespace ebl {
 
 ListBuilder::ListBuilder(Environment& env, ValuePtr first)
     : env_(env), front_(env, env.create<Pair>(first, env.getNull())),
-      back_((Heap::Ptr<Pair>)front_)
+      back_(env, (Heap::Ptr<Pair>)front_)
 {
 }
 
@@ -22,7 +22,7 @@ public:
 private:
     Environment& env_;
     Persistent<Pair> front_;
-    Heap::Ptr<Pair> back_;
+    Persistent<Pair> back_;
 };
 
 
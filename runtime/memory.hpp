@@ -12,6 +12,24 @@ namespace ebl {
 
 class Environment;
 
+// Controls how a Memory::Ptr<T> dereferences its handle. Types that store
+// their values directly within the pointer, rather than in memory,
+// specialize PtrTraits, see types.hpp.
+template <typename T> struct PtrTraits {
+    using Pointer = T*;
+    using Reference = T&;
+
+    static Pointer get(uint8_t* handle)
+    {
+        return reinterpret_cast<T*>(handle);
+    }
+
+    static Reference deref(uint8_t* handle)
+    {
+        return *reinterpret_cast<T*>(handle);
+    }
+};
+
 template <size_t Alignment> class Memory {
 public:
     static constexpr const size_t Align = Alignment;
@@ -41,6 +59,20 @@ public:
         other.capacity_ = 0;
     }
 
+    Memory& operator=(Memory&& other)
+    {
+        if (this not_eq &other) {
+            free(begin_);
+            begin_ = other.begin_;
+            end_ = other.end_;
+            capacity_ = other.capacity_;
+            other.begin_ = nullptr;
+            other.end_ = nullptr;
+            other.capacity_ = 0;
+        }
+        return *this;
+    }
+
     ~Memory()
     {
         free(begin_);
@@ -74,6 +106,18 @@ public:
 
     template <typename T> GenericPtr alloc();
 
+    // Reserves size bytes, for when the collector copies values between
+    // heaps and only knows their sizes at runtime.
+    GenericPtr alloc(size_t size)
+    {
+        if (this->size() + size <= capacity_) {
+            auto result = end_;
+            end_ += size;
+            return {result};
+        }
+        throw OOM{};
+    }
+
     template <typename T> Memory::Ptr<T> arrayElemAt(size_t index) const;
 
     void compacted(size_t bytes)
@@ -81,6 +125,16 @@ public:
         end_ -= bytes;
     }
 
+    void clear()
+    {
+        end_ = begin_;
+    }
+
+    bool contains(const void* ptr) const
+    {
+        return ptr >= begin_ and ptr < end_;
+    }
+
     size_t size() const
     {
         return end_ - begin_;
@@ -127,6 +181,13 @@ public:
         return handle_ == other.handle_;
     }
 
+    // Wraps a handle that didn't come from Memory::alloc, like a value stored
+    // within the pointer itself, see PtrTraits.
+    template <typename T> static Ptr<T> UNSAFE_make(HandleType handle)
+    {
+        return {handle};
+    }
+
     // NOTE: overwrite is meant for the GC to use when moving values
     // around. If you call this function manually, you could break
     // things.
@@ -155,18 +216,18 @@ public:
         static_assert(std::is_base_of<T, U>::value, "bad upcast");
     }
 
-    T& operator*() const
+    typename PtrTraits<T>::Reference operator*() const
     {
-        return *reinterpret_cast<T*>(GenericPtr::handle());
+        return PtrTraits<T>::deref(GenericPtr::handle());
     }
-    T* operator->() const
+    typename PtrTraits<T>::Pointer operator->() const
     {
-        return reinterpret_cast<T*>(GenericPtr::handle());
+        return PtrTraits<T>::get(GenericPtr::handle());
     }
 
-    T* get()
+    typename PtrTraits<T>::Pointer get() const
     {
-        return reinterpret_cast<T*>(GenericPtr::handle());
+        return PtrTraits<T>::get(GenericPtr::handle());
     }
 
 protected:
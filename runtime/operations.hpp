@@ -0,0 +1,294 @@
+#pragma once
+
+#include "environment.hpp"
+#include "listBuilder.hpp"
+#include "persistent.hpp"
+#include "types.hpp"
+
+// The semantics of the inlined builtins, and of calls, shared by the
+// interpreter and the jit. Each operation has a fast path for integers, and
+// sometimes floats, and otherwise falls back to calling the builtin of the
+// same name.
+
+namespace ebl {
+
+inline bool isInteger(ValuePtr val)
+{
+    return immediateTag(val.handle()) == ImmediateTag::Integer;
+}
+
+inline Integer::Rep integerValue(ValuePtr val)
+{
+    return Integer::Rep(immediatePayload((uintptr_t)val.handle()));
+}
+
+inline bool isFloat(ValuePtr val)
+{
+    return val->typeId() == typeId<Float>();
+}
+
+// Integer arithmetic wraps around, like the builtins do in practice, but
+// without relying on signed overflow.
+inline Integer::Rep wrappingAdd(Integer::Rep lhs, Integer::Rep rhs)
+{
+    return Integer::Rep(uint32_t(lhs) + uint32_t(rhs));
+}
+
+inline Integer::Rep wrappingSub(Integer::Rep lhs, Integer::Rep rhs)
+{
+    return Integer::Rep(uint32_t(lhs) - uint32_t(rhs));
+}
+
+// Anything mod -1 is 0, but the smallest integer mod -1 traps on some
+// machines. Callers rule out a zero divisor.
+inline Integer::Rep wrappingMod(Integer::Rep lhs, Integer::Rep rhs)
+{
+    return rhs == -1 ? 0 : lhs % rhs;
+}
+
+// Adds an integer or float to a sum the same way that the + builtin does.
+inline bool addTo(ValuePtr val, Integer::Rep& iSum, Float::Rep& dSum)
+{
+    if (isInteger(val)) {
+        iSum = wrappingAdd(iSum, integerValue(val));
+        return true;
+    } else if (isFloat(val)) {
+        dSum += val.cast<Float>()->value();
+        return true;
+    }
+    return false;
+}
+
+inline bool toFloat(ValuePtr val, Float::Rep& result)
+{
+    if (isInteger(val)) {
+        result = integerValue(val);
+        return true;
+    } else if (isFloat(val)) {
+        result = val.cast<Float>()->value();
+        return true;
+    }
+    return false;
+}
+
+// Slow path for the inlined numeric opcodes, calls the builtin with the
+// operands on top of the stack.
+inline ValuePtr callBuiltin(Environment& env, const char* name, size_t argc)
+{
+    auto fn = checkedCast<Function>(env.getGlobal(name));
+    auto& operandStack = env.getContext()->operandStack();
+    // Arguments expects the function on top of its args, like in Call.
+    operandStack.push_back(fn);
+    Arguments args(env, argc);
+    operandStack.pop_back();
+    return fn->directCall(args);
+}
+
+struct Less {
+    template <typename T> bool operator()(T lhs, T rhs) const
+    {
+        return lhs < rhs;
+    }
+
+    static const char* builtin()
+    {
+        return "<";
+    }
+};
+
+struct Greater {
+    template <typename T> bool operator()(T lhs, T rhs) const
+    {
+        return lhs > rhs;
+    }
+
+    static const char* builtin()
+    {
+        return ">";
+    }
+};
+
+// The slow paths below call the builtin of the same name, with the operands
+// pushed back onto the stack.
+template <typename Compare>
+inline bool compare(Environment& env, ValuePtr lhs, ValuePtr rhs)
+{
+    if (LIKELY(isInteger(lhs) and isInteger(rhs))) {
+        return Compare()(integerValue(lhs), integerValue(rhs));
+    } else if (isFloat(lhs) and isFloat(rhs)) {
+        return Compare()(lhs.cast<Float>()->value(),
+                         rhs.cast<Float>()->value());
+    }
+    auto& operandStack = env.getContext()->operandStack();
+    operandStack.push_back(lhs);
+    operandStack.push_back(rhs);
+    const auto result = callBuiltin(env, Compare::builtin(), 2);
+    return not(result == env.getBool(false));
+}
+
+inline ValuePtr add(Environment& env, ValuePtr lhs, ValuePtr rhs)
+{
+    if (LIKELY(isInteger(lhs) and isInteger(rhs))) {
+        const auto result = wrappingAdd(integerValue(lhs), integerValue(rhs));
+        return makeImmediate<Integer>(result);
+    }
+    Integer::Rep iSum = 0;
+    Float::Rep dSum = 0.0;
+    if (addTo(lhs, iSum, dSum) and addTo(rhs, iSum, dSum)) {
+        if (dSum) {
+            return env.create<Float>(dSum + iSum);
+        }
+        return makeImmediate<Integer>(iSum);
+    }
+    auto& operandStack = env.getContext()->operandStack();
+    operandStack.push_back(lhs);
+    operandStack.push_back(rhs);
+    return callBuiltin(env, "+", 2);
+}
+
+inline ValuePtr subtract(Environment& env, ValuePtr lhs, ValuePtr rhs)
+{
+    Float::Rep dLhs, dRhs;
+    if (LIKELY(isInteger(lhs) and isInteger(rhs))) {
+        const auto result = wrappingSub(integerValue(lhs), integerValue(rhs));
+        return makeImmediate<Integer>(result);
+    } else if (toFloat(lhs, dLhs) and toFloat(rhs, dRhs)) {
+        return env.create<Float>(dLhs - dRhs);
+    }
+    auto& operandStack = env.getContext()->operandStack();
+    operandStack.push_back(lhs);
+    operandStack.push_back(rhs);
+    return callBuiltin(env, "-", 2);
+}
+
+// Immediates have one encoding per value, so comparing them is just a matter
+// of comparing words. The builtin raises an error for null.
+inline ValuePtr equal(Environment& env, ValuePtr lhs, ValuePtr rhs)
+{
+    if (isImmediate(lhs) and isImmediate(rhs) and
+        immediateTag(lhs.handle()) not_eq ImmediateTag::Null and
+        immediateTag(rhs.handle()) not_eq ImmediateTag::Null) {
+        return env.getBool(lhs == rhs);
+    }
+    auto& operandStack = env.getContext()->operandStack();
+    operandStack.push_back(lhs);
+    operandStack.push_back(rhs);
+    return callBuiltin(env, "equal?", 2);
+}
+
+inline ValuePtr modulo(Environment& env, ValuePtr lhs, ValuePtr rhs)
+{
+    if (LIKELY(isInteger(lhs) and isInteger(rhs) and
+               integerValue(rhs) not_eq 0)) {
+        return makeImmediate<Integer>(
+            wrappingMod(integerValue(lhs), integerValue(rhs)));
+    }
+    auto& operandStack = env.getContext()->operandStack();
+    operandStack.push_back(lhs);
+    operandStack.push_back(rhs);
+    return callBuiltin(env, "mod", 2);
+}
+
+inline ValuePtr step(Environment& env,
+                     ValuePtr val,
+                     Integer::Rep delta,
+                     const char* builtin)
+{
+    if (LIKELY(isInteger(val))) {
+        return makeImmediate<Integer>(wrappingAdd(integerValue(val), delta));
+    }
+    env.getContext()->operandStack().push_back(val);
+    return callBuiltin(env, builtin, 1);
+}
+
+inline ValuePtr increment(Environment& env, ValuePtr val)
+{
+    return step(env, val, 1, "incr");
+}
+
+inline ValuePtr decrement(Environment& env, ValuePtr val)
+{
+    return step(env, val, -1, "decr");
+}
+
+// A closure's frame holds the values that it captured, and functions that
+// don't capture anything are defined directly in the top level. The
+// captured values are on top of the operand stack, which keeps them safe
+// while creating the function.
+template <typename... Args>
+inline ValuePtr makeClosure(Context& context, uint8_t captures, Args&&... args)
+{
+    if (captures == 0) {
+        return context.topLevel().create<Function>(std::forward<Args>(args)...);
+    }
+    auto closure = context.topLevel().derive();
+    auto fn = closure->create<Function>(std::forward<Args>(args)...);
+    auto& operandStack = context.operandStack();
+    for (auto it = operandStack.end() - captures; it not_eq operandStack.end();
+         ++it) {
+        closure->push(*it);
+    }
+    operandStack.erase(operandStack.end() - captures, operandStack.end());
+    return fn;
+}
+
+// Calls a builtin that sits above its arguments on the operand stack,
+// replacing them with the result.
+inline void callWrapped(Environment& env, Heap::Ptr<Function> fn, size_t argc)
+{
+    auto& operandStack = env.getContext()->operandStack();
+    auto result = env.getNull();
+    {
+        Arguments args(env, argc);
+        operandStack.pop_back();
+        result = fn->directCall(args);
+    }
+    operandStack.push_back(result);
+}
+
+// Gathers the arguments past a variadic function's required ones into a
+// list, which becomes its last argument. Returns the function, which may
+// have moved.
+inline Heap::Ptr<Function> gatherRestArgs(Environment& env,
+                                          Heap::Ptr<Function> fn,
+                                          size_t argc)
+{
+    auto& operandStack = env.getContext()->operandStack();
+    const auto requiredArgs = fn->argCount();
+    Persistent<Function> toCall(env, fn);
+    operandStack.pop_back();
+    if (UNLIKELY(argc < requiredArgs - 1)) {
+        failedToApply(env, fn.get(), argc, requiredArgs);
+        throw std::runtime_error("insufficient arguments to VA fn");
+    }
+    {
+        // NOTE: building the list may trigger the collector, after which fn
+        // no longer points to the function.
+        LazyListBuilder builder(env);
+        for (size_t i = 0; i < argc - (requiredArgs - 1); ++i) {
+            builder.pushFront(operandStack.back());
+            operandStack.pop_back();
+        }
+        operandStack.push_back(builder.result());
+    }
+    Heap::Ptr<Function> callee(toCall);
+    operandStack.push_back(callee);
+    return callee;
+}
+
+// For a tail call, moves the callee and its arguments, from the top of the
+// operand stack, down over the frame at base, and drops everything above
+// them. The caller's frame then belongs to the callee.
+inline void replaceFrame(Context& context, Function& fn, size_t base)
+{
+    auto& operandStack = context.operandStack();
+    const size_t size = fn.argCount() + 1;
+    std::copy(operandStack.end() - size, operandStack.end(),
+              operandStack.begin() + base);
+    operandStack.erase(operandStack.begin() + base + size, operandStack.end());
+    auto& frame = context.callStack().back();
+    frame.functionTop_ = fn.getBytecodeAddress();
+    frame.env_ = fn.definitionEnvironment().get();
+}
+
+} // namespace ebl
@@ -0,0 +1,318 @@
+#include "optimizer.hpp"
+#include "bytecode.hpp"
+#include "environment.hpp"
+#include "operations.hpp"
+#include <algorithm>
+
+namespace ebl {
+
+// Values other than variables don't depend on anything, so they're known at
+// compile time, and evaluating them does nothing else.
+static bool isConstant(const ast::Statement& node)
+{
+    return dynamic_cast<const ast::Value*>(&node) and
+           not dynamic_cast<const ast::LValue*>(&node);
+}
+
+static bool isTrue(const ast::Statement& node)
+{
+    return not dynamic_cast<const ast::False*>(&node);
+}
+
+static ast::Ptr<ast::Statement> makeBool(bool value)
+{
+    if (value) {
+        return make_unique<ast::True>();
+    }
+    return make_unique<ast::False>();
+}
+
+static ast::Ptr<ast::Statement> makeInteger(Environment& env,
+                                            Integer::Rep value)
+{
+    auto node = make_unique<ast::Integer>();
+    node->value_ = value;
+    node->cachedVal_ = storeI<Integer>(*env.getContext(), value);
+    return std::move(node);
+}
+
+static ast::Ptr<ast::Statement> makeFloat(Environment& env, Float::Rep value)
+{
+    auto node = make_unique<ast::Float>();
+    node->value_ = value;
+    node->cachedVal_ = storeI<Float>(*env.getContext(), value);
+    return std::move(node);
+}
+
+// A constant number, with its value as a float too.
+struct Number {
+    bool isInteger_;
+    Integer::Rep integer_;
+    Float::Rep float_;
+};
+
+static bool toNumber(const ast::Statement& node, Number& result)
+{
+    if (auto integer = dynamic_cast<const ast::Integer*>(&node)) {
+        result = {true, integer->value_, (Float::Rep)integer->value_};
+        return true;
+    } else if (auto real = dynamic_cast<const ast::Float*>(&node)) {
+        result = {false, 0, real->value_};
+        return true;
+    }
+    return false;
+}
+
+// Mirrors the fast paths in operations.hpp. Returns null for anything that
+// would fall back to calling the builtin, which might raise an error.
+static ast::Ptr<ast::Statement>
+fold(Environment& env, Opcode op, ast::Vector<ast::Ptr<ast::Statement>>& args)
+{
+    if (op == Opcode::Not) {
+        if (not isConstant(*args[0])) {
+            return nullptr;
+        }
+        return makeBool(not isTrue(*args[0]));
+    }
+    Number lhs, rhs;
+    if (not toNumber(*args[0], lhs)) {
+        return nullptr;
+    }
+    if (op == Opcode::Incr or op == Opcode::Decr) {
+        if (not lhs.isInteger_) {
+            return nullptr;
+        }
+        const Integer::Rep delta = op == Opcode::Incr ? 1 : -1;
+        return makeInteger(env, wrappingAdd(lhs.integer_, delta));
+    }
+    if (args.size() not_eq 2 or not toNumber(*args[1], rhs)) {
+        return nullptr;
+    }
+    const bool integers = lhs.isInteger_ and rhs.isInteger_;
+    const bool floats = not lhs.isInteger_ and not rhs.isInteger_;
+    switch (op) {
+    case Opcode::Add:
+        if (integers) {
+            return makeInteger(env, wrappingAdd(lhs.integer_, rhs.integer_));
+        } else {
+            const auto iSum = wrappingAdd(lhs.integer_, rhs.integer_);
+            const auto dSum = (lhs.isInteger_ ? 0.0 : lhs.float_) +
+                              (rhs.isInteger_ ? 0.0 : rhs.float_);
+            if (dSum) {
+                return makeFloat(env, dSum + iSum);
+            }
+            return makeInteger(env, iSum);
+        }
+
+    case Opcode::Sub:
+        if (integers) {
+            return makeInteger(env, wrappingSub(lhs.integer_, rhs.integer_));
+        }
+        return makeFloat(env, lhs.float_ - rhs.float_);
+
+    case Opcode::Lt:
+        if (integers) {
+            return makeBool(lhs.integer_ < rhs.integer_);
+        } else if (floats) {
+            return makeBool(lhs.float_ < rhs.float_);
+        }
+        return nullptr;
+
+    case Opcode::Gt:
+        if (integers) {
+            return makeBool(lhs.integer_ > rhs.integer_);
+        } else if (floats) {
+            return makeBool(lhs.float_ > rhs.float_);
+        }
+        return nullptr;
+
+    // Floats aren't always immediates, and equal? compares the boxed ones.
+    case Opcode::Eq:
+        if (integers) {
+            return makeBool(lhs.integer_ == rhs.integer_);
+        }
+        return nullptr;
+
+    // A zero divisor is left for the builtin to raise its error.
+    case Opcode::Mod:
+        if (integers and rhs.integer_ not_eq 0) {
+            return makeInteger(env, wrappingMod(lhs.integer_, rhs.integer_));
+        }
+        return nullptr;
+
+    default:
+        return nullptr;
+    }
+}
+
+void Optimizer::optimize(ast::Ptr<ast::Statement>& node)
+{
+    node->visit(*this);
+    if (replacement_) {
+        node = std::move(replacement_);
+    }
+}
+
+// Only the last statement's value is kept, so earlier constants and
+// variables do nothing.
+void Optimizer::optimizeBody(ast::Vector<ast::Ptr<ast::Statement>>& statements)
+{
+    for (auto& statement : statements) {
+        optimize(statement);
+    }
+    if (statements.empty()) {
+        return;
+    }
+    statements.erase(std::remove_if(statements.begin(), statements.end() - 1,
+                                    [](const ast::Ptr<ast::Statement>& st) {
+                                        return dynamic_cast<ast::Value*>(
+                                            st.get());
+                                    }),
+                     statements.end() - 1);
+}
+
+void Optimizer::visit(ast::Namespace& node)
+{
+    optimizeBody(node.statements_);
+}
+
+void Optimizer::visit(ast::Literal& node)
+{
+}
+
+void Optimizer::visit(ast::Null& node)
+{
+}
+
+void Optimizer::visit(ast::True& node)
+{
+}
+
+void Optimizer::visit(ast::False& node)
+{
+}
+
+void Optimizer::visit(ast::LValue& node)
+{
+}
+
+void Optimizer::visit(ast::Lambda& node)
+{
+    optimizeBody(node.statements_);
+}
+
+void Optimizer::visit(ast::VariadicLambda& node)
+{
+    optimizeBody(node.statements_);
+}
+
+void Optimizer::visit(ast::Application& node)
+{
+    optimize(node.toApply_);
+    for (auto& arg : node.args_) {
+        optimize(arg);
+    }
+    if (auto builtin = findInlinedBuiltin(node)) {
+        replacement_ = fold(env_, builtin->op_, node.args_);
+    }
+}
+
+void Optimizer::visit(ast::Let& node)
+{
+    for (auto& binding : node.bindings_) {
+        optimize(binding.value_);
+    }
+    optimizeBody(node.statements_);
+}
+
+// Each top level statement's value is the result of exec, so none of them
+// can be dropped.
+void Optimizer::visit(ast::TopLevel& node)
+{
+    for (auto& statement : node.statements_) {
+        optimize(statement);
+    }
+}
+
+void Optimizer::visit(ast::Begin& node)
+{
+    optimizeBody(node.statements_);
+    if (node.statements_.size() == 1) {
+        replacement_ = std::move(node.statements_.front());
+    }
+}
+
+void Optimizer::visit(ast::If& node)
+{
+    optimize(node.condition_);
+    optimize(node.trueBranch_);
+    optimize(node.falseBranch_);
+    if (isConstant(*node.condition_)) {
+        replacement_ = std::move(isTrue(*node.condition_) ? node.trueBranch_
+                                                           : node.falseBranch_);
+    }
+}
+
+// A false constant can be skipped, unless it's the last value, and nothing
+// after a true constant can run.
+void Optimizer::visit(ast::Or& node)
+{
+    auto& statements = node.statements_;
+    for (auto& statement : statements) {
+        optimize(statement);
+    }
+    for (size_t i = 0; i < statements.size(); ++i) {
+        if (not isConstant(*statements[i])) {
+            continue;
+        }
+        if (isTrue(*statements[i])) {
+            statements.erase(statements.begin() + i + 1, statements.end());
+        } else if (i + 1 < statements.size()) {
+            statements.erase(statements.begin() + i--);
+        }
+    }
+    if (statements.size() == 1) {
+        replacement_ = std::move(statements.front());
+    }
+}
+
+// The same as or, with true and false swapped.
+void Optimizer::visit(ast::And& node)
+{
+    auto& statements = node.statements_;
+    for (auto& statement : statements) {
+        optimize(statement);
+    }
+    for (size_t i = 0; i < statements.size(); ++i) {
+        if (not isConstant(*statements[i])) {
+            continue;
+        }
+        if (not isTrue(*statements[i])) {
+            statements.erase(statements.begin() + i + 1, statements.end());
+        } else if (i + 1 < statements.size()) {
+            statements.erase(statements.begin() + i--);
+        }
+    }
+    if (statements.size() == 1) {
+        replacement_ = std::move(statements.front());
+    }
+}
+
+void Optimizer::visit(ast::Def& node)
+{
+    optimize(node.value_);
+}
+
+void Optimizer::visit(ast::Set& node)
+{
+    optimize(node.value_);
+}
+
+void Optimizer::visit(ast::Recur& node)
+{
+    for (auto& arg : node.args_) {
+        optimize(arg);
+    }
+}
+
+} // namespace ebl
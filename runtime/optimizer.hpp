@@ -0,0 +1,51 @@
+#pragma once
+
+#include "ast.hpp"
+
+
+namespace ebl {
+
+class Environment;
+
+// Simplifies the ast between init and the bytecode builder. Calls to inlined
+// builtins with constant arguments are folded, ifs, ands and ors with
+// constant conditions lose the branches that can't run, and values whose
+// results are discarded are dropped. Folding follows the vm's own rules for
+// the builtins, and leaves alone anything that would call the builtin.
+class Optimizer : public ast::Visitor {
+public:
+    explicit Optimizer(Environment& env) : env_(env)
+    {
+    }
+
+    // Optimizes node, which might replace it.
+    void optimize(ast::Ptr<ast::Statement>& node);
+
+    void visit(ast::Namespace& node) override;
+    void visit(ast::Literal& node) override;
+    void visit(ast::Null& node) override;
+    void visit(ast::True& node) override;
+    void visit(ast::False& node) override;
+    void visit(ast::LValue& node) override;
+    void visit(ast::Lambda& node) override;
+    void visit(ast::VariadicLambda& node) override;
+    void visit(ast::Application& node) override;
+    void visit(ast::Let& node) override;
+    void visit(ast::TopLevel& node) override;
+    void visit(ast::Begin& node) override;
+    void visit(ast::If& node) override;
+    void visit(ast::Or& node) override;
+    void visit(ast::And& node) override;
+    void visit(ast::Def& node) override;
+    void visit(ast::Set& node) override;
+    void visit(ast::Recur& node) override;
+
+private:
+    void optimizeBody(ast::Vector<ast::Ptr<ast::Statement>>& statements);
+
+    Environment& env_;
+    // Set by a visit that replaces the node that it visited.
+    ast::Ptr<ast::Statement> replacement_;
+};
+
+} // namespace ebl
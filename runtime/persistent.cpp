@@ -4,23 +4,24 @@
 
 namespace ebl {
 
+// NOTE: the context's list points to the most recently created persistent,
+// and older persistents are reachable through prev().
 PersistentBase::PersistentBase(Environment& env, ValuePtr val)
-    : val_(val), next_(nullptr)
+    : val_(val), list_(env.getContext()->getPersistentsList()),
+      prev_(list_), next_(nullptr)
 {
-    auto& plist = env.getContext()->getPersistentsList();
-    if (plist) {
-        plist->next_ = this;
-        prev_ = plist;
-    } else {
-        prev_ = nullptr;
+    if (prev_) {
+        prev_->next_ = this;
     }
-    plist = this;
+    list_ = this;
 }
 
 PersistentBase::~PersistentBase()
 {
     if (next_) {
         next_->prev_ = prev_;
+    } else {
+        list_ = prev_;
     }
     if (prev_) {
         prev_->next_ = next_;
@@ -50,6 +50,7 @@ public:
 
 protected:
     ValuePtr val_;
+    PersistentBase*& list_;
     PersistentBase* prev_;
     PersistentBase* next_;
 };
@@ -1,64 +1,366 @@
+#pragma once
+
 #include "macros.hpp"
-#include <array>
+#include "spinlock.hpp"
+#include <atomic>
 #include <cassert>
 #include <mutex>
+#include <new>
+#include <stdint.h>
 #include <stddef.h>
+#include <stdlib.h>
+#if defined(_WIN32) or defined(_WIN64)
+#include <malloc.h>
+#endif
 
 namespace ebl {
 
 // NOTE: Pools are only designed for scalar allocations. The whole
 // intent of this class is specifically for use with allocate_shared,
 // for allocating environment frames.
+//
+// Each thread carves allocations out of blocks that it owns, so the common
+// case takes no locks and no atomic read-modify-writes. A value freed by a
+// thread other than its block's owner goes on the block's remote freelist.
+// The first value on it queues the block with the owner, which takes over
+// the queued blocks' remote freelists once its own freelists run dry. Full
+// blocks stay out of the way until a value in them is freed, so a refill
+// never looks at them. Blocks that become completely free are returned to
+// the system, and when a thread exits, blocks still in use are abandoned to
+// a global list, for another thread to adopt.
 
 template <typename T> struct PoolAllocator {
     typedef T value_type;
 
     class Pool {
     private:
-        struct Node {
-            alignas(T) std::array<uint8_t, sizeof(T)> mem_;
+        static constexpr const size_t blockSize = 16384;
+
+        union Node {
+            alignas(T) uint8_t mem_[sizeof(T)];
             Node* next_;
         };
 
-        void grow()
+        class Cache;
+
+        struct Block {
+            std::atomic<Cache*> owner_;
+            std::atomic<Node*> remote_;
+            Node* free_;
+            size_t used_;
+            Block* prev_;
+            Block* next_;
+            // Links the blocks queued with the owner, see pushRemote.
+            Block* nextQueued_;
+
+            static constexpr size_t nodesOffset()
+            {
+                return (sizeof(Block) + alignof(Node) - 1) &
+                       ~(alignof(Node) - 1);
+            }
+
+            static constexpr size_t capacity()
+            {
+                return (blockSize - nodesOffset()) / sizeof(Node);
+            }
+
+            Node* nodes()
+            {
+                return (Node*)((uint8_t*)this + nodesOffset());
+            }
+
+            static Block* of(void* mem)
+            {
+                return (Block*)((uintptr_t)mem & ~(uintptr_t)(blockSize - 1));
+            }
+
+            // Moves the remote freelist over to the local one.
+            void collect()
+            {
+                Node* node =
+                    remote_.exchange(nullptr, std::memory_order_acquire);
+                while (node) {
+                    Node* const next = node->next_;
+                    node->next_ = free_;
+                    free_ = node;
+                    --used_;
+                    node = next;
+                }
+            }
+
+            // Only the first value on an empty remote freelist takes the
+            // lock, to queue the block with its owner. Remote freelists are
+            // only ever emptied with the lock held, so the owner can't go
+            // away in between, and neither can the block, as node still
+            // counts as used.
+            void pushRemote(Node* node)
+            {
+                Node* head = remote_.load(std::memory_order_relaxed);
+                while (true) {
+                    if (head == nullptr) {
+                        std::lock_guard<Spinlock> guard(remoteLock_);
+                        node->next_ = nullptr;
+                        if (remote_.compare_exchange_strong(
+                                head, node, std::memory_order_release,
+                                std::memory_order_relaxed)) {
+                            if (auto owner =
+                                    owner_.load(std::memory_order_relaxed)) {
+                                owner->queue(this);
+                            }
+                            return;
+                        }
+                    }
+                    node->next_ = head;
+                    if (remote_.compare_exchange_weak(
+                            head, node, std::memory_order_release,
+                            std::memory_order_relaxed)) {
+                        return;
+                    }
+                }
+            }
+        };
+
+        static_assert(Block::capacity() > 1, "pooled type too large");
+
+        static Block* allocBlock()
         {
-            constexpr size_t allocCount = 4096 / sizeof(Node);
-            constexpr size_t allocSize = allocCount * sizeof(Node);
-            auto nodes = (Node*)malloc(allocSize);
-            for (size_t i = 0; i < allocCount; ++i) {
-                Node* current = &nodes[i];
-                current->next_ = freelist_;
-                freelist_ = current;
+            void* mem;
+#if defined(_WIN32) or defined(_WIN64)
+            mem = _aligned_malloc(blockSize, blockSize);
+#else
+            if (posix_memalign(&mem, blockSize, blockSize)) {
+                mem = nullptr;
+            }
+#endif
+            if (UNLIKELY(mem == nullptr)) {
+                throw std::bad_alloc();
+            }
+            auto block = (Block*)mem;
+            new (&block->owner_) std::atomic<Cache*>(nullptr);
+            new (&block->remote_) std::atomic<Node*>(nullptr);
+            block->free_ = nullptr;
+            block->used_ = 0;
+            block->prev_ = nullptr;
+            block->next_ = nullptr;
+            block->nextQueued_ = nullptr;
+            Node* const nodes = block->nodes();
+            for (size_t i = Block::capacity(); i > 0; --i) {
+                nodes[i - 1].next_ = block->free_;
+                block->free_ = &nodes[i - 1];
             }
+            return block;
         }
 
-    public:
-        Pool() : freelist_(nullptr)
+        static void freeBlock(Block* block)
         {
+#if defined(_WIN32) or defined(_WIN64)
+            _aligned_free(block);
+#else
+            free(block);
+#endif
         }
 
-        void* alloc()
+        // Blocks left behind by threads that exited. Threads only ever push
+        // single blocks or take the whole list, so there's no ABA problem.
+        static std::atomic<Block*> abandoned_;
+
+        // Held while emptying a remote freelist, or handing a block over to
+        // another owner, see pushRemote.
+        static Spinlock remoteLock_;
+
+        static void abandon(Block* block)
         {
-            std::lock_guard<std::mutex> guard(lock_);
-            if (UNLIKELY(freelist_ == nullptr)) {
-                grow();
+            Block* head = abandoned_.load(std::memory_order_relaxed);
+            do {
+                block->next_ = head;
+            } while (not abandoned_.compare_exchange_weak(
+                head, block, std::memory_order_release,
+                std::memory_order_relaxed));
+        }
+
+        class Cache {
+        public:
+            Cache() : current_(allocBlock())
+            {
+                current_->owner_.store(this, std::memory_order_relaxed);
+                alive_ = this;
+            }
+
+            ~Cache()
+            {
+                alive_ = nullptr;
+                std::lock_guard<Spinlock> guard(remoteLock_);
+                release(current_);
+                releaseAll(partial_);
+                releaseAll(full_);
+            }
+
+            void* alloc()
+            {
+                if (UNLIKELY(current_->free_ == nullptr)) {
+                    refill();
+                }
+                Node* const node = current_->free_;
+                current_->free_ = node->next_;
+                ++current_->used_;
+                return node->mem_;
+            }
+
+            void dealloc(Block* block, Node* node)
+            {
+                const bool wasFull = block->free_ == nullptr;
+                node->next_ = block->free_;
+                block->free_ = node;
+                --block->used_;
+                if (block not_eq current_) {
+                    freed(block, wasFull);
+                }
             }
-            void* const ret = freelist_->mem_.data();
-            freelist_ = freelist_->next_;
-            return ret;
+
+            // Called by pushRemote, with remoteLock_ held.
+            void queue(Block* block)
+            {
+                block->nextQueued_ = queued_.load(std::memory_order_relaxed);
+                queued_.store(block, std::memory_order_relaxed);
+            }
+
+            // Nulled out when the thread's cache is destroyed, see dealloc.
+            static thread_local Cache* alive_;
+
+        private:
+            static void link(Block*& list, Block* block)
+            {
+                block->prev_ = nullptr;
+                block->next_ = list;
+                if (list) {
+                    list->prev_ = block;
+                }
+                list = block;
+            }
+
+            static void unlink(Block*& list, Block* block)
+            {
+                if (block->prev_) {
+                    block->prev_->next_ = block->next_;
+                } else {
+                    list = block->next_;
+                }
+                if (block->next_) {
+                    block->next_->prev_ = block->prev_;
+                }
+            }
+
+            // Blocks other than current_ are on partial_ when they have
+            // local frees, and on full_ otherwise.
+            void freed(Block* block, bool wasFull)
+            {
+                if (block->used_ == 0) {
+                    unlink(wasFull ? full_ : partial_, block);
+                    freeBlock(block);
+                } else if (wasFull and block->free_) {
+                    unlink(full_, block);
+                    link(partial_, block);
+                }
+            }
+
+            static void release(Block* block)
+            {
+                block->owner_.store(nullptr, std::memory_order_release);
+                block->collect();
+                if (block->used_ == 0) {
+                    freeBlock(block);
+                } else {
+                    abandon(block);
+                }
+            }
+
+            static void releaseAll(Block* list)
+            {
+                while (list) {
+                    Block* const next = list->next_;
+                    release(list);
+                    list = next;
+                }
+            }
+
+            // Only blocks with frees are visited, so full blocks cost
+            // nothing here.
+            void refill()
+            {
+                link(full_, current_);
+                if (queued_.load(std::memory_order_relaxed)) {
+                    std::lock_guard<Spinlock> guard(remoteLock_);
+                    Block* block = queued_.load(std::memory_order_relaxed);
+                    queued_.store(nullptr, std::memory_order_relaxed);
+                    while (block) {
+                        Block* const next = block->nextQueued_;
+                        const bool wasFull = block->free_ == nullptr;
+                        block->collect();
+                        freed(block, wasFull);
+                        block = next;
+                    }
+                }
+                if (partial_ == nullptr) {
+                    adopt();
+                }
+                if (partial_) {
+                    current_ = partial_;
+                    unlink(partial_, current_);
+                } else {
+                    current_ = allocBlock();
+                    current_->owner_.store(this, std::memory_order_relaxed);
+                }
+            }
+
+            void adopt()
+            {
+                Block* block =
+                    abandoned_.exchange(nullptr, std::memory_order_acquire);
+                if (block == nullptr) {
+                    return;
+                }
+                std::lock_guard<Spinlock> guard(remoteLock_);
+                while (block) {
+                    Block* const next = block->next_;
+                    block->owner_.store(this, std::memory_order_release);
+                    block->collect();
+                    link(block->free_ ? partial_ : full_, block);
+                    block = next;
+                }
+            }
+
+            Block* current_;
+            Block* partial_ = nullptr;
+            Block* full_ = nullptr;
+            // Blocks that other threads have freed values in, see queue.
+            std::atomic<Block*> queued_{nullptr};
+        };
+
+        static Cache& cache()
+        {
+            static thread_local Cache cache;
+            return cache;
+        }
+
+    public:
+        void* alloc()
+        {
+            return cache().alloc();
         }
 
         void dealloc(void* mem)
         {
-            std::lock_guard<std::mutex> guard(lock_);
             auto node = (Node*)mem;
-            node->next_ = freelist_;
-            freelist_ = node;
+            Block* const block = Block::of(mem);
+            Cache* const local = Cache::alive_;
+            if (LIKELY(local and
+                       block->owner_.load(std::memory_order_acquire) ==
+                           local)) {
+                local->dealloc(block, node);
+            } else {
+                block->pushRemote(node);
+            }
         }
-
-    private:
-        Node* freelist_;
-        std::mutex lock_;
     };
 
     static Pool pool;
@@ -70,6 +372,7 @@ template <typename T> struct PoolAllocator {
 
     T* allocate(size_t n, const void* hint = 0)
     {
+        assert(n == 1);
         return static_cast<T*>(pool.alloc());
     }
 
@@ -81,6 +384,16 @@ template <typename T> struct PoolAllocator {
 
 template <typename T> typename PoolAllocator<T>::Pool PoolAllocator<T>::pool;
 
+template <typename T>
+std::atomic<typename PoolAllocator<T>::Pool::Block*>
+    PoolAllocator<T>::Pool::abandoned_{nullptr};
+
+template <typename T> Spinlock PoolAllocator<T>::Pool::remoteLock_;
+
+template <typename T>
+thread_local typename PoolAllocator<T>::Pool::Cache*
+    PoolAllocator<T>::Pool::Cache::alive_ = nullptr;
+
 template <typename T, typename U>
 inline bool operator==(const PoolAllocator<T>&, const PoolAllocator<U>&)
 {
@@ -0,0 +1,344 @@
+#include "profiler.hpp"
+#include "bytecode.hpp"
+#include "environment.hpp"
+#include <algorithm>
+#include <iomanip>
+#include <stdexcept>
+
+#if defined(__unix__) or defined(__APPLE__)
+#define EBL_SAMPLER
+#include <sys/time.h>
+#endif
+
+namespace ebl {
+
+Profiler::Profiler(Context& context) : context_(context), tailCallDepth_(0)
+{
+    nodes_.push_back({0, nullptr, {}, 0, 0, {}, {}});
+    current_ = &nodes_.front();
+    opcodes_.fill(0);
+}
+
+void Profiler::step(InstructionAddress ip)
+{
+    const auto& callStack = context_.callStack();
+    const auto op = (Opcode)context_.getProgram()[ip];
+    ++opcodes_[(uint8_t)op];
+    // Frames left behind by an exception.
+    while (activations_.size() > callStack.size()) {
+        exit();
+    }
+    // A tail call to a bytecode function lands at the start of the callee,
+    // which took over the caller's frame. A builtin called in tail position
+    // might call back into the vm, with a frame of its own.
+    if (tailCallDepth_) {
+        if (callStack.size() == tailCallDepth_ and
+            ip == callStack.back().functionTop_) {
+            exit();
+        }
+        tailCallDepth_ = 0;
+    }
+    while (activations_.size() < callStack.size()) {
+        enter(callStack[activations_.size()]);
+    }
+    if (op == Opcode::Return or op == Opcode::ExitLet) {
+        exit();
+    } else if (op == Opcode::TailCall) {
+        tailCallDepth_ = callStack.size();
+    }
+}
+
+void Profiler::enter(const StackFrame& frame)
+{
+    Node* const parent = current_;
+    // The top level, and top level lets, have no function.
+    if (frame.functionTop_ == 0) {
+        activations_.push_back({parent, false, false, {}, {}});
+        return;
+    }
+    if (parent->function_ == frame.functionTop_) {
+        ++parent->calls_;
+        activations_.push_back({parent, true, true, Clock::now(), {}});
+        return;
+    }
+    auto& child = parent->children_[frame.functionTop_];
+    if (child == nullptr) {
+        nodes_.push_back({frame.functionTop_, parent, {}, 0, 0, {}, {}});
+        child = &nodes_.back();
+    }
+    ++child->calls_;
+    current_ = child;
+    activations_.push_back({child, true, false, Clock::now(), {}});
+}
+
+void Profiler::exit()
+{
+    const auto activation = activations_.back();
+    activations_.pop_back();
+    current_ =
+        activations_.empty() ? &nodes_.front() : activations_.back().node_;
+    if (not activation.function_) {
+        return;
+    }
+    const auto elapsed = Clock::now() - activation.start_;
+    activation.node_->self_ += elapsed - activation.children_;
+    if (not activation.recursive_) {
+        activation.node_->total_ += elapsed;
+    }
+    for (auto it = activations_.rbegin(); it not_eq activations_.rend();
+         ++it) {
+        if (it->function_) {
+            it->children_ += elapsed;
+            break;
+        }
+    }
+}
+
+// Only top level definitions still have a name at runtime. At the top
+// level, a variable's slot is the same as its index in the scope.
+std::map<InstructionAddress, std::string>
+Profiler::functionNames(Context& context)
+{
+    std::map<InstructionAddress, std::string> names;
+    auto& vars = context.topLevel().getVars();
+    for (StackLoc slot = 0; slot < vars.size(); ++slot) {
+        if (not isType<Function>(vars[slot])) {
+            continue;
+        }
+        auto fn = vars[slot].cast<Function>();
+        if (fn->getInvocationModel() not_eq
+            Function::InvocationModel::Wrapped) {
+            names.emplace(fn->getBytecodeAddress(),
+                          context.astRoot_->nameOf(slot));
+        }
+    }
+    return names;
+}
+
+static std::string nameOf(std::map<InstructionAddress, std::string>& names,
+                          InstructionAddress function)
+{
+    auto found = names.find(function);
+    if (found == names.end()) {
+        return "lambda@" + std::to_string(function);
+    }
+    return found->second;
+}
+
+// Visits the call tree depth first, without recursion, as the tree can be
+// as deep as the program's mutual recursion. The root is left out of paths.
+template <typename Enter, typename Leave>
+void Profiler::walk(Enter&& enter, Leave&& leave)
+{
+    std::vector<std::pair<Node*, bool>> pending{{&nodes_.front(), false}};
+    std::vector<Node*> path;
+    while (not pending.empty()) {
+        const auto item = pending.back();
+        pending.pop_back();
+        if (item.second) {
+            leave(*path.back());
+            path.pop_back();
+            continue;
+        }
+        if (item.first not_eq &nodes_.front()) {
+            path.push_back(item.first);
+            enter(path);
+            pending.push_back({item.first, true});
+        }
+        auto& children = item.first->children_;
+        for (auto it = children.rbegin(); it not_eq children.rend(); ++it) {
+            pending.push_back({it->second, false});
+        }
+    }
+}
+
+void Profiler::report(std::ostream& out)
+{
+    using namespace std::chrono;
+    struct Totals {
+        InstructionAddress function_;
+        size_t calls_;
+        size_t allocations_;
+        Clock::duration self_;
+        Clock::duration total_;
+    };
+    std::map<InstructionAddress, Totals> functions;
+    // Inclusive time only counts the outermost of nested calls to the same
+    // function, or recursion would count the same time more than once.
+    std::map<InstructionAddress, size_t> onPath;
+    walk(
+        [&](const std::vector<Node*>& path) {
+            const Node& node = *path.back();
+            auto found = functions.find(node.function_);
+            if (found == functions.end()) {
+                found = functions
+                            .insert({node.function_,
+                                     {node.function_, 0, 0, {}, {}}})
+                            .first;
+            }
+            auto& totals = found->second;
+            totals.calls_ += node.calls_;
+            totals.allocations_ += node.allocations_;
+            totals.self_ += node.self_;
+            if (onPath[node.function_]++ == 0) {
+                totals.total_ += node.total_;
+            }
+        },
+        [&](const Node& node) { --onPath[node.function_]; });
+
+    std::vector<Totals> sorted;
+    for (auto& function : functions) {
+        sorted.push_back(function.second);
+    }
+    std::sort(sorted.begin(), sorted.end(),
+              [](const Totals& lhs, const Totals& rhs) {
+                  return lhs.self_ > rhs.self_;
+              });
+    auto names = functionNames(context_);
+    const auto millis = [](Clock::duration time) {
+        return duration_cast<microseconds>(time).count() / 1000.0;
+    };
+    out << std::setw(10) << "calls" << std::setw(14) << "inclusive ms"
+        << std::setw(14) << "exclusive ms" << std::setw(13) << "allocations"
+        << "  function" << std::endl;
+    out << std::fixed << std::setprecision(3);
+    for (auto& totals : sorted) {
+        out << std::setw(10) << totals.calls_ << std::setw(14)
+            << millis(totals.total_) << std::setw(14) << millis(totals.self_)
+            << std::setw(13) << totals.allocations_ << "  "
+            << nameOf(names, totals.function_) << std::endl;
+    }
+    out << "allocations outside of functions: "
+        << nodes_.front().allocations_ << std::endl;
+
+    std::vector<std::pair<size_t, uint8_t>> histogram;
+    size_t instructions = 0;
+    for (size_t op = 0; op < (size_t)Opcode::Count; ++op) {
+        if (opcodes_[op]) {
+            histogram.push_back({opcodes_[op], (uint8_t)op});
+            instructions += opcodes_[op];
+        }
+    }
+    std::sort(histogram.rbegin(), histogram.rend());
+    out << std::endl
+        << std::setw(14) << "instructions" << std::setw(9) << "%"
+        << "  opcode" << std::endl;
+    out << std::setprecision(2);
+    for (auto& entry : histogram) {
+        out << std::setw(14) << entry.first << std::setw(9)
+            << 100.0 * entry.first / instructions << "  "
+            << opcodeName((Opcode)entry.second) << std::endl;
+    }
+}
+
+void Profiler::writeFolded(std::ostream& out)
+{
+    using namespace std::chrono;
+    auto names = functionNames(context_);
+    walk(
+        [&](const std::vector<Node*>& path) {
+            const auto self =
+                duration_cast<microseconds>(path.back()->self_).count();
+            if (self == 0) {
+                return;
+            }
+            out << "toplevel";
+            for (auto node : path) {
+                out << ';' << nameOf(names, node->function_);
+            }
+            out << ' ' << self << '\n';
+        },
+        [](const Node&) {});
+    out.flush();
+}
+
+#ifdef EBL_SAMPLER
+
+static volatile std::sig_atomic_t* sampleRequested = nullptr;
+static struct sigaction previousAction;
+
+static void requestSample(int)
+{
+    *sampleRequested = 1;
+}
+
+Sampler::Sampler(Context& context, std::chrono::microseconds interval)
+    : context_(context)
+{
+    if (sampleRequested) {
+        throw std::runtime_error("only one sampler can run at a time");
+    }
+    sampleRequested = &context_.sampleRequested();
+    struct sigaction action {};
+    action.sa_handler = requestSample;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, &previousAction);
+    itimerval timer{};
+    timer.it_interval.tv_sec = interval.count() / 1000000;
+    timer.it_interval.tv_usec = interval.count() % 1000000;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, nullptr);
+}
+
+Sampler::~Sampler()
+{
+    itimerval timer{};
+    setitimer(ITIMER_PROF, &timer, nullptr);
+    sigaction(SIGPROF, &previousAction, nullptr);
+    sampleRequested = nullptr;
+}
+
+bool Sampler::supported()
+{
+    return true;
+}
+
+#else
+
+Sampler::Sampler(Context& context, std::chrono::microseconds)
+    : context_(context)
+{
+    throw std::runtime_error("sampling is unsupported on this platform");
+}
+
+Sampler::~Sampler()
+{
+}
+
+bool Sampler::supported()
+{
+    return false;
+}
+
+#endif
+
+// Frames without a function, like top level lets, belong to the enclosing
+// function. Direct recursion is collapsed, as in the Profiler's call tree.
+void Sampler::sample()
+{
+    context_.sampleRequested_ = 0;
+    stack_.clear();
+    for (auto& frame : context_.callStack()) {
+        if (frame.functionTop_ and
+            (stack_.empty() or stack_.back() not_eq frame.functionTop_)) {
+            stack_.push_back(frame.functionTop_);
+        }
+    }
+    ++samples_[stack_];
+}
+
+void Sampler::writeFolded(std::ostream& out)
+{
+    auto names = Profiler::functionNames(context_);
+    for (auto& sample : samples_) {
+        out << "toplevel";
+        for (auto function : sample.first) {
+            out << ';' << nameOf(names, function);
+        }
+        out << ' ' << sample.second << '\n';
+    }
+    out.flush();
+}
+
+} // namespace ebl
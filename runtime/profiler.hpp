@@ -0,0 +1,116 @@
+#pragma once
+
+#include "vm.hpp"
+#include <array>
+#include <chrono>
+#include <csignal>
+#include <deque>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace ebl {
+
+class Context;
+
+// Records calls, time and allocations for each bytecode function, along with
+// how often each opcode runs. While profiling, the vm dispatches every
+// instruction through a separate table, which calls step() first, so the
+// profiler costs nothing when it's off. Compiled code doesn't go through
+// the vm's dispatch, so the jit stays off while profiling.
+class Profiler {
+public:
+    Profiler(Context& context);
+    Profiler(const Profiler&) = delete;
+
+    // Called by the vm before running the instruction at ip.
+    void step(InstructionAddress ip);
+
+    // Called for each value allocated on the heap.
+    void allocated()
+    {
+        ++current_->allocations_;
+    }
+
+    // Calls, inclusive and exclusive time, and allocations for each
+    // function, followed by the opcode histogram.
+    void report(std::ostream& out);
+
+    // A line for each distinct call stack, with the microseconds spent in
+    // the stack's last function, as read by flamegraph.pl.
+    void writeFolded(std::ostream& out);
+
+    // Names functions after their top level definitions.
+    static std::map<InstructionAddress, std::string>
+    functionNames(Context& context);
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    // Calls form a tree, with a node for each distinct call stack. Direct
+    // recursion stays within one node, which keeps the tree from growing
+    // with the depth of recursion.
+    struct Node {
+        InstructionAddress function_;
+        Node* parent_;
+        std::map<InstructionAddress, Node*> children_;
+        size_t calls_;
+        size_t allocations_;
+        Clock::duration self_;
+        Clock::duration total_;
+    };
+
+    // Frames that aren't functions, like top level lets, belong to the
+    // enclosing function's node, and aren't timed separately.
+    struct Activation {
+        Node* node_;
+        bool function_;
+        bool recursive_;
+        Clock::time_point start_;
+        Clock::duration children_;
+    };
+
+    void enter(const StackFrame& frame);
+    void exit();
+    template <typename Enter, typename Leave>
+    void walk(Enter&& enter, Leave&& leave);
+
+    Context& context_;
+    std::deque<Node> nodes_;
+    Node* current_;
+    std::vector<Activation> activations_;
+    size_t tailCallDepth_;
+    std::array<size_t, 256> opcodes_;
+};
+
+// Samples the call stack every so often, using a SIGPROF timer, which
+// disturbs the program much less than recording every call. The signal
+// handler only sets the context's sampleRequested flag, and the vm sends
+// its next instruction through the profiling dispatch table, which takes
+// the sample. Compiled code takes samples when calling, recurring or
+// entering the jit. SIGPROF belongs to the whole process, so only one
+// sampler can run at a time.
+class Sampler {
+public:
+    Sampler(Context& context, std::chrono::microseconds interval);
+    Sampler(const Sampler&) = delete;
+    ~Sampler();
+
+    // False on platforms without setitimer.
+    static bool supported();
+
+    // Records the call stack, and clears the context's request.
+    void sample();
+
+    // A line for each distinct call stack, with the number of samples taken
+    // in it, as read by flamegraph.pl.
+    void writeFolded(std::ostream& out);
+
+private:
+    Context& context_;
+    std::map<std::vector<InstructionAddress>, size_t> samples_;
+    std::vector<InstructionAddress> stack_;
+};
+
+} // namespace ebl
@@ -41,15 +41,23 @@ ValuePtr Function::call(Arguments& params)
             failedToApply(*envPtr_, this, params.count(), requiredArgs_);
         }
         Context* const ctx = envPtr_->getContext();
-        auto derived = envPtr_->derive();
-        ctx->callStack().push_back(
-            {ctx->getProgram().size() - 1, bytecodeAddress_, derived});
-        VM::execute(*derived, ctx->getProgram(), bytecodeAddress_);
-        auto ret = ctx->operandStack().back();
+        auto& operandStack = ctx->operandStack();
+        // The function sits above its arguments in the frame, see StackFrame.
+        operandStack.push_back(
+            Heap::GenericPtr::UNSAFE_make<Function>((uint8_t*)this));
+        const size_t base = operandStack.size() - (params.count() + 1);
+        ctx->callStack().push_back({ctx->getProgram().size() - 1,
+                                    bytecodeAddress_, envPtr_.get(), base});
+        auto code = ctx->jit() ? ctx->jit()->hot(*this) : nullptr;
+        if (not code or not ctx->jit()->enter(code, base, envPtr_.get())) {
+            VM::execute(*envPtr_, ctx->getProgram(),
+                        ctx->callStack().back().functionTop_);
+        }
+        auto ret = operandStack.back();
         // The bytecode function would have taken the args off of the
         // operand stack, so we need to clear out the argument
         // vector's count.
-        ctx->operandStack().pop_back();
+        operandStack.pop_back();
         params.consumed();
         return ret;
     } break;
@@ -99,6 +107,17 @@ Function::Function(Environment& env, ValuePtr docstring, size_t requiredArgs,
 }
 
 
+Value immediateHeaders[immediateTagMask + 1] = {
+    Value{0}, // Unused, heap pointers aren't tagged
+    Value{typeId<Integer>()},
+    Value{typeId<Float>()},
+    Value{typeId<Character>()},
+    Value{typeId<Boolean>()},
+    Value{typeId<Null>()},
+    Value{typeId<Float>()},
+    Value{0}, // Unused
+};
+
 TypeError::TypeError(TypeId t, const std::string& reason)
     : std::runtime_error(std::string("for type ") + typeInfoTable[t].name_ +
                          ": " + reason)
@@ -127,7 +146,7 @@ void String::initialize(const char* data, size_t len, Encoding enc)
         storage_.init(len * sizeof(Character));
         for (size_t i = 0; i < len; ++i) {
             auto charMem = storage_.alloc<Character>();
-            new (charMem.cast<Character>().get()) Character({data[i], 0, 0, 0});
+            new ((Character*)charMem.handle()) Character({data[i], 0, 0, 0});
         }
     } break;
 
@@ -136,7 +155,7 @@ void String::initialize(const char* data, size_t len, Encoding enc)
         foreachUtf8Glyph(
             [&](const Character::Rep& val) {
                 auto charMem = storage_.alloc<Character>();
-                new (charMem.cast<Character>().get()) Character(val);
+                new ((Character*)charMem.handle()) Character(val);
             },
             data, len);
     } break;
@@ -146,17 +165,18 @@ void String::initialize(const char* data, size_t len, Encoding enc)
 bool String::operator==(const Input& other) const
 {
     auto glyphs = reinterpret_cast<Character*>(storage_.begin());
+    const auto len = length();
     size_t index = 0;
     bool equal = true;
     foreachUtf8Glyph(
         [&](const Character::Rep& val) {
-            if (glyphs[index].value() != val) {
+            if (index >= len or glyphs[index].value() != val) {
                 equal = false;
             }
             index += 1;
         },
         other.c_str(), other.length());
-    return equal;
+    return equal and index == len;
 }
 
 bool String::operator==(const String& other) const
@@ -220,6 +240,7 @@ void Object::setAttr(Environment& env,
                      Heap::Ptr<Value> value)
 {
     members_.emplace(name->value()->toAscii(), value);
+    writeBarrier(this, value);
 }
 
 std::ostream& operator<<(std::ostream& out, const String& str)
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <array>
+#include <atomic>
 #include <complex>
 #include <functional>
 #include <limits>
@@ -29,14 +30,25 @@ using TypeId = uint8_t;
 
 class Value {
 private:
+    enum Flags : uint8_t {
+        Marked = 1 << 0,
+        Young = 1 << 1,      // allocated in the nursery
+        Remembered = 1 << 2, // recorded by the write barrier
+        Forwarded = 1 << 3,  // evacuated from the nursery
+    };
+
     struct Header {
         const TypeId typeInfoIndex;
-        uint8_t marked : 1;
-        uint8_t reserved : 7;
+        uint8_t flags;
     } header_;
 
+    inline void setFlag(Flags flag, bool value)
+    {
+        header_.flags = value ? header_.flags | flag : header_.flags & ~flag;
+    }
+
 public:
-    inline Value(TypeId id) : header_{id, 0, 0}
+    constexpr Value(TypeId id) : header_{id, 0}
     {
     }
     inline TypeId typeId() const
@@ -45,26 +57,199 @@ public:
     }
     inline void mark()
     {
-        header_.marked = true;
+        header_.flags |= Marked;
     }
     inline void unmark()
     {
-        header_.marked = false;
+        header_.flags &= ~Marked;
     }
     inline bool marked() const
     {
-        return header_.marked;
+        return header_.flags & Marked;
+    }
+    // Marks the value, and returns false if it was already marked. Safe to
+    // call from several collector threads at once.
+    inline bool tryMark()
+    {
+        return not(__atomic_fetch_or(&header_.flags, uint8_t(Marked),
+                                     __ATOMIC_RELAXED) &
+                   Marked);
+    }
+    inline bool young() const
+    {
+        return header_.flags & Young;
+    }
+    inline void setYoung(bool young)
+    {
+        setFlag(Young, young);
+    }
+    inline bool remembered() const
+    {
+        return header_.flags & Remembered;
+    }
+    inline void setRemembered(bool remembered)
+    {
+        setFlag(Remembered, remembered);
+    }
+    inline bool forwarded() const
+    {
+        return header_.flags & Forwarded;
+    }
+    inline void setForwarded()
+    {
+        header_.flags |= Forwarded;
     }
 };
 
 
+// Integers, characters, booleans and null are stored within the pointer
+// itself, rather than on the heap. Heap values are eight byte aligned, so an
+// immediate is any pointer with some of the low three bits set. The tag
+// selects the type, and the payload goes in the upper 32 bits. Floats are
+// special, see Float::encode.
+enum class ImmediateTag : uintptr_t {
+    None,
+    Integer,
+    Float,
+    Character,
+    Boolean,
+    Null,
+    NegativeFloat,
+};
+
+static const uintptr_t immediateTagMask = 7;
+
+static_assert(sizeof(uintptr_t) == 8,
+              "immediates require 64 bit pointers to fit their payload");
+
+inline uintptr_t packImmediate(ImmediateTag tag, uint32_t payload)
+{
+    return (uintptr_t)payload << 32 | (uintptr_t)tag;
+}
+
+inline uint32_t immediatePayload(uintptr_t word)
+{
+    return word >> 32;
+}
+
+inline ImmediateTag immediateTag(const void* handle)
+{
+    return ImmediateTag((uintptr_t)handle & immediateTagMask);
+}
+
+inline bool isImmediate(const void* handle)
+{
+    return (uintptr_t)handle & immediateTagMask;
+}
+
+// Stand-in headers for immediates, indexed by tag, so that code that only
+// looks at a value's header, like typeId(), works for any value.
+extern Value immediateHeaders[immediateTagMask + 1];
+
+template <> struct PtrTraits<Value> {
+    using Pointer = Value*;
+    using Reference = Value&;
+
+    static Pointer get(uint8_t* handle)
+    {
+        if (UNLIKELY(isImmediate(handle))) {
+            return &immediateHeaders[(size_t)immediateTag(handle)];
+        }
+        return reinterpret_cast<Value*>(handle);
+    }
+
+    static Reference deref(uint8_t* handle)
+    {
+        return *get(handle);
+    }
+};
+
 using ValuePtr = Heap::Ptr<Value>;
 
+inline bool isImmediate(ValuePtr val)
+{
+    return isImmediate(val.handle());
+}
+
+
+// Adds an old value to the remembered set, see gc.cpp.
+void rememberValue(Value* owner);
+
+// Write barrier for the generational collector. Any value that may outlive a
+// nursery collection needs to call writeBarrier after storing a pointer into
+// one of its fields, so that the collector can find old-to-young pointers
+// without tracing the whole heap.
+inline void writeBarrier(Value* owner, ValuePtr value)
+{
+    if (UNLIKELY(value->young() and not owner->young() and
+                 not owner->remembered())) {
+        rememberValue(owner);
+    }
+}
+
+
+// Number of contexts that are marking incrementally, see gc.cpp.
+extern std::atomic<int> incrementalMarkers;
+
+// Queues a value for the incremental marker.
+void shadeValue(Value* val);
+
+// Deletion barrier for incremental marking. While a context is marking
+// incrementally, the marker has to find every value that was reachable when
+// marking began, so a value's fields need to call deletionBarrier with the
+// pointer that they're about to overwrite.
+inline void deletionBarrier(ValuePtr old)
+{
+    if (UNLIKELY(incrementalMarkers.load(std::memory_order_relaxed)) and
+        not isImmediate(old) and not old->young()) {
+        shadeValue(old.get());
+    }
+}
+
+
+// Visits the values that a value references, see TypeInfo::trace. The
+// collector uses tracers to mark values, and to update fields after moving
+// values around.
+class Tracer {
+public:
+    Tracer(bool updatesFields) : updatesFields_(updatesFields)
+    {
+    }
+
+    virtual ~Tracer()
+    {
+    }
+
+    // Returns the value that the field should hold from now on.
+    virtual ValuePtr visit(ValuePtr val) = 0;
+
+    // Functions reference their definition environment, which isn't a value.
+    virtual void visitFrame(Environment& frame)
+    {
+    }
+
+    // NOTE: fields are updated through their setters, which run the write
+    // barrier, so the collector can rebuild the remembered set as it goes.
+    template <typename Set> void field(ValuePtr val, Set&& set)
+    {
+        auto result = visit(val);
+        if (updatesFields_) {
+            set(result);
+        }
+    }
+
+private:
+    const bool updatesFields_;
+};
+
 
 template <typename T> class ValueTemplate : public Value {
 public:
     ValueTemplate();
 
+    // Values that reference other values define their own trace function.
+    static constexpr void (*trace)(Value*, Tracer&) = nullptr;
+
     static void finalize(Value* val)
     {
         reinterpret_cast<T*>(val)->~T();
@@ -89,6 +274,67 @@ public:
     }
 };
 
+template <typename T>
+constexpr void (*ValueTemplate<T>::trace)(Value*, Tracer&);
+
+
+// Dereferencing a pointer to an immediate yields a copy of the value, decoded
+// from the pointer. Characters within a string's storage are regular pointers
+// though, so those get copied out of memory instead.
+template <typename T> class ImmediateRef {
+public:
+    ImmediateRef(const T& value) : value_(value)
+    {
+    }
+
+    T* operator->()
+    {
+        return &value_;
+    }
+
+private:
+    T value_;
+};
+
+template <typename T> struct ImmediateTraits {
+    using Pointer = ImmediateRef<T>;
+    using Reference = T;
+
+    static Pointer get(uint8_t* handle)
+    {
+        return {deref(handle)};
+    }
+
+    static Reference deref(uint8_t* handle)
+    {
+        if (isImmediate(handle)) {
+            return T::decode((uintptr_t)handle);
+        }
+        return *reinterpret_cast<T*>(handle);
+    }
+
+    // Whether a value fits within a pointer, rather than needing to be
+    // allocated on the heap.
+    template <typename... Args> static bool fits(const Args&...)
+    {
+        return true;
+    }
+};
+
+template <typename T>
+struct IsImmediate
+    : std::integral_constant<bool, std::is_base_of<ImmediateTraits<T>,
+                                                   PtrTraits<T>>::value> {
+};
+
+template <typename T, typename... Args>
+Heap::Ptr<T> makeImmediate(Args&&... args)
+{
+    static_assert(IsImmediate<T>::value, "not an immediate type");
+    return Heap::GenericPtr::UNSAFE_make<T>(
+        (uint8_t*)T::encode(std::forward<Args>(args)...));
+}
+
 
 struct EqualTo {
     bool operator()(ValuePtr lhs, ValuePtr rhs) const;
@@ -121,6 +367,19 @@ public:
     }
 
     Heap::Ptr<Null> clone(Environment& env) const;
+
+    static uintptr_t encode()
+    {
+        return packImmediate(ImmediateTag::Null, 0);
+    }
+
+    static Null decode(uintptr_t)
+    {
+        return {};
+    }
+};
+
+template <> struct PtrTraits<Null> : ImmediateTraits<Null> {
 };
 
 
@@ -147,16 +406,27 @@ public:
 
     inline void setCar(ValuePtr value)
     {
+        deletionBarrier(car_);
         car_ = value;
+        writeBarrier(this, value);
     }
 
     inline void setCdr(ValuePtr value)
     {
+        deletionBarrier(cdr_);
         cdr_ = value;
+        writeBarrier(this, value);
     }
 
     Heap::Ptr<Pair> clone(Environment& env) const;
 
+    static void trace(Value* val, Tracer& tracer)
+    {
+        auto p = (Pair*)val;
+        tracer.field(p->car_, [p](ValuePtr v) { p->setCar(v); });
+        tracer.field(p->cdr_, [p](ValuePtr v) { p->setCdr(v); });
+    }
+
 private:
     ValuePtr car_;
     ValuePtr cdr_;
@@ -177,7 +447,9 @@ class alignas(8) Box : public ValueTemplate<Box> {
 
     void set(ValuePtr value)
     {
+        deletionBarrier(value_);
         value_ = value;
+        writeBarrier(this, value);
     }
 
     ValuePtr get() const
@@ -187,6 +459,12 @@ class alignas(8) Box : public ValueTemplate<Box> {
 
     Heap::Ptr<Box> clone(Environment& env) const;
 
+    static void trace(Value* val, Tracer& tracer)
+    {
+        auto b = (Box*)val;
+        tracer.field(b->value_, [b](ValuePtr v) { b->set(v); });
+    }
+
  private:
     ValuePtr value_;
 };
@@ -215,10 +493,23 @@ public:
 
     Heap::Ptr<Boolean> clone(Environment& env) const;
 
+    static uintptr_t encode(bool value)
+    {
+        return packImmediate(ImmediateTag::Boolean, value);
+    }
+
+    static Boolean decode(uintptr_t word)
+    {
+        return {immediatePayload(word) not_eq 0};
+    }
+
 private:
     bool value_;
 };
 
+template <> struct PtrTraits<Boolean> : ImmediateTraits<Boolean> {
+};
+
 
 class alignas(8) Integer : public ValueTemplate<Integer> {
 public:
@@ -241,10 +532,23 @@ public:
 
     Heap::Ptr<Integer> clone(Environment& env) const;
 
+    static uintptr_t encode(Rep value)
+    {
+        return packImmediate(ImmediateTag::Integer, value);
+    }
+
+    static Integer decode(uintptr_t word)
+    {
+        return {Rep(immediatePayload(word))};
+    }
+
 private:
     Rep value_;
 };
 
+template <> struct PtrTraits<Integer> : ImmediateTraits<Integer> {
+};
+
 
 class alignas(8) Float : public ValueTemplate<Float> {
 public:
@@ -267,10 +571,66 @@ public:
 
     Heap::Ptr<Float> clone(Environment& env) const;
 
+    // Doubles with an exponent bias in the middle of the range, which covers
+    // magnitudes from about 1e-77 to 1e77, are rotated so that the top three
+    // bits of the exponent end up where the tag goes. Two of those bits can
+    // be recovered from the third, and the sign bit stays put, so floats use
+    // the Float and NegativeFloat tags. Zero gets an encoding of its own, and
+    // anything else is allocated on the heap.
+    static bool fitsImmediate(Rep value)
+    {
+        const auto bits = toBits(value);
+        const auto exponent = (bits >> 60) & 7;
+        return bits == 0 or
+               ((exponent == 3 or exponent == 4) and bits not_eq aliasOfZero);
+    }
+
+    static uintptr_t encode(Rep value)
+    {
+        const auto bits = toBits(value);
+        if (bits == 0) {
+            return encodedZero;
+        }
+        const auto rotated = bits << 3 | bits >> 61;
+        return (rotated & ~(uintptr_t)3) | (uintptr_t)ImmediateTag::Float;
+    }
+
+    static Float decode(uintptr_t word)
+    {
+        if (word == encodedZero) {
+            return {0.0};
+        }
+        const uintptr_t exponent = 2 - (word >> 63);
+        const auto rotated = exponent | (word & ~(uintptr_t)3);
+        const uint64_t bits = rotated >> 3 | rotated << 61;
+        Rep value;
+        std::memcpy(&value, &bits, sizeof value);
+        return {value};
+    }
+
 private:
+    static constexpr uintptr_t encodedZero =
+        0x8000000000000000 | (uintptr_t)ImmediateTag::Float;
+    // The one double that would otherwise encode the same as zero.
+    static constexpr uint64_t aliasOfZero = 0x3000000000000000;
+
+    static uint64_t toBits(Rep value)
+    {
+        uint64_t bits;
+        std::memcpy(&bits, &value, sizeof bits);
+        return bits;
+    }
+
     Rep value_;
 };
 
+template <> struct PtrTraits<Float> : ImmediateTraits<Float> {
+    static bool fits(Float::Rep value)
+    {
+        return Float::fitsImmediate(value);
+    }
+};
+
 
 class alignas(8) Complex : public ValueTemplate<Complex> {
 public:
@@ -319,10 +679,28 @@ public:
 
     Heap::Ptr<Character> clone(Environment& env) const;
 
+    static uintptr_t encode(const Rep& value)
+    {
+        uint32_t payload;
+        std::memcpy(&payload, value.data(), sizeof payload);
+        return packImmediate(ImmediateTag::Character, payload);
+    }
+
+    static Character decode(uintptr_t word)
+    {
+        const uint32_t payload = immediatePayload(word);
+        Rep value;
+        std::memcpy(value.data(), &payload, sizeof payload);
+        return {value};
+    }
+
 private:
     Rep value_;
 };
 
+template <> struct PtrTraits<Character> : ImmediateTraits<Character> {
+};
+
 
 class alignas(8) String : public ValueTemplate<String> {
 public:
@@ -343,6 +721,8 @@ public:
     String(const char* data, size_t length, Encoding enc = Encoding::utf8);
     String(const Input& str, Encoding enc = Encoding::utf8);
 
+    // NOTE: the character lives within the string's own storage, which the
+    // collector doesn't know about. Clone it before letting it escape.
     Heap::Ptr<Character> operator[](size_t index) const;
 
     size_t length() const;
@@ -380,18 +760,25 @@ public:
 
     inline void set(Heap::Ptr<String> val)
     {
+        deletionBarrier(str_);
         str_ = val;
+        writeBarrier(this, val);
     }
 
     Heap::Ptr<Symbol> clone(Environment& env) const;
 
+    static void trace(Value* val, Tracer& tracer)
+    {
+        auto s = (Symbol*)val;
+        tracer.field(s->str_,
+                     [s](ValuePtr v) { s->set(v.cast<String>()); });
+    }
+
 private:
     Heap::Ptr<String> str_;
 };
 
 
-// FIXME! Object contains gc roots and needs to have its internal
-// state tracked by the GC!
 class alignas(8) Object : public ValueTemplate<Object> {
 public:
     static constexpr const char* name()
@@ -407,6 +794,17 @@ public:
                  Heap::Ptr<Symbol> name,
                  Heap::Ptr<Value> value);
 
+    static void trace(Value* val, Tracer& tracer)
+    {
+        auto o = (Object*)val;
+        for (auto& member : o->members_) {
+            tracer.field(member.second, [o, &member](ValuePtr v) {
+                member.second = v;
+                writeBarrier(o, v);
+            });
+        }
+    }
+
 private:
     std::map<std::string, Heap::Ptr<Value>> members_;
 };
@@ -474,6 +872,7 @@ struct InvalidArgumentError : std::runtime_error {
 };
 
 class Function;
+struct JitEntry;
 
 void failedToApply(Environment& env,
                    Function* function,
@@ -524,7 +923,9 @@ public:
 
     inline void setDocstring(ValuePtr val)
     {
+        deletionBarrier(docstring_);
         docstring_ = val;
+        writeBarrier(this, val);
     }
 
     inline size_t argCount()
@@ -532,13 +933,31 @@ public:
         return requiredArgs_;
     }
 
-    inline EnvPtr definitionEnvironment()
+    inline const EnvPtr& definitionEnvironment() const
     {
         return envPtr_;
     }
 
+    // Functions sharing a body share an entry, which counts their calls.
+    inline JitEntry* jitEntry() const
+    {
+        return jitEntry_;
+    }
+
+    inline void setJitEntry(JitEntry* entry)
+    {
+        jitEntry_ = entry;
+    }
+
     Heap::Ptr<Function> clone(Environment& env) const;
 
+    static void trace(Value* val, Tracer& tracer)
+    {
+        auto f = (Function*)val;
+        tracer.field(f->docstring_, [f](ValuePtr v) { f->setDocstring(v); });
+        tracer.visitFrame(*f->envPtr_);
+    }
+
     enum InvocationModel { Wrapped, Bytecode, BytecodeVariadic };
 
     InvocationModel getInvocationModel() const
@@ -553,6 +972,7 @@ private:
     CFunction nativeFn_;
     size_t bytecodeAddress_;
     EnvPtr envPtr_;
+    JitEntry* jitEntry_ = nullptr;
 };
 
 
@@ -561,6 +981,8 @@ struct TypeInfo {
     const char* name_;
     void (*finalizer)(Value*);
     void (*relocatePolicy)(Value*, uint8_t*);
+    // Null for values that don't reference other values.
+    void (*trace)(Value*, Tracer&);
     ValuePtr (*clonePolicy)(Environment&, ValuePtr);
 };
 
@@ -568,7 +990,7 @@ struct TypeInfo {
 template <typename T> constexpr TypeInfo makeInfo()
 {
     return TypeInfo{sizeof(T), T::name(), T::finalize, T::relocate,
-                    T::cloneInterface};
+                    T::trace, T::cloneInterface};
 }
 
 
@@ -4,6 +4,7 @@
 #include <bitset>
 #include <memory>
 #include <stddef.h>
+#include <stdexcept>
 #include <type_traits>
 
 namespace ebl {
@@ -25,6 +26,18 @@ std::unique_ptr<T> make_unique(Args&&... args)
     return std::unique_ptr<T>(new T(std::forward<Args>(args)...));
 }
 
+// C++11 lacks std::index_sequence, which is handy for unpacking tuples.
+template <size_t... Indices> struct IndexSequence {
+};
+
+template <size_t N, size_t... Indices>
+struct MakeIndexSequence : MakeIndexSequence<N - 1, N - 1, Indices...> {
+};
+
+template <size_t... Indices> struct MakeIndexSequence<0, Indices...> {
+    using type = IndexSequence<Indices...>;
+};
+
 template <typename F> struct OnUnwind {
     OnUnwind(F&& proc) : proc_(std::forward<F>(proc))
     {
@@ -2,6 +2,7 @@
 #include "bytecode.hpp"
 #include "ebl.hpp"
 #include "listBuilder.hpp"
+#include "operations.hpp"
 #include "persistent.hpp"
 
 
@@ -30,35 +31,35 @@ template <> uint16_t readParam(const Bytecode& bc, size_t& ip)
 #define NO_DIRECT_THREADING
 #endif
 
-void failedToApply(Environment& env,
-                   Function* function,
-                   size_t suppliedArgs,
-                   size_t expectedArgs);
-
 InstructionAddress VM::execute(Environment& environment,
                                const Bytecode& bc,
                                InstructionAddress start)
 {
-    auto env = environment.reference();
+    Environment* const env = &environment;
     Context* const context = env->getContext();
     auto& operandStack = context->operandStack();
     auto& callStack = context->callStack();
     size_t ip = start;
+    // The current frame, see StackFrame.
+    size_t base = callStack.back().base_;
+    Environment* parent = callStack.back().env_;
 #ifndef NO_DIRECT_THREADING
     static const std::array<void*, (uint8_t)Opcode::Count> labels = {
         &&Exit,
         &&Call,
         &&Return,
         &&Recur,
+        &&TailCall,
         &&Jump,
         &&JumpIfFalse,
         &&Load,
         &&Load0,
         &&Load1,
-        &&Load2,
         &&Load0Fast,
         &&Load1Fast,
-        &&Store,
+        &&LoadGlobal,
+        &&StoreGlobal,
+        &&Reserve,
         &&Rebind,
         &&PushI,
         &&PushNull,
@@ -68,13 +69,61 @@ InstructionAddress VM::execute(Environment& environment,
         &&PushDocumentedLambda,
         &&PushVariadicLambda,
         &&Discard,
+        &&Dup,
         &&EnterLet,
         &&ExitLet,
+        &&Box,
+        &&Unbox,
+        &&SetBox,
         &&Cons,
         &&Car,
         &&Cdr,
-        &&IsNull};
-#define VM_DISPATCH_BEGIN() goto* labels[bc[ip]];
+        &&IsNull,
+        &&Add,
+        &&Sub,
+        &&Lt,
+        &&Gt,
+        &&Incr,
+        &&Decr,
+        &&Eq,
+        &&Not,
+        &&Mod,
+        &&Load0Fast2,
+        &&Load0Car,
+        &&Load0Cdr,
+        &&Load0PushI,
+        &&JumpIfNotNull,
+        &&JumpIfNotLt,
+        &&JumpIfNotGt,
+        &&AddRR,
+        &&AddRK,
+        &&SubRR,
+        &&SubRK,
+        &&LtRR,
+        &&LtRK,
+        &&GtRR,
+        &&GtRK,
+        &&IncrR,
+        &&DecrR,
+        &&JumpIfNotLtRR,
+        &&JumpIfNotLtRK,
+        &&JumpIfNotGtRR,
+        &&JumpIfNotGtRK};
+    // While profiling, every instruction dispatches through Profile first,
+    // which then goes on to the instruction's label. The sampler's signal
+    // handler sends only the next instruction through Profile, by setting
+    // sampleRequested.
+    static const auto profiledLabels = [](void* profile) {
+        std::array<void*, (uint8_t)Opcode::Count> table;
+        table.fill(profile);
+        return table;
+    }(&&Profile);
+    using Table = decltype(labels);
+    static Table* const unprofiled[] = {&labels, &profiledLabels};
+    static Table* const profiled[] = {&profiledLabels, &profiledLabels};
+    Table* const* dispatch = context->profiler() ? profiled : unprofiled;
+    auto& sampleRequested = context->sampleRequested();
+#define VM_DISPATCH_BEGIN() goto*(*dispatch[sampleRequested])[bc[ip]];
 #define VM_DISPATCH_END() ;
 #define VM_BLOCK_BEGIN(IDENTIFIER)                                             \
     IDENTIFIER:
@@ -140,54 +189,174 @@ InstructionAddress VM::execute(Environment& environment,
     VM_BLOCK_END();
 
 
+    VM_BLOCK_BEGIN(Add)
+    {
+        ++ip;
+        const auto lhs = operandStack.end()[-2];
+        const auto rhs = operandStack.end()[-1];
+        operandStack.pop_back();
+        operandStack.pop_back();
+        operandStack.push_back(add(*env, lhs, rhs));
+    }
+    VM_BLOCK_END();
+
+
+    VM_BLOCK_BEGIN(Sub)
+    {
+        ++ip;
+        const auto lhs = operandStack.end()[-2];
+        const auto rhs = operandStack.end()[-1];
+        operandStack.pop_back();
+        operandStack.pop_back();
+        operandStack.push_back(subtract(*env, lhs, rhs));
+    }
+    VM_BLOCK_END();
+
+
+    VM_BLOCK_BEGIN(Lt)
+    {
+        ++ip;
+        const auto lhs = operandStack.end()[-2];
+        const auto rhs = operandStack.end()[-1];
+        operandStack.pop_back();
+        operandStack.pop_back();
+        const bool result = compare<Less>(*env, lhs, rhs);
+        operandStack.push_back(env->getBool(result));
+    }
+    VM_BLOCK_END();
+
+
+    VM_BLOCK_BEGIN(Gt)
+    {
+        ++ip;
+        const auto lhs = operandStack.end()[-2];
+        const auto rhs = operandStack.end()[-1];
+        operandStack.pop_back();
+        operandStack.pop_back();
+        const bool result = compare<Greater>(*env, lhs, rhs);
+        operandStack.push_back(env->getBool(result));
+    }
+    VM_BLOCK_END();
+
+
+    VM_BLOCK_BEGIN(Incr)
+    {
+        ++ip;
+        const auto val = operandStack.back();
+        operandStack.pop_back();
+        operandStack.push_back(increment(*env, val));
+    }
+    VM_BLOCK_END();
+
+
+    VM_BLOCK_BEGIN(Decr)
+    {
+        ++ip;
+        const auto val = operandStack.back();
+        operandStack.pop_back();
+        operandStack.push_back(decrement(*env, val));
+    }
+    VM_BLOCK_END();
+
+
+    VM_BLOCK_BEGIN(Eq)
+    {
+        ++ip;
+        const auto lhs = operandStack.end()[-2];
+        const auto rhs = operandStack.end()[-1];
+        operandStack.pop_back();
+        operandStack.pop_back();
+        operandStack.push_back(equal(*env, lhs, rhs));
+    }
+    VM_BLOCK_END();
+
+
+    VM_BLOCK_BEGIN(Not)
+    {
+        ++ip;
+        operandStack.back() =
+            env->getBool(operandStack.back() == env->getBool(false));
+    }
+    VM_BLOCK_END();
+
+
+    VM_BLOCK_BEGIN(Mod)
+    {
+        ++ip;
+        const auto lhs = operandStack.end()[-2];
+        const auto rhs = operandStack.end()[-1];
+        operandStack.pop_back();
+        operandStack.pop_back();
+        operandStack.push_back(modulo(*env, lhs, rhs));
+    }
+    VM_BLOCK_END();
+
+
     VM_BLOCK_BEGIN(Call)
     {
         ++ip;
         auto argc = readParam<uint8_t>(bc, ip);
-        auto target = operandStack.back();
-        auto fn = checkedCast<Function>(target);
+        auto fn = checkedCast<Function>(operandStack.back());
         switch (fn->getInvocationModel()) {
+        case Function::InvocationModel::Wrapped:
+            callWrapped(*env, fn, argc);
+            break;
+
+        case Function::InvocationModel::BytecodeVariadic:
+            fn = gatherRestArgs(*env, fn, argc);
+            argc = fn->argCount();
+        // fallthrough
         case Function::InvocationModel::Bytecode: {
             const auto addr = fn->getBytecodeAddress();
             if (UNLIKELY(argc not_eq fn->argCount())) {
                 failedToApply(*env, fn.get(), argc, fn->argCount());
             }
-            operandStack.pop_back();
-            env = fn->definitionEnvironment()->derive();
-            callStack.push_back({ip, addr, env});
-            ip = addr;
-        } break;
-
-        case Function::InvocationModel::Wrapped: {
-            auto result = env->getNull();
-            {
-                Arguments args(*env, argc);
-                operandStack.pop_back();
-                result = fn->directCall(args);
+            base = operandStack.size() - (argc + 1);
+            parent = fn->definitionEnvironment().get();
+            callStack.push_back({ip, addr, parent, base});
+            // Compiled code returns with the frame popped, unless it made a
+            // tail call to a function that's left to the interpreter.
+            Jit* const jit = context->jit();
+            const auto code = jit ? jit->hot(*fn) : nullptr;
+            if (not code or not jit->enter(code, base, parent)) {
+                ip = callStack.back().functionTop_;
             }
-            operandStack.push_back(result);
+            base = callStack.back().base_;
+            parent = callStack.back().env_;
         } break;
+        }
+    }
+    VM_BLOCK_END();
 
-        case Function::InvocationModel::BytecodeVariadic: {
-            const auto addr = fn->getBytecodeAddress();
-            Persistent<Function> toCall(*env, fn);
-            operandStack.pop_back();
-            if (UNLIKELY(argc < fn->argCount() - 1)) {
+
+    VM_BLOCK_BEGIN(TailCall)
+    {
+        ++ip;
+        // The callee takes over the current frame, like with Recur. Builtins
+        // are called as usual, and the Return after the call returns their
+        // result.
+        const auto argc = readParam<uint8_t>(bc, ip);
+        auto fn = checkedCast<Function>(operandStack.back());
+        const auto model = fn->getInvocationModel();
+        if (model == Function::InvocationModel::Wrapped) {
+            callWrapped(*env, fn, argc);
+        } else {
+            if (model == Function::InvocationModel::BytecodeVariadic) {
+                fn = gatherRestArgs(*env, fn, argc);
+            } else if (UNLIKELY(argc not_eq fn->argCount())) {
                 failedToApply(*env, fn.get(), argc, fn->argCount());
-                throw std::runtime_error("insufficient arguments to VA fn");
             }
-            {
-                LazyListBuilder builder(*env);
-                for (size_t i = 0; i < argc - (fn->argCount() - 1); ++i) {
-                    builder.pushFront(operandStack.back());
-                    operandStack.pop_back();
-                }
-                operandStack.push_back(builder.result());
+            replaceFrame(*context, *fn, base);
+            const auto retAddr = callStack.back().returnAddress_;
+            Jit* const jit = context->jit();
+            const auto code = jit ? jit->hot(*fn) : nullptr;
+            if (code and jit->enter(code, base, callStack.back().env_)) {
+                ip = retAddr;
+            } else {
+                ip = callStack.back().functionTop_;
             }
-            env = toCall->definitionEnvironment()->derive();
-            callStack.push_back({ip, addr, env});
-            ip = addr;
-        } break;
+            base = callStack.back().base_;
+            parent = callStack.back().env_;
         }
     }
     VM_BLOCK_END();
@@ -196,7 +365,13 @@ InstructionAddress VM::execute(Environment& environment,
     VM_BLOCK_BEGIN(Recur)
     {
         ++ip;
-        env->getVars().clear();
+        // Moves the new arguments over the old ones, and drops everything
+        // above the function.
+        const auto argc = readParam<uint8_t>(bc, ip);
+        std::copy(operandStack.end() - argc, operandStack.end(),
+                  operandStack.begin() + base);
+        operandStack.erase(operandStack.begin() + base + argc + 1,
+                           operandStack.end());
         ip = callStack.back().functionTop_;
     }
     VM_BLOCK_END();
@@ -205,8 +380,12 @@ InstructionAddress VM::execute(Environment& environment,
     VM_BLOCK_BEGIN(Return)
     {
         auto retAddr = callStack.back().returnAddress_;
+        auto result = operandStack.back();
+        operandStack.erase(operandStack.begin() + base, operandStack.end());
+        operandStack.push_back(result);
         callStack.pop_back();
-        env = callStack.back().env_;
+        base = callStack.back().base_;
+        parent = callStack.back().env_;
         ip = retAddr;
     }
     VM_BLOCK_END();
@@ -215,8 +394,8 @@ InstructionAddress VM::execute(Environment& environment,
     VM_BLOCK_BEGIN(EnterLet)
     {
         ++ip;
-        env = env->derive();
-        callStack.push_back({0, 0, env});
+        base = operandStack.size();
+        callStack.push_back({0, 0, parent, base});
     }
     VM_BLOCK_END();
 
@@ -224,8 +403,12 @@ InstructionAddress VM::execute(Environment& environment,
     VM_BLOCK_BEGIN(ExitLet)
     {
         ++ip;
+        auto result = operandStack.back();
+        operandStack.erase(operandStack.begin() + base, operandStack.end());
+        operandStack.push_back(result);
         callStack.pop_back();
-        env = env->parent();
+        base = callStack.back().base_;
+        parent = callStack.back().env_;
     }
     VM_BLOCK_END();
 
@@ -251,11 +434,249 @@ InstructionAddress VM::execute(Environment& environment,
     VM_BLOCK_END();
 
 
+    VM_BLOCK_BEGIN(JumpIfNotNull)
+    {
+        ++ip;
+        const auto jumpOffset = readParam<uint16_t>(bc, ip);
+        if (not isType<Null>(operandStack.back())) {
+            ip += jumpOffset;
+        }
+        operandStack.pop_back();
+    }
+    VM_BLOCK_END();
+
+
+    VM_BLOCK_BEGIN(JumpIfNotLt)
+    {
+        ++ip;
+        const auto jumpOffset = readParam<uint16_t>(bc, ip);
+        const auto lhs = operandStack.end()[-2];
+        const auto rhs = operandStack.end()[-1];
+        operandStack.pop_back();
+        operandStack.pop_back();
+        if (not compare<Less>(*env, lhs, rhs)) {
+            ip += jumpOffset;
+        }
+    }
+    VM_BLOCK_END();
+
+
+    VM_BLOCK_BEGIN(JumpIfNotGt)
+    {
+        ++ip;
+        const auto jumpOffset = readParam<uint16_t>(bc, ip);
+        const auto lhs = operandStack.end()[-2];
+        const auto rhs = operandStack.end()[-1];
+        operandStack.pop_back();
+        operandStack.pop_back();
+        if (not compare<Greater>(*env, lhs, rhs)) {
+            ip += jumpOffset;
+        }
+    }
+    VM_BLOCK_END();
+
+
+    VM_BLOCK_BEGIN(AddRR)
+    {
+        ++ip;
+        const auto lhs = operandStack[base + readParam<uint8_t>(bc, ip)];
+        const auto rhs = operandStack[base + readParam<uint8_t>(bc, ip)];
+        operandStack.push_back(add(*env, lhs, rhs));
+    }
+    VM_BLOCK_END();
+
+
+    VM_BLOCK_BEGIN(AddRK)
+    {
+        ++ip;
+        const auto lhs = operandStack[base + readParam<uint8_t>(bc, ip)];
+        const auto rhs = context->immediates()[readParam<ImmediateId>(bc, ip)];
+        operandStack.push_back(add(*env, lhs, rhs));
+    }
+    VM_BLOCK_END();
+
+
+    VM_BLOCK_BEGIN(SubRR)
+    {
+        ++ip;
+        const auto lhs = operandStack[base + readParam<uint8_t>(bc, ip)];
+        const auto rhs = operandStack[base + readParam<uint8_t>(bc, ip)];
+        operandStack.push_back(subtract(*env, lhs, rhs));
+    }
+    VM_BLOCK_END();
+
+
+    VM_BLOCK_BEGIN(SubRK)
+    {
+        ++ip;
+        const auto lhs = operandStack[base + readParam<uint8_t>(bc, ip)];
+        const auto rhs = context->immediates()[readParam<ImmediateId>(bc, ip)];
+        operandStack.push_back(subtract(*env, lhs, rhs));
+    }
+    VM_BLOCK_END();
+
+
+    VM_BLOCK_BEGIN(LtRR)
+    {
+        ++ip;
+        const auto lhs = operandStack[base + readParam<uint8_t>(bc, ip)];
+        const auto rhs = operandStack[base + readParam<uint8_t>(bc, ip)];
+        const bool result = compare<Less>(*env, lhs, rhs);
+        operandStack.push_back(env->getBool(result));
+    }
+    VM_BLOCK_END();
+
+
+    VM_BLOCK_BEGIN(LtRK)
+    {
+        ++ip;
+        const auto lhs = operandStack[base + readParam<uint8_t>(bc, ip)];
+        const auto rhs = context->immediates()[readParam<ImmediateId>(bc, ip)];
+        const bool result = compare<Less>(*env, lhs, rhs);
+        operandStack.push_back(env->getBool(result));
+    }
+    VM_BLOCK_END();
+
+
+    VM_BLOCK_BEGIN(GtRR)
+    {
+        ++ip;
+        const auto lhs = operandStack[base + readParam<uint8_t>(bc, ip)];
+        const auto rhs = operandStack[base + readParam<uint8_t>(bc, ip)];
+        const bool result = compare<Greater>(*env, lhs, rhs);
+        operandStack.push_back(env->getBool(result));
+    }
+    VM_BLOCK_END();
+
+
+    VM_BLOCK_BEGIN(GtRK)
+    {
+        ++ip;
+        const auto lhs = operandStack[base + readParam<uint8_t>(bc, ip)];
+        const auto rhs = context->immediates()[readParam<ImmediateId>(bc, ip)];
+        const bool result = compare<Greater>(*env, lhs, rhs);
+        operandStack.push_back(env->getBool(result));
+    }
+    VM_BLOCK_END();
+
+
+    VM_BLOCK_BEGIN(IncrR)
+    {
+        ++ip;
+        const auto val = operandStack[base + readParam<uint8_t>(bc, ip)];
+        operandStack.push_back(increment(*env, val));
+    }
+    VM_BLOCK_END();
+
+
+    VM_BLOCK_BEGIN(DecrR)
+    {
+        ++ip;
+        const auto val = operandStack[base + readParam<uint8_t>(bc, ip)];
+        operandStack.push_back(decrement(*env, val));
+    }
+    VM_BLOCK_END();
+
+
+    VM_BLOCK_BEGIN(JumpIfNotLtRR)
+    {
+        ++ip;
+        const auto lhs = operandStack[base + readParam<uint8_t>(bc, ip)];
+        const auto rhs = operandStack[base + readParam<uint8_t>(bc, ip)];
+        const auto jumpOffset = readParam<uint16_t>(bc, ip);
+        if (not compare<Less>(*env, lhs, rhs)) {
+            ip += jumpOffset;
+        }
+    }
+    VM_BLOCK_END();
+
+
+    VM_BLOCK_BEGIN(JumpIfNotLtRK)
+    {
+        ++ip;
+        const auto lhs = operandStack[base + readParam<uint8_t>(bc, ip)];
+        const auto rhs = context->immediates()[readParam<ImmediateId>(bc, ip)];
+        const auto jumpOffset = readParam<uint16_t>(bc, ip);
+        if (not compare<Less>(*env, lhs, rhs)) {
+            ip += jumpOffset;
+        }
+    }
+    VM_BLOCK_END();
+
+
+    VM_BLOCK_BEGIN(JumpIfNotGtRR)
+    {
+        ++ip;
+        const auto lhs = operandStack[base + readParam<uint8_t>(bc, ip)];
+        const auto rhs = operandStack[base + readParam<uint8_t>(bc, ip)];
+        const auto jumpOffset = readParam<uint16_t>(bc, ip);
+        if (not compare<Greater>(*env, lhs, rhs)) {
+            ip += jumpOffset;
+        }
+    }
+    VM_BLOCK_END();
+
+
+    VM_BLOCK_BEGIN(JumpIfNotGtRK)
+    {
+        ++ip;
+        const auto lhs = operandStack[base + readParam<uint8_t>(bc, ip)];
+        const auto rhs = context->immediates()[readParam<ImmediateId>(bc, ip)];
+        const auto jumpOffset = readParam<uint16_t>(bc, ip);
+        if (not compare<Greater>(*env, lhs, rhs)) {
+            ip += jumpOffset;
+        }
+    }
+    VM_BLOCK_END();
+
+
+    VM_BLOCK_BEGIN(Load0Fast2)
+    {
+        ++ip;
+        const auto first = readParam<uint8_t>(bc, ip);
+        const auto second = readParam<uint8_t>(bc, ip);
+        operandStack.push_back(operandStack[base + first]);
+        operandStack.push_back(operandStack[base + second]);
+    }
+    VM_BLOCK_END();
+
+
+    VM_BLOCK_BEGIN(Load0Car)
+    {
+        ++ip;
+        const auto offset = readParam<uint8_t>(bc, ip);
+        const auto& value = operandStack[base + offset];
+        operandStack.push_back(checkedCast<Pair>(value)->getCar());
+    }
+    VM_BLOCK_END();
+
+
+    VM_BLOCK_BEGIN(Load0Cdr)
+    {
+        ++ip;
+        const auto offset = readParam<uint8_t>(bc, ip);
+        const auto& value = operandStack[base + offset];
+        operandStack.push_back(checkedCast<Pair>(value)->getCdr());
+    }
+    VM_BLOCK_END();
+
+
+    VM_BLOCK_BEGIN(Load0PushI)
+    {
+        ++ip;
+        const auto offset = readParam<uint8_t>(bc, ip);
+        const auto param = readParam<ImmediateId>(bc, ip);
+        operandStack.push_back(operandStack[base + offset]);
+        operandStack.push_back(context->immediates()[param]);
+    }
+    VM_BLOCK_END();
+
+
     VM_BLOCK_BEGIN(Load0Fast)
     {
         ++ip;
         const auto offset = readParam<uint8_t>(bc, ip);
-        operandStack.push_back(env->getVars()[offset]);
+        operandStack.push_back(operandStack[base + offset]);
     }
     VM_BLOCK_END();
 
@@ -264,7 +685,7 @@ InstructionAddress VM::execute(Environment& environment,
     {
         ++ip;
         const auto offset = readParam<uint8_t>(bc, ip);
-        operandStack.push_back(env->parent()->getVars()[offset]);
+        operandStack.push_back(parent->getVars()[offset]);
     }
     VM_BLOCK_END();
 
@@ -273,16 +694,16 @@ InstructionAddress VM::execute(Environment& environment,
     {
         ++ip;
         const auto offset = readParam<StackLoc>(bc, ip);
-        operandStack.push_back(env->parent()->getVars()[offset]);
+        operandStack.push_back(parent->getVars()[offset]);
     }
     VM_BLOCK_END();
 
 
-    VM_BLOCK_BEGIN(Load2)
+    VM_BLOCK_BEGIN(LoadGlobal)
     {
         ++ip;
-        const auto offset = readParam<StackLoc>(bc, ip);
-        operandStack.push_back(env->parent()->parent()->getVars()[offset]);
+        const auto slot = readParam<StackLoc>(bc, ip);
+        operandStack.push_back(context->topLevel().getVars()[slot]);
     }
     VM_BLOCK_END();
 
@@ -296,10 +717,11 @@ InstructionAddress VM::execute(Environment& environment,
     VM_BLOCK_END();
 
 
-    VM_BLOCK_BEGIN(Store)
+    VM_BLOCK_BEGIN(StoreGlobal)
     {
         ++ip;
-        env->push(operandStack.back());
+        const auto slot = readParam<StackLoc>(bc, ip);
+        context->topLevel().storeGlobal(slot, operandStack.back());
         operandStack.pop_back();
     }
     VM_BLOCK_END();
@@ -313,6 +735,14 @@ InstructionAddress VM::execute(Environment& environment,
     VM_BLOCK_END();
 
 
+    VM_BLOCK_BEGIN(Dup)
+    {
+        ++ip;
+        operandStack.push_back(operandStack.back());
+    }
+    VM_BLOCK_END();
+
+
     VM_BLOCK_BEGIN(PushNull)
     {
         ++ip;
@@ -341,8 +771,10 @@ InstructionAddress VM::execute(Environment& environment,
     {
         ++ip;
         auto argc = readParam<uint8_t>(bc, ip);
+        auto captures = readParam<uint8_t>(bc, ip);
         const size_t addr = ip + sizeof(Opcode::Jump) + sizeof(uint16_t);
-        auto lambda = env->create<Function>(env->getNull(), (size_t)argc, addr);
+        auto lambda = makeClosure(*context, captures, env->getNull(),
+                                  (size_t)argc, addr);
         operandStack.push_back(lambda);
     }
     VM_BLOCK_END();
@@ -352,9 +784,10 @@ InstructionAddress VM::execute(Environment& environment,
     {
         ++ip;
         auto argc = readParam<uint8_t>(bc, ip);
+        auto captures = readParam<uint8_t>(bc, ip);
         const size_t addr = ip + sizeof(Opcode::Jump) + sizeof(uint16_t);
-        auto lambda =
-            env->create<Function>(env->getNull(), (size_t)argc, addr, true);
+        auto lambda = makeClosure(*context, captures, env->getNull(),
+                                  (size_t)argc, addr, true);
         operandStack.push_back(lambda);
     }
     VM_BLOCK_END();
@@ -364,20 +797,59 @@ InstructionAddress VM::execute(Environment& environment,
     {
         ++ip;
         auto argc = readParam<uint8_t>(bc, ip);
+        auto captures = readParam<uint8_t>(bc, ip);
         auto docLoc = readParam<uint16_t>(bc, ip);
         const size_t addr = ip + sizeof(Opcode::Jump) + sizeof(uint16_t);
-        auto lambda = env->create<Function>(context->immediates()[docLoc],
-                                            (size_t)argc, addr);
+        auto lambda = makeClosure(*context, captures,
+                                  context->immediates()[docLoc], (size_t)argc,
+                                  addr);
         operandStack.push_back(lambda);
     }
     VM_BLOCK_END();
 
 
+    VM_BLOCK_BEGIN(Box)
+    {
+        ++ip;
+        auto box = env->create<ebl::Box>(operandStack.back());
+        operandStack.back() = box;
+    }
+    VM_BLOCK_END();
+
+
+    VM_BLOCK_BEGIN(Unbox)
+    {
+        ++ip;
+        operandStack.back() = operandStack.back().cast<ebl::Box>()->get();
+    }
+    VM_BLOCK_END();
+
+
+    VM_BLOCK_BEGIN(SetBox)
+    {
+        ++ip;
+        auto box = operandStack.back().cast<ebl::Box>();
+        operandStack.pop_back();
+        box->set(operandStack.back());
+        operandStack.pop_back();
+    }
+    VM_BLOCK_END();
+
+
+    VM_BLOCK_BEGIN(Reserve)
+    {
+        ++ip;
+        const auto count = readParam<StackLoc>(bc, ip);
+        operandStack.insert(operandStack.end(), count, env->getNull());
+    }
+    VM_BLOCK_END();
+
+
     VM_BLOCK_BEGIN(Load0)
     {
         ++ip;
         const auto offset = readParam<StackLoc>(bc, ip);
-        operandStack.push_back(env->getVars()[offset]);
+        operandStack.push_back(operandStack[base + offset]);
     }
     VM_BLOCK_END();
 
@@ -388,7 +860,12 @@ InstructionAddress VM::execute(Environment& environment,
         VarLoc param;
         param.frameDist_ = readParam<FrameDist>(bc, ip);
         param.offset_ = readParam<StackLoc>(bc, ip);
-        operandStack.push_back(env->load(param));
+        if (param.frameDist_ == 0) {
+            operandStack.push_back(operandStack[base + param.offset_]);
+        } else {
+            param.frameDist_ -= 1;
+            operandStack.push_back(parent->load(param));
+        }
     }
     VM_BLOCK_END();
 
@@ -401,7 +878,14 @@ InstructionAddress VM::execute(Environment& environment,
         param.offset_ = readParam<StackLoc>(bc, ip);
         auto value = operandStack.back();
         operandStack.pop_back();
-        env->store(param, value);
+        // NOTE: the operand stack is a root, so storing to a local doesn't
+        // need the write barrier.
+        if (param.frameDist_ == 0) {
+            operandStack[base + param.offset_] = value;
+        } else {
+            param.frameDist_ -= 1;
+            parent->store(param, value);
+        }
     }
     VM_BLOCK_END();
 
@@ -413,6 +897,18 @@ InstructionAddress VM::execute(Environment& environment,
     VM_BLOCK_END();
 
 
+#ifndef NO_DIRECT_THREADING
+Profile:
+    if (sampleRequested and context->sampler()) {
+        context->sampler()->sample();
+    }
+    if (context->profiler()) {
+        context->profiler()->step(ip);
+    }
+    goto* labels[bc[ip]];
+#endif
+
+
     VM_DISPATCH_END();
 }
 
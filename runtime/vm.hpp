@@ -9,10 +9,15 @@ class Environment;
 using EnvPtr = std::shared_ptr<Environment>;
 using InstructionAddress = size_t;
 
+// A frame's local variables live on the operand stack, starting at base_.
+// For function calls, the arguments come first, followed by the function
+// itself, which keeps the parent environment alive. The parent is the
+// function's closure, or the top level.
 struct StackFrame {
     InstructionAddress returnAddress_;
     InstructionAddress functionTop_;
-    EnvPtr env_;
+    Environment* env_;
+    size_t base_;
 };
 
 class VM {
@@ -0,0 +1,100 @@
+#include <atomic>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+#include "runtime/pool.hpp"
+
+// Exercises the pool from several threads at once. Values move between
+// threads, so most of them are freed remotely, and threads exit while other
+// threads still hold their values, so later threads adopt the blocks.
+// Holders remember each value's id, which catches nodes handed out twice.
+
+namespace {
+
+struct Frame {
+    long id_;
+    char padding_[88];
+};
+
+struct Held {
+    std::shared_ptr<Frame> frame_;
+    long id_;
+};
+
+std::mutex sharedLock;
+std::vector<Held> shared;
+std::atomic<bool> failed{false};
+
+void check(const Held& held)
+{
+    if (held.frame_->id_ not_eq held.id_) {
+        failed = true;
+    }
+}
+
+void work(unsigned seed)
+{
+    std::mt19937 rng(seed);
+    std::vector<Held> mine;
+    for (long i = 0; i < 50000; ++i) {
+        const long id = long(seed) << 32 | i;
+        auto frame =
+            std::allocate_shared<Frame>(ebl::PoolAllocator<Frame>{});
+        frame->id_ = id;
+        mine.push_back({std::move(frame), id});
+        if (rng() % 3 == 0) {
+            std::lock_guard<std::mutex> guard(sharedLock);
+            shared.push_back(std::move(mine.back()));
+            mine.pop_back();
+        }
+        if (rng() % 4 == 0 and not mine.empty()) {
+            auto& victim = mine[rng() % mine.size()];
+            check(victim);
+            victim = std::move(mine.back());
+            mine.pop_back();
+        }
+        if (rng() % 3 == 0) {
+            std::lock_guard<std::mutex> guard(sharedLock);
+            if (not shared.empty()) {
+                auto& victim = shared[rng() % shared.size()];
+                check(victim);
+                victim = std::move(shared.back());
+                shared.pop_back();
+            }
+        }
+    }
+    for (auto& held : mine) {
+        check(held);
+    }
+}
+
+} // namespace
+
+int main()
+{
+    for (unsigned round = 0; round < 6; ++round) {
+        std::vector<std::thread> threads;
+        for (unsigned i = 0; i < 8; ++i) {
+            threads.emplace_back(work, round * 8 + i + 1);
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        // Every other round, the survivors die on the main thread, which
+        // empties their blocks.
+        if (round % 2) {
+            for (auto& held : shared) {
+                check(held);
+            }
+            shared.clear();
+        }
+    }
+    if (failed) {
+        std::cout << "pool handed out a value twice" << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,33 @@
+#include <iostream>
+#include "runtime/types.hpp"
+
+// Comparing a String with a std::string. No builtin reaches this, so the ebl
+// test suites can't cover it. Neither side may be a prefix of the other.
+
+int main()
+{
+    using ebl::String;
+    struct Case {
+        const char* lhs_;
+        const char* rhs_;
+        bool equal_;
+    };
+    const Case cases[] = {{"abc", "abc", true},
+                          {"", "", true},
+                          {"λx", "λx", true},
+                          {"abc", "ab", false},
+                          {"ab", "abc", false},
+                          {"", "a", false},
+                          {"a", "", false},
+                          {"λx", "λy", false}};
+    bool failed = false;
+    for (auto& c : cases) {
+        if ((String(c.lhs_) == std::string(c.rhs_)) not_eq c.equal_) {
+            std::cout << '"' << c.lhs_ << "\" == \"" << c.rhs_
+                      << "\" should be " << (c.equal_ ? "true" : "false")
+                      << std::endl;
+            failed = true;
+        }
+    }
+    return failed ? 1 : 0;
+}
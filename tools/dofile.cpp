@@ -7,12 +7,58 @@
 
 int main(int argc, char** argv)
 {
-    if (argc != 2) {
-        std::cout << "usage: dofile <fname>" << std::endl;
+    auto config = ebl::Context::defaultConfig();
+    const char* fname = nullptr;
+    const char* profile = nullptr;
+    const char* sample = nullptr;
+    size_t sampleInterval = 1000;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--heap-size" and i + 1 < argc) {
+            config.heapSize_ = std::stoul(argv[++i]);
+        } else if (arg == "--max-heap-size" and i + 1 < argc) {
+            config.maxHeapSize_ = std::stoul(argv[++i]);
+        } else if (arg == "--gc-threads" and i + 1 < argc) {
+            config.gcThreads_ = std::stoul(argv[++i]);
+        } else if (arg == "--gc-slice-budget" and i + 1 < argc) {
+            config.gcSliceBudget_ = std::stoul(argv[++i]);
+        } else if (arg == "--no-register-instructions") {
+            config.registerInstructions_ = false;
+        } else if (arg == "--no-optimize") {
+            config.optimize_ = false;
+        } else if (arg == "--no-jit") {
+            config.jit_ = false;
+        } else if (arg == "--jit-threshold" and i + 1 < argc) {
+            config.jitThreshold_ = std::stoul(argv[++i]);
+        } else if (arg == "--profile" and i + 1 < argc) {
+            config.profile_ = true;
+            profile = argv[++i];
+        } else if (arg == "--image" and i + 1 < argc) {
+            config.image_ = argv[++i];
+        } else if (arg == "--sample" and i + 1 < argc) {
+            sample = argv[++i];
+        } else if (arg == "--sample-interval" and i + 1 < argc) {
+            sampleInterval = std::stoul(argv[++i]);
+        } else {
+            fname = argv[i];
+        }
     }
-    ebl::Context context;
+    if (not fname) {
+        std::cout << "usage: dofile [--heap-size bytes] [--max-heap-size bytes] "
+                     "[--gc-threads n] [--gc-slice-budget us] "
+                     "[--no-register-instructions] [--no-optimize] "
+                     "[--no-jit] [--jit-threshold calls] [--profile folded-stacks] "
+                     "[--sample folded-stacks] [--sample-interval us] "
+                     "[--image startup-image] <fname>"
+                  << std::endl;
+        return 1;
+    }
+    if (sample) {
+        config.sampleInterval_ = sampleInterval;
+    }
+    ebl::Context context(config);
     auto& env = context.topLevel();
-    std::ifstream t(argv[1]);
+    std::ifstream t(fname);
     std::stringstream buffer;
     buffer << t.rdbuf();
     env.openDLL("libfs");
@@ -30,6 +76,18 @@ int main(int argc, char** argv)
 
         context.writeToFile("bc");
 
+        if (profile) {
+            std::ofstream folded(profile);
+            context.profiler()->writeFolded(folded);
+            std::cout << std::endl;
+            context.profiler()->report(std::cout);
+        }
+
+        if (sample) {
+            std::ofstream folded(sample);
+            context.sampler()->writeFolded(folded);
+        }
+
     } catch (const std::exception& ex) {
         std::cout << "Error:\n" << ex.what() << std::endl;
         return 1;
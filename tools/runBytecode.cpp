@@ -8,14 +8,15 @@
 int main(int argc, char** argv)
 {
     if (argc != 2) {
-        std::cout << "usage: dofile <fname>" << std::endl;
+        std::cout << "usage: run-bytecode <image>" << std::endl;
+        return 1;
     }
     ebl::Context context;
     auto& env = context.topLevel();
     env.openDLL("libfs");
     env.openDLL("libsys");
     try {
-        context.loadFromFile("bc");
+        context.loadFromFile(argv[1]);
     } catch (const std::exception& ex) {
         std::cout << "Error:\n" << ex.what() << std::endl;
         return 1;
@@ -1,11 +1,38 @@
 #!/bin/bash
 
-for filename in ebl/*.test.ebl; do
-    echo $filename
-    if ! ./ebl-dofile $filename; then
-        exit 1
-    fi
-done
+# Runs every test suite with the given ebl-dofile options.
+suites() {
+    for filename in ebl/*.test.ebl; do
+        echo $filename "$@"
+        if ! ./ebl-dofile "$@" $filename; then
+            exit 1
+        fi
+    done
+}
+
+suites
+
+# The collector only marks and compacts in parallel with more than one
+# thread, and a small heap makes full collections happen.
+suites --gc-threads 4
+suites --gc-threads 4 --heap-size 300000
+
+# Marking only runs incrementally with a slice budget, once the heap is half
+# full.
+suites --gc-slice-budget 20 --heap-size 300000
+
+# The heap grows from well below what the tests need, up to a cap.
+suites --heap-size 300000 --max-heap-size 200000000
+
+# Functions are only compiled once they're hot, which the default threshold
+# rarely reaches in the tests.
+suites --jit-threshold 1
+
+# Stack instructions are still compiled without register instructions.
+suites --no-register-instructions
+
+# And without folding, every builtin call reaches the vm.
+suites --no-optimize
 
 if ! ./ebl-dofile "ebl/mandelbrot.ebl"; then
     exit 1
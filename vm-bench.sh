@@ -0,0 +1,20 @@
+#!/bin/bash
+
+# Times each program with and without register instructions. Run from the
+# build directory, like unit-test.sh.
+
+elapsed() {
+    ./ebl-dofile "$@" | grep "execution finished" | sed 's/[^0-9]*\([0-9]*\)ns.*/\1/'
+}
+
+printf "%-24s %12s %12s\n" "program" "stack (ms)" "register (ms)"
+for filename in ebl/*.test.ebl ebl/mandelbrot.ebl ebl/gc-bench.ebl; do
+    stack=$(elapsed --no-register-instructions $filename)
+    register=$(elapsed $filename)
+    if [ -z "$stack" ] || [ -z "$register" ]; then
+        echo "$filename failed"
+        exit 1
+    fi
+    printf "%-24s %12d %12d\n" $(basename $filename) \
+           $((stack / 1000000)) $((register / 1000000))
+done